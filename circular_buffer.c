@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stddef.h>
 #include <assert.h>
@@ -8,6 +9,20 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <linux/mempolicy.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <signal.h>
+#include <sys/resource.h>
 
 // @Comments
 // I thought initially to have one multithreaded version and another without it, but decided not to, because:
@@ -16,26 +31,214 @@
 
 // @Compile Instructions 
 // gcc -O3 -pthread circular_buffer.c
+// gcc -O3 -pthread -DCBUF_BENCHMARK circular_buffer.c -o cbuf_bench   (benchmark instead of the tests, cbuf_bench -h)
+// add -DCBUF_STATS (and -DCBUF_STATS_LATENCY) for circular_buf_get_stats
 
 #define FCBUF_DO_NOT_OVERWRITE   0x0001
 #define FCBUF_OVERWRITE          0x0000
-#define FCBUF_RESIZE_AUTO        0x0002
-#define FCBUF_WRITE_TIMESTAMP    0x0004
+#define FCBUF_RESIZE_AUTO        0x0002 // grow when full instead of refusing the put, see circular_buf_set_resize_limit
+#define FCBUF_WRITE_TIMESTAMP    0x0004 // every put records a coarse monotonic time (ns) for its slot, see circular_buf_find_time
+#define FCBUF_SPSC               0x0008 // single producer / single consumer, lock free (implies FCBUF_DO_NOT_OVERWRITE)
+#define FCBUF_MPMC               0x0010 // multiple producers / multiple consumers, lock free with per slot sequence numbers
+#define FCBUF_MIRRORED           0x0020 // buffer mapped twice back to back, so any run of items is contiguous
+#define FCBUF_BLOCKING_GET       0x0040 // get waits for data instead of returning -1 (see circular_buf_set_timeout)
+#define FCBUF_BLOCKING_PUT       0x0080 // put waits for space instead of returning -1 (implies FCBUF_DO_NOT_OVERWRITE)
+#define FCBUF_RECORDS            0x0100 // variable size records packed in a byte ring (size = bytes, elemSize = biggest record)
+#define FCBUF_POW2               0x0200 // capacity rounded up to a power of two, free running head/tail, lock free size/empty/full
+#define FCBUF_BROADCAST          0x0400 // every subscribed consumer reads every item, see circular_buf_subscribe
+#define FCBUF_PERSISTENT         0x0800 // set by circular_buf_init_file: the buffer and its state live in a mapped file
+#define FCBUF_HUGETLB            0x1000 // buffer in explicit huge pages (MAP_HUGETLB), init fails when none are reserved
+#define FCBUF_THP                0x2000 // buffer in transparent huge pages whenever the kernel can (MADV_HUGEPAGE)
+#define FCBUF_PREFAULT           0x4000 // touch every page of the buffer at init, so no put pays the page fault
+#define FCBUF_SEGMENTED          0x8000 // buffer made of chunks allocated when first written and given back once drained (implies FCBUF_POW2)
+#define FCBUF_SNAPSHOT          0x10000 // per slot sequence numbers so circular_buf_snapshot can read without the lock (implies FCBUF_POW2)
+#define FCBUF_EVENTFD           0x20000 // readable/writable eventfds for epoll loops, see circular_buf_event_fd
+#define FCBUF_SHARED            0x40000 // set by circular_buf_init_shm: header and slots in shared memory, lock free between processes
+
+#define FCBUF_LOCKFREE           (FCBUF_SPSC | FCBUF_MPMC)
 
 #define MAXCBFSIZE 0xFFFFFFFF //uint32_t Max
 #define INCREASESTEPCBUFSIZE 64
 #define NUMBEROFTHREADS 12
+#define CBUF_CACHELINE 64
+#define CBUF_RECORD_ALIGN 4 // FCBUF_RECORDS: headers and payloads start on this boundary
+#define CBUF_RECORD_SKIP 0xFFFFFFFF // FCBUF_RECORDS: header meaning "nothing more until the end, go to offset 0"
+#define CBUF_BROADCAST_CONSUMERS 32 // FCBUF_BROADCAST: most consumers subscribed at once
+#define CBUF_SEQ_WRITING UINT64_MAX // FCBUF_BROADCAST: seq of a slot while its item is being replaced
+#define CBUF_FILE_MAGIC 0x46554243 // FCBUF_PERSISTENT: "CBUF"
+#define CBUF_FILE_VERSION 1
+#define CBUF_FILE_HEADER 64 // FCBUF_PERSISTENT: bytes before the first slot in the file
+#define CBUF_HUGEPAGE (2u << 20) // FCBUF_HUGETLB/FCBUF_THP: buffers are rounded up to this (the default huge page size)
+#define CBUF_NUMA_NODES 1024 // circular_buf_init_numa: highest node + 1 accepted
+#define CBUF_SEGMENT_BYTES (64u << 10) // FCBUF_SEGMENTED: chunks hold the power of two slots that fit in this (at least one)
+#define CBUF_SEGMENT_SPARES 2 // FCBUF_SEGMENTED: drained chunks kept for reuse, the others go back to the OS
+#define CBUF_SNAPSHOT_RETRIES 4 // circular_buf_snapshot: copies started again when producers overwrote part of the previous one
+#define CBUF_EVENT_READABLE 1 // circular_buf_event_fd: there are items to get
+#define CBUF_EVENT_WRITABLE 2 // circular_buf_event_fd: there is room to put
+#define CBUF_SHM_MAGIC 0x4D484342 // FCBUF_SHARED: "BCHM"
+#define CBUF_SHM_VERSION 1
+#define CBUF_SHM_OPEN_WAIT_MS 1000 // circular_buf_init_shm: how long to wait for another process still creating the ring
+#define CBUF_SHM_FREE 0u // FCBUF_SHARED slot states, see circular_buf_put_shm
+#define CBUF_SHM_WRITING 1u
+#define CBUF_SHM_FULL 2u
+#define CBUF_SHM_READING 3u
+#define CBUF_SHM_WORD(pos,state,pid) (((uint64_t)(uint32_t)(pos) << 32) | ((uint64_t)(state) << 30) | (uint64_t)(uint32_t)(pid))
+#define CBUF_SHM_POS(word) ((uint32_t)((word) >> 32))
+#define CBUF_SHM_STATE(word) ((uint32_t)((word) >> 30) & 3u)
+#define CBUF_SHM_PID(word) ((pid_t)((word) & 0x3FFFFFFF))
+
+// Wait strategies of blocking put/get, chosen per ring (circular_buf_set_wait) or per call (circular_buf_put_wait,
+// circular_buf_get_wait). Spinning looks at the ring, then pauses 1, 2, 4 .. CBUF_WAIT_BACKOFF_MAX times before
+// looking again, for the ring's spin budget of rounds.
+#define CBUF_WAIT_PARK           0 // spin the budget, then sleep on the futex (the default, with a budget of 0 rounds)
+#define CBUF_WAIT_SPIN           1 // spin until done or timed out, never gives the CPU away
+#define CBUF_WAIT_YIELD          2 // spin the budget, then sched_yield between looks
+#define CBUF_WAIT_BACKOFF_MAX    64 // most pause instructions between two looks at the ring
+
+// Statistics, compiled in with -DCBUF_STATS (and the latency histograms with -DCBUF_STATS_LATENCY too).
+// Without them every CBUF_STAT_* below expands to nothing and circular_buf_get_stats returns -1.
+// Counters are spread over CBUF_STATS_SHARDS cache lines, each thread always adds to the same one,
+// so counting does not make the threads fight over a line the way the ring itself would.
+#define CBUF_STATS_SHARDS 16
+#define CBUF_STATS_BUCKETS 64 // latency bucket i counts calls that took [2^(i-1), 2^i) ns, bucket 0 is 0 ns
+
+typedef struct {
+	uint64_t puts; // items stored
+	uint64_t gets; // items taken out
+	uint64_t emptyGets; // gets that found nothing (blocking ones only when they give up)
+	uint64_t overwrites;
+	uint64_t lockContended; // lock acquisitions that had to wait for another thread
+	uint64_t lockWaitNs; // time spent waiting for the lock
+	uint64_t highWater; // most items ever seen in the buffer
+	uint64_t waitSpins; // spin rounds of blocking put/get
+	uint64_t waitYields; // sched_yield calls of blocking put/get
+	uint64_t waitParks; // futex sleeps of blocking put/get
+	uint64_t waitNs; // time blocking put/get spent waiting, spinning and yielding included
+	uint64_t putLatency[CBUF_STATS_BUCKETS];
+	uint64_t getLatency[CBUF_STATS_BUCKETS];
+} circular_buf_stats_t;
+
+#ifdef CBUF_STATS
+typedef struct {
+	uint64_t puts;
+	uint64_t gets;
+	uint64_t emptyGets;
+	uint64_t lockContended;
+	uint64_t lockWaitNs;
+	uint64_t waitSpins;
+	uint64_t waitYields;
+	uint64_t waitParks;
+	uint64_t waitNs;
+#ifdef CBUF_STATS_LATENCY
+	uint64_t putLatency[CBUF_STATS_BUCKETS];
+	uint64_t getLatency[CBUF_STATS_BUCKETS];
+#endif
+} __attribute__((aligned(CBUF_CACHELINE))) circular_buf_stat_shard_t;
+#endif
+
+// FCBUF_BROADCAST: one read position per subscribed consumer, each on its own cache line
+typedef struct {
+	uint64_t cursor; // next position this consumer reads
+	uint32_t active;
+} __attribute__((aligned(CBUF_CACHELINE))) circular_buf_cursor_t;
+
+// FCBUF_PERSISTENT: start of the file, followed by the slots at offset CBUF_FILE_HEADER.
+// head and tail are free running positions (the ring is always FCBUF_POW2).
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t elemSize;
+	uint32_t max;
+	uint64_t head;
+	uint64_t tail;
+	uint64_t overwrites;
+	uint32_t flags; // the ones the file was created with
+} circular_buf_file_header_t;
+
+// FCBUF_SHARED: start of the shared memory object. The rest is found through offsets from it, every process
+// maps it wherever it likes. Followed by one state word per slot and by the slots.
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t elemSize;
+	uint32_t max;
+	uint64_t seqOffset;
+	uint64_t slotOffset;
+	uint64_t lost; // items given up because the process writing (or reading) them died
+	uint64_t head __attribute__((aligned(CBUF_CACHELINE)));
+	uint64_t tail __attribute__((aligned(CBUF_CACHELINE)));
+} __attribute__((aligned(CBUF_CACHELINE))) circular_buf_shm_header_t;
 
 // The hidden definition of our circular buffer structure
+// head and tail live on their own cache lines, so in FCBUF_SPSC mode the producer and the consumer
+// do not keep stealing the same line from each other. In FCBUF_SPSC mode head and tail are free running
+// positions (slot = position % max), in the default mode they are plain indexes protected by the mutex.
+// FCBUF_MPMC uses free running positions too, plus one sequence number per slot (see circular_buf_put_mpmc).
+// FCBUF_POW2 makes them free running in the mutex mode as well, and turns position % max into position & mask.
 struct circular_buf_t {
 	uint32_t * buffer;
-	uint32_t head;
-	uint32_t tail;
+	uint64_t * seq; // per slot sequence numbers (FCBUF_MPMC), position + 1 of the item in the slot (FCBUF_BROADCAST, FCBUF_SNAPSHOT)
+	uint64_t * stamps; // put time of each slot, parallel to buffer (FCBUF_WRITE_TIMESTAMP)
+	circular_buf_cursor_t * cursors; // FCBUF_BROADCAST consumers
+	uint32_t cursorSlots; // FCBUF_BROADCAST: cursors[0..cursorSlots) have been used, the producer scans only those
+	circular_buf_file_header_t * file; // FCBUF_PERSISTENT: the mapping, buffer points into it
+	circular_buf_shm_header_t * shm; // FCBUF_SHARED: the mapping, buffer and seq point into it, head and tail live in it
+	uint32_t syncEvery; // FCBUF_PERSISTENT: msync after this many puts, 0 = not by count
+	uint32_t syncMs; // FCBUF_PERSISTENT: msync when the last one is older than this, 0 = not by time
+	uint32_t syncPending; // puts since the last msync
+	uint64_t syncLast; // circular_buf_timestamp of the last msync
+	size_t mapSize; // bytes mapped for the buffer, 0 when it comes from malloc
+	int numaNode; // node the buffer pages are bound to, -1 = wherever they get touched first
+	void ** segments; // FCBUF_SEGMENTED: chunk of each run of segMask + 1 slots, NULL while nothing lives there
+	uint32_t segShift; // FCBUF_SEGMENTED: slot index >> segShift = chunk
+	uint32_t segMask; // FCBUF_SEGMENTED: slots per chunk - 1
+	uint32_t segCount; // FCBUF_SEGMENTED: chunks allocated (spares not included)
+	size_t segBytes; // FCBUF_SEGMENTED: bytes mapped per chunk
+	uint64_t segTail; // FCBUF_SEGMENTED: the chunks behind this position have been looked at by circular_buf_segment_trim
+	void * segSpare[CBUF_SEGMENT_SPARES]; // FCBUF_SEGMENTED: drained chunks waiting to be reused
+	uint32_t segSpares;
+	uint32_t timeoutUs; // how long blocking put/get wait, 0 = forever
+	uint32_t waitStrategy; // CBUF_WAIT_* of blocking put/get
+	uint32_t waitSpins; // rounds blocking put/get spin before yielding or parking
+	uint32_t resizeLimit; // FCBUF_RESIZE_AUTO never grows beyond this many elements
+	uint64_t consumed; // items taken out by consumers so far (mutex modes), lets resize copy without the lock
+	uint32_t recBytes; // FCBUF_RECORDS: bytes in use, headers and padding included
+	uint32_t recCount; // FCBUF_RECORDS: records in the buffer
+	pthread_mutex_t resizeMutex; // one resize at a time, taken before mutex
 	uint32_t max; // max no. of elements
 	uint32_t elemSize;
-	uint32_t overwrites;
+	uint32_t flags;
+	uint32_t mask; // max - 1 (FCBUF_POW2)
+	uint64_t overwrites;
 	pthread_mutex_t mutex;	 
 	bool full;
+	
+	// producer side
+	uint64_t head __attribute__((aligned(CBUF_CACHELINE)));
+	uint64_t tailCache; // last tail seen by the producer (FCBUF_SPSC)
+	uint32_t reserved;  // slots handed out by circular_buf_reserve and not committed yet
+	
+	// consumer side
+	uint64_t tail __attribute__((aligned(CBUF_CACHELINE)));
+	uint64_t headCache; // last head seen by the consumer (FCBUF_SPSC)
+	uint32_t peeked;    // slots handed out by circular_buf_peek and not released yet
+	
+	// blocking put/get: futex event counters, bumped only when somebody is waiting on them
+	uint32_t dataEvent __attribute__((aligned(CBUF_CACHELINE)));
+	uint32_t dataWaiters;
+	uint32_t spaceEvent;
+	uint32_t spaceWaiters;
+	
+	// FCBUF_EVENTFD: the eventfds and whether the next put (get) has to write to them
+	int readFd;
+	int writeFd;
+	uint32_t readArmed;
+	uint32_t writeArmed;
+	
+#ifdef CBUF_STATS
+	uint64_t highWater;
+	circular_buf_stat_shard_t stats[CBUF_STATS_SHARDS];
+#endif
 };
 
 // Opaque circular buffer structure
@@ -43,6 +246,117 @@ typedef struct circular_buf_t circular_buf_t;
 // Handle type, the way users interact with the API
 typedef circular_buf_t* cbuf_handle_t;
 cbuf_handle_t cbufglobal;
+
+// Sharded set of buffers (see circular_buf_set_init)
+typedef struct circular_buf_set_t {
+	uint32_t count; // shards
+	uint32_t elemSize;
+	cbuf_handle_t shards[];
+} circular_buf_set_t;
+typedef circular_buf_set_t* cbuf_set_handle_t;
+
+// Priority ring: lanes of buffers, the highest non empty lane is served first (see circular_buf_prio_init)
+#define CBUF_PRIO_LANES 64 // one bit each in nonEmpty
+
+typedef struct circular_buf_prio_t {
+	uint64_t nonEmpty; // bit i set: lane i may have items
+	uint32_t count; // lanes
+	uint32_t elemSize;
+	uint32_t quota; // a lower lane is served after this many gets in a row from the top one, 0 = never
+	uint32_t streak; // gets in a row from the top lane while lower ones were waiting
+	uint32_t turn; // the starved lanes are served round robin, downwards from this one
+	cbuf_handle_t lanes[];
+} circular_buf_prio_t;
+typedef circular_buf_prio_t* cbuf_prio_handle_t;
+
+#ifdef CBUF_STATS
+#define CBUF_STAT_ADD(cbuf, field, n)         __atomic_fetch_add(&circular_buf_stat_shard(cbuf)->field,(n),__ATOMIC_RELAXED)
+#define CBUF_STAT_HIGH_WATER(cbuf, size)      circular_buf_stat_high_water(cbuf,size)
+#else
+#define CBUF_STAT_ADD(cbuf, field, n)         ((void)0)
+#define CBUF_STAT_HIGH_WATER(cbuf, size)      ((void)0)
+#endif
+#if defined(CBUF_STATS) && defined(CBUF_STATS_LATENCY)
+#define CBUF_STAT_CLOCK(start)                uint64_t start = circular_buf_now_ns()
+#define CBUF_STAT_LATENCY(cbuf, hist, start)  circular_buf_stat_latency(circular_buf_stat_shard(cbuf)->hist,circular_buf_now_ns() - (start))
+#else
+#define CBUF_STAT_CLOCK(start)                ((void)0)
+#define CBUF_STAT_LATENCY(cbuf, hist, start)  ((void)0)
+#endif
+
+// In place scans (circular_buf_scan) and the aggregates over them (circular_buf_aggregate).
+// A visitor gets n items starting at items, oldest first, and returns 0 to go on, anything else to stop.
+typedef int (*circular_buf_visit_t)(const void * items, uint32_t n, void * arg);
+
+#define CBUF_TYPE_U32            0 // element types of circular_buf_aggregate
+#define CBUF_TYPE_I32            1
+#define CBUF_TYPE_F32            2
+#define CBUF_TYPE_F64            3
+#define CBUF_AGGREGATE_LANES     8 // independent accumulators per kernel, what lets the compiler keep them in vector registers
+
+typedef struct {
+	uint32_t count; // items
+	uint32_t matches; // items with lo <= value <= hi (count if)
+	double min; // +inf when there are no items (or only NaNs), every 32 bit value and double is exact
+	double max; // -inf when there are no items (or only NaNs)
+	double sum; // floats are summed in double, NaNs left out
+	int64_t isum; // CBUF_TYPE_U32 / CBUF_TYPE_I32: the exact sum
+} circular_buf_aggregate_t;
+
+// Typed rings, specialized at compile time.
+// CIRCULAR_BUF_DEFINE(name, type, capacity) generates name##_t and its functions for a single producer /
+// single consumer ring of capacity items of type, with capacity a power of two. Element size and capacity
+// are constants, so put/get compile to one load and one store of the item, the slot is position & (capacity - 1)
+// and there is no wrap branch at all. head and tail run freely as uint32_t (capacity divides 2^32, so
+// head - tail is the size even after they overflow). Like FCBUF_SPSC, put returns -1 when full, it never
+// overwrites. The runtime sized circular_buf_t stays the generic version for everything else.
+//   CIRCULAR_BUF_DEFINE(cbuf_u32, uint32_t, 4096)
+//   static cbuf_u32_t ring;  cbuf_u32_init(&ring);  cbuf_u32_put(&ring,42);  cbuf_u32_get(&ring,&data);
+#define CIRCULAR_BUF_DEFINE(name, type, capacity)                                                   \
+_Static_assert((capacity) > 0 && ((capacity) & ((capacity) - 1)) == 0, #name ": capacity must be a power of two"); \
+typedef struct name##_t {                                                                           \
+	uint32_t head __attribute__((aligned(CBUF_CACHELINE)));                                         \
+	uint32_t tailCache;                                                                             \
+	uint32_t tail __attribute__((aligned(CBUF_CACHELINE)));                                         \
+	uint32_t headCache;                                                                             \
+	type buffer[capacity] __attribute__((aligned(CBUF_CACHELINE)));                                 \
+} name##_t;                                                                                         \
+static inline void name##_init(name##_t * cbuf)                                                     \
+{                                                                                                   \
+	cbuf->head = cbuf->tail = cbuf->tailCache = cbuf->headCache = 0;                                \
+}                                                                                                   \
+static inline int name##_put(name##_t * cbuf, type item)                                            \
+{                                                                                                   \
+	uint32_t head = cbuf->head;                                                                     \
+	if (head - cbuf->tailCache == (capacity))                                                       \
+	{                                                                                               \
+		cbuf->tailCache = __atomic_load_n(&cbuf->tail,__ATOMIC_ACQUIRE);                            \
+		if (head - cbuf->tailCache == (capacity)) return -1;                                        \
+	}                                                                                               \
+	cbuf->buffer[head & ((capacity) - 1)] = item;                                                   \
+	__atomic_store_n(&cbuf->head,head + 1,__ATOMIC_RELEASE);                                        \
+	return 0;                                                                                       \
+}                                                                                                   \
+static inline int name##_get(name##_t * cbuf, type * item)                                          \
+{                                                                                                   \
+	uint32_t tail = cbuf->tail;                                                                     \
+	if (tail == cbuf->headCache)                                                                    \
+	{                                                                                               \
+		cbuf->headCache = __atomic_load_n(&cbuf->head,__ATOMIC_ACQUIRE);                            \
+		if (tail == cbuf->headCache) return -1;                                                     \
+	}                                                                                               \
+	*item = cbuf->buffer[tail & ((capacity) - 1)];                                                  \
+	__atomic_store_n(&cbuf->tail,tail + 1,__ATOMIC_RELEASE);                                        \
+	return 0;                                                                                       \
+}                                                                                                   \
+static inline uint32_t name##_size(name##_t * cbuf)                                                 \
+{                                                                                                   \
+	uint32_t tail = __atomic_load_n(&cbuf->tail,__ATOMIC_ACQUIRE);                                  \
+	return __atomic_load_n(&cbuf->head,__ATOMIC_ACQUIRE) - tail;                                    \
+}                                                                                                   \
+static inline bool name##_empty(name##_t * cbuf) { return name##_size(cbuf) == 0; }                 \
+static inline bool name##_full(name##_t * cbuf) { return name##_size(cbuf) == (capacity); }         \
+static inline uint32_t name##_capacity(name##_t * cbuf) { (void)cbuf; return (capacity); }
 //#include "circular_buffer.h" // putting all together in .c file instead of having .h separated
 // https://embeddedartistry.com/blog/2017/05/17/creating-a-circular-buffer-in-c-and-c/
 
@@ -51,595 +365,5121 @@ pthread_t threadsPut[NUMBEROFTHREADS];
 uint32_t count[NUMBEROFTHREADS];
 uint32_t countPut[NUMBEROFTHREADS];
 cbuf_handle_t circular_buf_init(uint32_t size, uint32_t elemSize);
+cbuf_handle_t circular_buf_init_flags(uint32_t size, uint32_t elemSize, uint32_t flags);
+cbuf_handle_t circular_buf_init_numa(uint32_t size, uint32_t elemSize, uint32_t flags, int node);
+static void *circular_buf_map_anon(cbuf_handle_t cbuf, size_t bytes, size_t * mapSize);
+static int circular_buf_place(cbuf_handle_t cbuf, void * p, size_t bytes);
 
 void circular_buf_free(cbuf_handle_t cbuf);
 bool circular_buf_full(cbuf_handle_t cbuf);
 bool circular_buf_empty(cbuf_handle_t cbuf);
 uint32_t circular_buf_capacity(cbuf_handle_t cbuf);
 uint32_t circular_buf_size(cbuf_handle_t cbuf);
-uint32_t circular_buf_get_overwrites(cbuf_handle_t cbuf);
+uint64_t circular_buf_get_overwrites(cbuf_handle_t cbuf);
+size_t circular_buf_get_resident(cbuf_handle_t cbuf);
+static uint32_t circular_buf_size_locked(cbuf_handle_t cbuf);
+static inline bool circular_buf_full_locked(cbuf_handle_t cbuf);
+static inline uint32_t circular_buf_index(cbuf_handle_t cbuf, uint64_t pos);
+static inline uint64_t circular_buf_forward(cbuf_handle_t cbuf, uint64_t pos, uint32_t n);
 
 static void circular_buf_reset(cbuf_handle_t cbuf);
+static int circular_buf_alloc_buffer(cbuf_handle_t cbuf);
+cbuf_handle_t circular_buf_init_file(const char * path, uint32_t size, uint32_t elemSize, uint32_t flags);
+cbuf_handle_t circular_buf_init_shm(const char * name, uint32_t size, uint32_t elemSize, uint32_t flags);
+static int circular_buf_put_shm(cbuf_handle_t cbuf, const void * data);
+static int circular_buf_get_shm(cbuf_handle_t cbuf, void * data);
+int circular_buf_sync(cbuf_handle_t cbuf);
+void circular_buf_set_sync(cbuf_handle_t cbuf, uint32_t everyPuts, uint32_t everyMs);
+static inline void circular_buf_persist(cbuf_handle_t cbuf);
+static void circular_buf_sync_maybe(cbuf_handle_t cbuf, uint32_t puts);
+static uint32_t circular_buf_round_pow2(uint32_t size);
+static void circular_buf_free_buffer(cbuf_handle_t cbuf);
+static inline void circular_buf_copy_elem(cbuf_handle_t cbuf, void * dst, const void * src);
+static char *circular_buf_segment_slot(cbuf_handle_t cbuf, uint32_t index, bool alloc);
+static int circular_buf_segment_alloc(cbuf_handle_t cbuf, uint32_t index, uint32_t count);
+static void circular_buf_segment_copy(cbuf_handle_t cbuf, uint32_t index, char * data, uint32_t count, bool in);
+static void circular_buf_segment_trim(cbuf_handle_t cbuf);
 static void advance_pointer(cbuf_handle_t cbuf);
 static void retreat_pointer(cbuf_handle_t cbuf);
 
-void circular_buf_put(cbuf_handle_t cbuf, const void * data);
+int circular_buf_put(cbuf_handle_t cbuf, const void * data);
 int circular_buf_get(cbuf_handle_t cbuf, void * data);
+int circular_buf_put_timed(cbuf_handle_t cbuf, const void * data, uint32_t timeoutUs);
+int circular_buf_get_timed(cbuf_handle_t cbuf, void * data, uint32_t timeoutUs);
+void circular_buf_set_timeout(cbuf_handle_t cbuf, uint32_t timeoutUs);
+void circular_buf_set_wait(cbuf_handle_t cbuf, uint32_t strategy, uint32_t spins);
+int circular_buf_put_wait(cbuf_handle_t cbuf, const void * data, uint32_t timeoutUs, uint32_t strategy);
+int circular_buf_get_wait(cbuf_handle_t cbuf, void * data, uint32_t timeoutUs, uint32_t strategy);
+static int circular_buf_wait(cbuf_handle_t cbuf, void * data, bool put, uint32_t timeoutUs, uint32_t strategy);
+static inline void circular_buf_cpu_relax(void);
+static int circular_buf_try_put(cbuf_handle_t cbuf, const void * data);
+static int circular_buf_try_get(cbuf_handle_t cbuf, void * data);
+static int circular_buf_put_mutex(cbuf_handle_t cbuf, const void * data);
+static int circular_buf_get_mutex(cbuf_handle_t cbuf, void * data);
+int circular_buf_subscribe(cbuf_handle_t cbuf);
+void circular_buf_unsubscribe(cbuf_handle_t cbuf, int consumer);
+int circular_buf_get_from(cbuf_handle_t cbuf, int consumer, void * data, uint64_t * missed);
+uint32_t circular_buf_snapshot(cbuf_handle_t cbuf, void * data, uint32_t n);
+static inline void circular_buf_seq_begin(cbuf_handle_t cbuf, uint64_t pos, uint32_t count);
+static inline void circular_buf_seq_end(cbuf_handle_t cbuf, uint64_t pos, uint32_t count);
+static int circular_buf_put_broadcast(cbuf_handle_t cbuf, const void * data);
+static uint64_t circular_buf_slowest_cursor(cbuf_handle_t cbuf, uint64_t head);
+static void circular_buf_wake(uint32_t * event, uint32_t * waiters, uint32_t count);
+int circular_buf_event_fd(cbuf_handle_t cbuf, uint32_t event);
+void circular_buf_event_ack(cbuf_handle_t cbuf, uint32_t event);
+static int circular_buf_open_events(cbuf_handle_t cbuf);
+static void circular_buf_signal(int fd, uint32_t * armed);
+static int circular_buf_futex_wait(uint32_t * event, uint32_t seen, const struct timespec * deadline);
 int circular_buf_resize(cbuf_handle_t cbuf, uint32_t newsize);
+int circular_buf_put_record(cbuf_handle_t cbuf, const void * data, uint32_t len);
+int circular_buf_get_record(cbuf_handle_t cbuf, void * data);
+static int circular_buf_put_record_mutex(cbuf_handle_t cbuf, const void * data, uint32_t len);
+static int circular_buf_get_record_mutex(cbuf_handle_t cbuf, void * data);
+static void circular_buf_drop_record(cbuf_handle_t cbuf);
+void circular_buf_set_resize_limit(cbuf_handle_t cbuf, uint32_t limit);
+uint64_t circular_buf_timestamp(void);
+static uint64_t circular_buf_now_ns(void);
+static inline void circular_buf_lock(cbuf_handle_t cbuf);
+#ifdef CBUF_STATS
+static circular_buf_stat_shard_t *circular_buf_stat_shard(cbuf_handle_t cbuf);
+static void circular_buf_stat_high_water(cbuf_handle_t cbuf, uint64_t size);
+#ifdef CBUF_STATS_LATENCY
+static void circular_buf_stat_latency(uint64_t * hist, uint64_t ns);
+#endif
+#endif
+int circular_buf_get_stats(cbuf_handle_t cbuf, circular_buf_stats_t * stats);
+void circular_buf_reset_stats(cbuf_handle_t cbuf);
+int circular_buf_find_time(cbuf_handle_t cbuf, uint64_t from, uint64_t to, uint32_t * first, uint32_t * last);
+uint32_t circular_buf_read_at(cbuf_handle_t cbuf, uint32_t offset, void * data, uint32_t n);
+int circular_buf_scan(cbuf_handle_t cbuf, circular_buf_visit_t visit, void * arg);
+int circular_buf_aggregate(cbuf_handle_t cbuf, uint32_t type, const void * lo, const void * hi, circular_buf_aggregate_t * agg);
+static int circular_buf_aggregate_visit(const void * items, uint32_t n, void * arg);
+static void circular_buf_stamp(cbuf_handle_t cbuf, uint64_t pos, uint32_t n);
+static uint32_t circular_buf_search_time(cbuf_handle_t cbuf, uint32_t size, uint64_t t, bool after);
+static int circular_buf_grow(cbuf_handle_t cbuf, uint32_t needed);
+static void circular_buf_copy_ring(uint32_t elemSize, char * dst, uint32_t dstMax, uint32_t dstIndex, const char * src, uint32_t srcMax, uint32_t srcIndex, uint32_t count);
+uint32_t circular_buf_put_n(cbuf_handle_t cbuf, const void * data, uint32_t n);
+uint32_t circular_buf_get_n(cbuf_handle_t cbuf, void * data, uint32_t n);
+void *circular_buf_reserve(cbuf_handle_t cbuf, uint32_t * n);
+int circular_buf_commit(cbuf_handle_t cbuf, uint32_t n);
+void *circular_buf_peek(cbuf_handle_t cbuf, uint32_t * n);
+int circular_buf_release(cbuf_handle_t cbuf, uint32_t n);
+
+static uint32_t circular_buf_try_put_n(cbuf_handle_t cbuf, const void * data, uint32_t n);
+static uint32_t circular_buf_try_get_n(cbuf_handle_t cbuf, void * data, uint32_t n);
+static uint32_t circular_buf_put_n_mutex(cbuf_handle_t cbuf, const char * src, uint32_t n);
+static void circular_buf_copy_in(cbuf_handle_t cbuf, uint32_t index, const char * src, uint32_t count);
+static void circular_buf_copy_out(cbuf_handle_t cbuf, uint32_t index, char * dst, uint32_t count);
+
+static int circular_buf_put_spsc(cbuf_handle_t cbuf, const void * data);
+static int circular_buf_get_spsc(cbuf_handle_t cbuf, void * data);
+static int circular_buf_put_mpmc(cbuf_handle_t cbuf, const void * data);
+static int circular_buf_get_mpmc(cbuf_handle_t cbuf, void * data);
+static int circular_buf_drop_oldest_mpmc(cbuf_handle_t cbuf);
+static uint32_t circular_buf_put_n_spsc(cbuf_handle_t cbuf, const char * data, uint32_t n);
+static uint32_t circular_buf_get_n_spsc(cbuf_handle_t cbuf, char * data, uint32_t n);
+static uint32_t circular_buf_put_n_mpmc(cbuf_handle_t cbuf, const char * data, uint32_t n);
+static uint32_t circular_buf_get_n_mpmc(cbuf_handle_t cbuf, char * data, uint32_t n);
+
+cbuf_set_handle_t circular_buf_set_init(uint32_t shards, uint32_t size, uint32_t elemSize, uint32_t flags);
+void circular_buf_set_free(cbuf_set_handle_t set);
+int circular_buf_set_put(cbuf_set_handle_t set, const void * data);
+int circular_buf_set_put_to(cbuf_set_handle_t set, uint32_t shard, const void * data);
+int circular_buf_set_get(cbuf_set_handle_t set, void * data);
+uint32_t circular_buf_set_get_n(cbuf_set_handle_t set, void * data, uint32_t n);
+uint32_t circular_buf_set_size(cbuf_set_handle_t set);
+cbuf_handle_t circular_buf_set_shard(cbuf_set_handle_t set, uint32_t shard);
+static uint32_t circular_buf_set_local(cbuf_set_handle_t set);
+
+cbuf_prio_handle_t circular_buf_prio_init(uint32_t lanes, uint32_t size, uint32_t elemSize, uint32_t flags);
+void circular_buf_prio_free(cbuf_prio_handle_t prio);
+int circular_buf_prio_put(cbuf_prio_handle_t prio, uint32_t lane, const void * data);
+int circular_buf_prio_get(cbuf_prio_handle_t prio, void * data, uint32_t * lane);
+void circular_buf_prio_set_quota(cbuf_prio_handle_t prio, uint32_t quota);
+uint32_t circular_buf_prio_size(cbuf_prio_handle_t prio);
+cbuf_handle_t circular_buf_prio_lane(cbuf_prio_handle_t prio, uint32_t lane);
+static uint32_t circular_buf_prio_starved(cbuf_prio_handle_t prio, uint64_t lower);
 
 void *circular_buf_get_all(void* param);
 void *circular_buf_put_all_sleep(void* param);
 void *circular_buf_get_all_sleep(void* param);
 
 
+// Grows the buffer to newsize elements keeping the items and their order, also when they wrap.
+// The new buffer is allocated and filled without holding the lock: the items are copied from a snapshot
+// of tail/size while producers and consumers carry on. Then, under the lock, only what changed meanwhile is
+// fixed up: items consumed during the copy are simply skipped (the new tail starts after them) and items put
+// during the copy are appended. If something was overwritten during the copy the snapshot can not be trusted
+// and everything is copied again under the lock. The old buffer is freed after the lock is released.
+// With FCBUF_POW2 head and tail keep running: only the index mapping changes, each item moves to
+// pos & (newsize - 1). Without it the items are rebased to start at index 0.
+// Not available in FCBUF_SPSC/FCBUF_MPMC/FCBUF_MIRRORED modes, nor while a reserve or peek is outstanding
+// (checked again before the swap, one may have started during the copy).
 int circular_buf_resize(cbuf_handle_t cbuf, uint32_t newsize)
 {
+  char *newbuf, *old;
+  size_t newMapSize = 0, oldMapSize;
+  uint64_t *newstamps = NULL, *oldstamps;
+  uint32_t oldmax, tail0, size0, size1, base;
+  uint64_t consumed0, overwrites0, consumed, tailPos0;
+  bool pow2 = (cbuf->flags & FCBUF_POW2) != 0;
   
-  pthread_mutex_lock(&cbuf->mutex);
-  if ( (newsize > circular_buf_capacity(cbuf) ) && ( newsize + circular_buf_capacity(cbuf) < MAXCBFSIZE ) ) {
-	  
-    cbuf->buffer = realloc(cbuf->buffer,(newsize*cbuf->elemSize));
-    cbuf->max = newsize;
-    cbuf->full = false;
-    
+  if (cbuf->flags & (FCBUF_LOCKFREE|FCBUF_SHARED)) return -1; // there is no lock to stop the other side while the buffer moves
+  if (cbuf->flags & FCBUF_MIRRORED) return -1; // mappings can not be realloc'ed
+  if (cbuf->flags & (FCBUF_RECORDS|FCBUF_BROADCAST|FCBUF_PERSISTENT|FCBUF_SEGMENTED)) return -1;
+  if (cbuf->flags & FCBUF_SNAPSHOT) return -1; // a snapshot may be reading the old buffer at any time
+  if ( (cbuf->flags & FCBUF_POW2) && (newsize = circular_buf_round_pow2(newsize)) == 0 ) return -1;
+  
+  pthread_mutex_lock(&cbuf->resizeMutex);
+  circular_buf_lock(cbuf);
+  if ( (newsize <= circular_buf_capacity(cbuf) ) || ( (uint64_t)newsize + circular_buf_capacity(cbuf) >= MAXCBFSIZE ) || cbuf->reserved || cbuf->peeked ) {
     pthread_mutex_unlock(&cbuf->mutex);
-    return 0; 
-    }
+    pthread_mutex_unlock(&cbuf->resizeMutex);
+    return -1;
+  }
+  old = (char *)cbuf->buffer;
+  oldMapSize = cbuf->mapSize;
+  oldstamps = cbuf->stamps;
+  oldmax = cbuf->max;
+  tailPos0 = cbuf->tail;
+  tail0 = circular_buf_index(cbuf,tailPos0);
+  size0 = circular_buf_size_locked(cbuf);
+  consumed0 = cbuf->consumed;
+  overwrites0 = cbuf->overwrites;
+  pthread_mutex_unlock(&cbuf->mutex);
+  
+  if (oldMapSize) // same huge page / NUMA / prefault treatment as the first one
+    newbuf = circular_buf_map_anon(cbuf,(size_t)newsize*cbuf->elemSize,&newMapSize);
+  else
+    newbuf = malloc((size_t)newsize*cbuf->elemSize);
+  if (oldstamps) newstamps = malloc((size_t)newsize*sizeof(uint64_t));
+  if (newbuf == NULL || (oldstamps && newstamps == NULL)) {
+    if (newMapSize) munmap(newbuf,newMapSize);
+    else free(newbuf);
+    free(newstamps);
+    pthread_mutex_unlock(&cbuf->resizeMutex);
+    return -1;
+  }
+  base = pow2 ? (uint32_t)(tailPos0 & (newsize - 1)) : 0; // where the snapshot tail lands in newbuf
+  circular_buf_copy_ring(cbuf->elemSize,newbuf,newsize,base,old,oldmax,tail0,size0);
+  if (oldstamps) circular_buf_copy_ring(sizeof(uint64_t),(char *)newstamps,newsize,base,(char *)oldstamps,oldmax,tail0,size0);
+  
+  circular_buf_lock(cbuf);
+  if (cbuf->reserved || cbuf->peeked) {
+    // somebody got a pointer into the old buffer while we were copying, it has to stay
+    pthread_mutex_unlock(&cbuf->mutex);
+    pthread_mutex_unlock(&cbuf->resizeMutex);
+    if (newMapSize) munmap(newbuf,newMapSize);
+    else free(newbuf);
+    free(newstamps);
+    return -1;
+  }
+  size1 = circular_buf_size_locked(cbuf);
+  consumed = cbuf->consumed - consumed0;
+  
+  if (cbuf->overwrites != overwrites0 || consumed >= size0)
+  {
+    // nothing usable in the snapshot
+    base = pow2 ? (uint32_t)(cbuf->tail & (newsize - 1)) : 0;
+    circular_buf_copy_ring(cbuf->elemSize,newbuf,newsize,base,old,oldmax,circular_buf_index(cbuf,cbuf->tail),size1);
+    if (oldstamps) circular_buf_copy_ring(sizeof(uint64_t),(char *)newstamps,newsize,base,(char *)oldstamps,oldmax,circular_buf_index(cbuf,cbuf->tail),size1);
+  }
+  else
+  {
+    // newbuf[base+consumed..base+size0) still holds live items, the ones put after the snapshot follow them
+    uint32_t keep = size0 - (uint32_t)consumed;
+    circular_buf_copy_ring(cbuf->elemSize,newbuf,newsize,(base + size0) % newsize,old,oldmax,(circular_buf_index(cbuf,cbuf->tail) + keep) % oldmax,size1 - keep);
+    if (oldstamps) circular_buf_copy_ring(sizeof(uint64_t),(char *)newstamps,newsize,(base + size0) % newsize,(char *)oldstamps,oldmax,(circular_buf_index(cbuf,cbuf->tail) + keep) % oldmax,size1 - keep);
+    base = (uint32_t)((base + consumed) % newsize);
+  }
+  
+  cbuf->buffer = (uint32_t *)newbuf;
+  cbuf->mapSize = newMapSize;
+  cbuf->stamps = newstamps;
+  cbuf->max = newsize;
+  cbuf->mask = newsize - 1;
+  if (!pow2)
+  {
+    // size1 < newsize, so the head never wraps onto the tail
+    cbuf->tail = base;
+    cbuf->head = (base + size1) % newsize;
+  }
+  cbuf->full = false;
+  
   pthread_mutex_unlock(&cbuf->mutex);
-  return -1;
+  pthread_mutex_unlock(&cbuf->resizeMutex);
+  if (oldMapSize) munmap(old,oldMapSize);
+  else free(old);
+  free(oldstamps);
+  return 0; 
 }
 
-cbuf_handle_t circular_buf_init(uint32_t size,uint32_t elemSize)
+// FCBUF_RESIZE_AUTO: grows a full buffer geometrically (doubling, at least INCREASESTEPCBUFSIZE elements)
+// up to resizeLimit. Returns 0 when the buffer is bigger than before, by us or by somebody else.
+static int circular_buf_grow(cbuf_handle_t cbuf, uint32_t needed)
 {
-	if ( size > MAXCBFSIZE ) return NULL;
-	  
-	cbuf_handle_t cbuf = malloc(sizeof(circular_buf_t));
-	cbuf->buffer = malloc(size*elemSize);
-    
-	cbuf->max = size;
-	circular_buf_reset(cbuf);
-    cbuf->elemSize = elemSize;   
-    pthread_mutex_init(&cbuf->mutex,NULL);
-	assert(circular_buf_empty(cbuf));
+  uint32_t cap = __atomic_load_n(&cbuf->max,__ATOMIC_RELAXED);
+  uint64_t newsize = (uint64_t)cap + (cap > INCREASESTEPCBUFSIZE ? cap : INCREASESTEPCBUFSIZE);
+  
+  if (newsize < needed) newsize = needed;
+  if (newsize > cbuf->resizeLimit) newsize = cbuf->resizeLimit;
+  if (newsize <= cap) return -1;
+  
+  if (circular_buf_resize(cbuf,(uint32_t)newsize) == 0) return 0;
+  return (__atomic_load_n(&cbuf->max,__ATOMIC_RELAXED) > cap) ? 0 : -1;
+}
 
-	return cbuf;
+void circular_buf_set_resize_limit(cbuf_handle_t cbuf, uint32_t limit)
+{
+  assert(cbuf);
+  cbuf->resizeLimit = limit;
 }
 
-static void circular_buf_reset(cbuf_handle_t cbuf)
+// Bulk put: stores n elements (data is an array of n * elemSize bytes) taking the lock once.
+// In overwrite mode all n items are accepted and the oldest ones are overwritten as needed, with
+// FCBUF_DO_NOT_OVERWRITE only the free space is filled. Returns how many items were stored.
+uint32_t circular_buf_put_n(cbuf_handle_t cbuf, const void * data, uint32_t n)
 {
-    assert(cbuf);
+	CBUF_STAT_CLOCK(start);
+	uint32_t count = circular_buf_try_put_n(cbuf,data,n);
+	
+	CBUF_STAT_ADD(cbuf,puts,count);
+	if (cbuf->flags & (FCBUF_LOCKFREE|FCBUF_SHARED)) CBUF_STAT_HIGH_WATER(cbuf,circular_buf_size(cbuf));
+	if (cbuf->file && count > 0) circular_buf_sync_maybe(cbuf,count);
+	CBUF_STAT_LATENCY(cbuf,putLatency,start);
+	if (count > 0 && (cbuf->flags & FCBUF_BLOCKING_GET))
+		circular_buf_wake(&cbuf->dataEvent,&cbuf->dataWaiters,count);
+	if (count > 0 && (cbuf->flags & FCBUF_EVENTFD))
+		circular_buf_signal(cbuf->readFd,&cbuf->readArmed);
+	return count;
+}
 
-    cbuf->head = 0;
-    cbuf->tail = 0;
-    cbuf->full = false;
-    cbuf->overwrites = 0;
+static uint32_t circular_buf_try_put_n(cbuf_handle_t cbuf, const void * data, uint32_t n)
+{
+	const char *src = data;
+	uint32_t count;
+	
+	assert(cbuf && (data || n == 0));
+	
+	if (n == 0 || (cbuf->flags & FCBUF_RECORDS)) return 0;
+	if (cbuf->flags & FCBUF_SHARED)
+	{
+		for (count = 0; count < n && circular_buf_put_shm(cbuf,src + (size_t)count*cbuf->elemSize) == 0; count++)
+			;
+		return count;
+	}
+	if (cbuf->flags & FCBUF_SPSC) return circular_buf_put_n_spsc(cbuf,src,n);
+	if (cbuf->flags & FCBUF_MPMC) return circular_buf_put_n_mpmc(cbuf,src,n);
+	if (cbuf->flags & FCBUF_BROADCAST)
+	{
+		for (count = 0; count < n && circular_buf_put_broadcast(cbuf,src + (size_t)count*cbuf->elemSize) == 0; count++)
+			;
+		return count;
+	}
+	
+	count = circular_buf_put_n_mutex(cbuf,src,n);
+	while (count < n && (cbuf->flags & FCBUF_RESIZE_AUTO) && circular_buf_grow(cbuf,circular_buf_size(cbuf) + (n - count)) == 0)
+		count += circular_buf_put_n_mutex(cbuf,src + (size_t)count*cbuf->elemSize,n - count);
+	return count;
 }
 
-void circular_buf_free(cbuf_handle_t cbuf)
+static uint32_t circular_buf_put_n_mutex(cbuf_handle_t cbuf, const char * src, uint32_t n)
 {
-	assert(cbuf);
-	free(cbuf->buffer);
-	pthread_mutex_destroy(&cbuf->mutex);
-	free(cbuf);
+	uint32_t size;
+	bool keep; // nothing gets overwritten
+	
+	circular_buf_lock(cbuf);
+	
+	if (cbuf->reserved)
+	{
+		// the slots at head are handed out
+		pthread_mutex_unlock(&cbuf->mutex);
+		return 0;
+	}
+	
+	uint32_t count = n;
+	size = circular_buf_size_locked(cbuf);
+	keep = (cbuf->flags & FCBUF_DO_NOT_OVERWRITE) || cbuf->peeked; // a peeked item is never overwritten
+	
+	if (keep)
+	{
+		if (count > cbuf->max - size) count = cbuf->max - size;
+	}
+	else if (count > cbuf->max)
+	{
+		// only the last max items can survive, do not even copy the others
+		src += (size_t)(count - cbuf->max)*cbuf->elemSize;
+		count = cbuf->max;
+	}
+	
+	if (count > 0 && cbuf->segments && circular_buf_segment_alloc(cbuf,circular_buf_index(cbuf,cbuf->head),count) != 0)
+	{
+		pthread_mutex_unlock(&cbuf->mutex);
+		return 0;
+	}
+	
+	// items in the buffer plus items offered, whatever exceeds max overwrites the oldest ones
+	uint64_t total = (uint64_t)size + (keep ? count : n);
+	
+	if (count > 0)
+	{
+		if (cbuf->seq) circular_buf_seq_begin(cbuf,cbuf->head,count);
+		circular_buf_copy_in(cbuf,circular_buf_index(cbuf,cbuf->head),src,count);
+		if (cbuf->seq) circular_buf_seq_end(cbuf,cbuf->head,count);
+		if (cbuf->stamps) circular_buf_stamp(cbuf,cbuf->head,count);
+		__atomic_store_n(&cbuf->head,circular_buf_forward(cbuf,cbuf->head,count),__ATOMIC_RELEASE);
+		
+		if (total >= cbuf->max)
+		{
+			cbuf->overwrites += total - cbuf->max; // 0 when exactly filled
+			if (cbuf->flags & FCBUF_POW2)
+				__atomic_store_n(&cbuf->tail,cbuf->head - cbuf->max,__ATOMIC_RELEASE);
+			else
+				cbuf->tail = cbuf->head;
+			cbuf->full = true;
+			if (cbuf->segments) circular_buf_segment_trim(cbuf);
+		}
+	}
+	circular_buf_persist(cbuf);
+	CBUF_STAT_HIGH_WATER(cbuf,circular_buf_size_locked(cbuf));
+	
+	pthread_mutex_unlock(&cbuf->mutex);
+	
+	return keep ? count : n;
 }
 
-bool circular_buf_full(cbuf_handle_t cbuf)
+// Bulk get: reads up to n elements into data (an array of n * elemSize bytes) taking the lock once.
+// Returns how many items were read, 0 when the buffer is empty.
+// Neither bulk call blocks, even with FCBUF_BLOCKING_GET / FCBUF_BLOCKING_PUT, but they do wake the waiters.
+uint32_t circular_buf_get_n(cbuf_handle_t cbuf, void * data, uint32_t n)
 {
-	assert(cbuf);
-	return cbuf->full;
+	CBUF_STAT_CLOCK(start);
+	uint32_t count = circular_buf_try_get_n(cbuf,data,n);
+	
+	if (count > 0) CBUF_STAT_ADD(cbuf,gets,count);
+	else if (n > 0) CBUF_STAT_ADD(cbuf,emptyGets,1);
+	CBUF_STAT_LATENCY(cbuf,getLatency,start);
+	if (count > 0 && (cbuf->flags & FCBUF_BLOCKING_PUT))
+		circular_buf_wake(&cbuf->spaceEvent,&cbuf->spaceWaiters,count);
+	if (count > 0 && (cbuf->flags & FCBUF_EVENTFD))
+		circular_buf_signal(cbuf->writeFd,&cbuf->writeArmed);
+	return count;
 }
 
-uint32_t circular_buf_capacity(cbuf_handle_t cbuf)
+static uint32_t circular_buf_try_get_n(cbuf_handle_t cbuf, void * data, uint32_t n)
 {
-	assert(cbuf);
-	return cbuf->max;
+	uint32_t count;
+	
+	assert(cbuf && (data || n == 0));
+	
+	if (n == 0 || (cbuf->flags & (FCBUF_RECORDS|FCBUF_BROADCAST))) return 0;
+	if (cbuf->flags & FCBUF_SHARED)
+	{
+		for (count = 0; count < n && circular_buf_get_shm(cbuf,(char *)data + (size_t)count*cbuf->elemSize) == 0; count++)
+			;
+		return count;
+	}
+	if (cbuf->flags & FCBUF_SPSC) return circular_buf_get_n_spsc(cbuf,data,n);
+	if (cbuf->flags & FCBUF_MPMC) return circular_buf_get_n_mpmc(cbuf,data,n);
+	
+	circular_buf_lock(cbuf);
+	
+	count = cbuf->peeked ? 0 : circular_buf_size_locked(cbuf); // the oldest items are being peeked at
+	if (count > n) count = n;
+	
+	if (count > 0)
+	{
+		circular_buf_copy_out(cbuf,circular_buf_index(cbuf,cbuf->tail),data,count);
+		__atomic_store_n(&cbuf->tail,circular_buf_forward(cbuf,cbuf->tail,count),__ATOMIC_RELEASE);
+		cbuf->full = false;
+		cbuf->consumed += count;
+		if (cbuf->segments) circular_buf_segment_trim(cbuf);
+		circular_buf_persist(cbuf);
+	}
+	
+	pthread_mutex_unlock(&cbuf->mutex);
+	
+	return count;
 }
 
-uint32_t circular_buf_size(cbuf_handle_t cbuf)
+// Zero copy access, in two phases.
+// circular_buf_reserve returns a pointer to the next free slot and sets *n to how many contiguous free slots
+// (at most the *n asked) can be written there, the producer fills them in place and publishes them with
+// circular_buf_commit. circular_buf_peek/circular_buf_release do the same for the oldest items on the
+// consumer side. Reserve never overwrites: with a full buffer it returns NULL and *n = 0.
+// With FCBUF_MIRRORED the whole free (or used) space is contiguous, even across the wrap.
+// Only one thread may hold a reservation (or a peek) at a time. With FCBUF_SPSC it must be the producer (the
+// consumer), otherwise the lock keeps the other calls off what was handed out until commit (release): while a
+// reservation is held put and put_n store nothing, while a peek is held get and get_n read nothing and puts
+// do not overwrite, a full buffer refuses them as with FCBUF_DO_NOT_OVERWRITE. Resize fails meanwhile.
+// Not available in FCBUF_MPMC and FCBUF_RECORDS modes.
+void *circular_buf_reserve(cbuf_handle_t cbuf, uint32_t * n)
 {
-	assert(cbuf);
+	uint32_t count;
+	uint64_t head;
+	char *slot = NULL;
 	
-	pthread_mutex_lock(&cbuf->mutex);
-	uint32_t size = cbuf->max;
-    
-	if(!cbuf->full)
+	assert(cbuf && n);
+	
+	if (cbuf->flags & (FCBUF_MPMC|FCBUF_RECORDS|FCBUF_BROADCAST|FCBUF_SNAPSHOT|FCBUF_SHARED)) { *n = 0; return NULL; } // snapshot: slots written outside the lock
+	
+	if (cbuf->flags & FCBUF_SPSC)
 	{
-		if(cbuf->head >= cbuf->tail)
+		head = cbuf->head;
+		if (head - cbuf->tailCache + *n > cbuf->max)
+			cbuf->tailCache = __atomic_load_n(&cbuf->tail,__ATOMIC_ACQUIRE);
+		count = cbuf->max - (uint32_t)(head - cbuf->tailCache);
+		head = circular_buf_index(cbuf,head);
+	}
+	else
+	{
+		circular_buf_lock(cbuf);
+		count = cbuf->max - circular_buf_size_locked(cbuf);
+		head = circular_buf_index(cbuf,cbuf->head);
+		if (cbuf->segments)
 		{
-			size = (cbuf->head - cbuf->tail);
+			if (count > cbuf->segMask + 1 - (head & cbuf->segMask))
+				count = cbuf->segMask + 1 - (uint32_t)(head & cbuf->segMask); // to the end of the chunk
+			if (count > 0 && (slot = circular_buf_segment_slot(cbuf,(uint32_t)head,true)) == NULL) count = 0;
 		}
-		else
+	}
+	
+	if (!(cbuf->flags & FCBUF_MIRRORED) && count > cbuf->max - head)
+		count = cbuf->max - (uint32_t)head; // contiguous part only
+	if (count > *n) count = *n;
+	if (!cbuf->segments) slot = (char *)cbuf->buffer + head*cbuf->elemSize;
+	
+	cbuf->reserved = count; // under the lock outside FCBUF_SPSC: circular_buf_resize must not move the buffer from under it
+	if (!(cbuf->flags & FCBUF_SPSC)) pthread_mutex_unlock(&cbuf->mutex);
+	*n = count;
+	return (count == 0) ? NULL : slot;
+}
+
+// Publishes the first n reserved slots, returns -1 if more than what was reserved
+int circular_buf_commit(cbuf_handle_t cbuf, uint32_t n)
+{
+	assert(cbuf);
+	
+	if (n > cbuf->reserved) return -1;
+	
+	if (cbuf->flags & FCBUF_SPSC)
+	{
+		cbuf->reserved = 0;
+		if (n == 0) return 0;
+		__atomic_store_n(&cbuf->head,cbuf->head + n,__ATOMIC_RELEASE);
+		CBUF_STAT_HIGH_WATER(cbuf,circular_buf_size(cbuf));
+	}
+	else
+	{
+		circular_buf_lock(cbuf);
+		cbuf->reserved = 0;
+		if (n > 0)
 		{
-			size = (cbuf->max + cbuf->head - cbuf->tail);
+			if (cbuf->stamps) circular_buf_stamp(cbuf,cbuf->head,n);
+			__atomic_store_n(&cbuf->head,circular_buf_forward(cbuf,cbuf->head,n),__ATOMIC_RELEASE);
+			cbuf->full = (cbuf->head == cbuf->tail);
+			circular_buf_persist(cbuf);
+			CBUF_STAT_HIGH_WATER(cbuf,circular_buf_size_locked(cbuf));
 		}
+		pthread_mutex_unlock(&cbuf->mutex);
+		if (cbuf->flags & FCBUF_BLOCKING_PUT)
+			circular_buf_wake(&cbuf->spaceEvent,&cbuf->spaceWaiters,INT_MAX); // puts refused while the slots were reserved
+		if (n == 0) return 0;
 	}
-    
-    pthread_mutex_unlock(&cbuf->mutex);
+	CBUF_STAT_ADD(cbuf,puts,n);
+	if (cbuf->file) circular_buf_sync_maybe(cbuf,n);
+	
+	if (cbuf->flags & FCBUF_BLOCKING_GET)
+		circular_buf_wake(&cbuf->dataEvent,&cbuf->dataWaiters,n);
+	if (cbuf->flags & FCBUF_EVENTFD)
+		circular_buf_signal(cbuf->readFd,&cbuf->readArmed);
+	return 0;
+}
 
-	return size;
+void *circular_buf_peek(cbuf_handle_t cbuf, uint32_t * n)
+{
+	uint32_t count;
+	uint64_t tail;
+	char *slot = NULL;
+	
+	assert(cbuf && n);
+	
+	if (cbuf->flags & (FCBUF_MPMC|FCBUF_RECORDS|FCBUF_BROADCAST|FCBUF_SHARED)) { *n = 0; return NULL; }
+	
+	if (cbuf->flags & FCBUF_SPSC)
+	{
+		tail = cbuf->tail;
+		if (cbuf->headCache - tail < *n)
+			cbuf->headCache = __atomic_load_n(&cbuf->head,__ATOMIC_ACQUIRE);
+		count = (uint32_t)(cbuf->headCache - tail);
+		tail = circular_buf_index(cbuf,tail);
+	}
+	else
+	{
+		circular_buf_lock(cbuf);
+		count = circular_buf_size_locked(cbuf);
+		tail = circular_buf_index(cbuf,cbuf->tail);
+		if (cbuf->segments)
+		{
+			if (count > cbuf->segMask + 1 - (tail & cbuf->segMask))
+				count = cbuf->segMask + 1 - (uint32_t)(tail & cbuf->segMask);
+			if (count > 0) slot = circular_buf_segment_slot(cbuf,(uint32_t)tail,false);
+		}
+	}
+	
+	if (!(cbuf->flags & FCBUF_MIRRORED) && count > cbuf->max - tail)
+		count = cbuf->max - (uint32_t)tail;
+	if (count > *n) count = *n;
+	if (!cbuf->segments) slot = (char *)cbuf->buffer + tail*cbuf->elemSize;
+	
+	cbuf->peeked = count; // under the lock outside FCBUF_SPSC: circular_buf_resize must not move the buffer from under it
+	if (!(cbuf->flags & FCBUF_SPSC)) pthread_mutex_unlock(&cbuf->mutex);
+	*n = count;
+	return (count == 0) ? NULL : slot;
 }
 
-static void advance_pointer(cbuf_handle_t cbuf)
+// Frees the first n peeked slots, returns -1 if more than what was peeked
+int circular_buf_release(cbuf_handle_t cbuf, uint32_t n)
 {
 	assert(cbuf);
-
-    if(cbuf->full)
-   	{
-		if (++(cbuf->tail) == cbuf->max) 
-		{ 
-			cbuf->tail = 0;
+	
+	if (n > cbuf->peeked) return -1;
+	
+	if (cbuf->flags & FCBUF_SPSC)
+	{
+		cbuf->peeked = 0;
+		if (n == 0) return 0;
+		__atomic_store_n(&cbuf->tail,cbuf->tail + n,__ATOMIC_RELEASE);
+	}
+	else
+	{
+		circular_buf_lock(cbuf);
+		cbuf->peeked = 0;
+		if (n > 0)
+		{
+			__atomic_store_n(&cbuf->tail,circular_buf_forward(cbuf,cbuf->tail,n),__ATOMIC_RELEASE);
+			cbuf->full = false;
+			cbuf->consumed += n;
+			if (cbuf->segments) circular_buf_segment_trim(cbuf);
+			circular_buf_persist(cbuf);
 		}
-	    cbuf->overwrites++;
+		pthread_mutex_unlock(&cbuf->mutex);
+		if (cbuf->flags & FCBUF_BLOCKING_GET)
+			circular_buf_wake(&cbuf->dataEvent,&cbuf->dataWaiters,INT_MAX); // gets refused while the items were peeked
+		if (n == 0) return 0;
 	}
+	CBUF_STAT_ADD(cbuf,gets,n);
+	
+	if (cbuf->flags & FCBUF_BLOCKING_PUT)
+		circular_buf_wake(&cbuf->spaceEvent,&cbuf->spaceWaiters,n);
+	if (cbuf->flags & FCBUF_EVENTFD)
+		circular_buf_signal(cbuf->writeFd,&cbuf->writeArmed);
+	return 0;
+}
 
-	if (++(cbuf->head) == cbuf->max) 
-	{ 
+// FCBUF_RECORDS: variable size records.
+// The buffer is a ring of max bytes and every record is stored as a uint32_t length followed by the payload,
+// both aligned to CBUF_RECORD_ALIGN so a record costs 4 bytes plus its payload rounded up, instead of a whole
+// elemSize slot. A record never wraps: when it does not fit before the end of the buffer the rest of the
+// buffer is marked with a CBUF_RECORD_SKIP header and the record starts at offset 0. head and tail are byte
+// offsets, recBytes counts the bytes in use (skipped ones too) and recCount the records.
+// elemSize is the biggest record accepted and the size of the buffer get_record may write to.
+// circular_buf_put/circular_buf_get also work on a record ring, moving elemSize byte records.
+// Returns 0 when stored, -1 when it is too big or the buffer is full and must not be overwritten.
+int circular_buf_put_record(cbuf_handle_t cbuf, const void * data, uint32_t len)
+{
+	int result;
+	
+	assert(cbuf && (cbuf->flags & FCBUF_RECORDS));
+	
+	result = circular_buf_put_record_mutex(cbuf,data,len);
+	if (result == 0) CBUF_STAT_ADD(cbuf,puts,1);
+	if (result == 0 && (cbuf->flags & FCBUF_BLOCKING_GET))
+		circular_buf_wake(&cbuf->dataEvent,&cbuf->dataWaiters,1);
+	if (result == 0 && (cbuf->flags & FCBUF_EVENTFD))
+		circular_buf_signal(cbuf->readFd,&cbuf->readArmed);
+	return result;
+}
+
+// Returns the length of the record copied to data, -1 when the buffer is empty
+int circular_buf_get_record(cbuf_handle_t cbuf, void * data)
+{
+	int result;
+	
+	assert(cbuf && data && (cbuf->flags & FCBUF_RECORDS));
+	
+	result = circular_buf_get_record_mutex(cbuf,data);
+	if (result >= 0) CBUF_STAT_ADD(cbuf,gets,1);
+	else CBUF_STAT_ADD(cbuf,emptyGets,1);
+	if (result >= 0 && (cbuf->flags & FCBUF_BLOCKING_PUT))
+		circular_buf_wake(&cbuf->spaceEvent,&cbuf->spaceWaiters,1);
+	if (result >= 0 && (cbuf->flags & FCBUF_EVENTFD))
+		circular_buf_signal(cbuf->writeFd,&cbuf->writeArmed);
+	return result;
+}
+
+static int circular_buf_put_record_mutex(cbuf_handle_t cbuf, const void * data, uint32_t len)
+{
+	char *p = (char *)cbuf->buffer;
+	uint32_t need = sizeof(uint32_t) + ((len + CBUF_RECORD_ALIGN - 1) & ~(CBUF_RECORD_ALIGN - 1));
+	uint32_t pad;
+	
+	if (len > cbuf->elemSize) return -1;
+	
+	circular_buf_lock(cbuf);
+	
+	for (;;)
+	{
+		if (cbuf->recCount == 0)
+		{
+			// start over at offset 0, so the biggest record always fits in an empty buffer
+			cbuf->head = cbuf->tail = 0;
+			cbuf->recBytes = 0;
+		}
+		pad = (cbuf->max - cbuf->head < need) ? cbuf->max - (uint32_t)cbuf->head : 0;
+		if ((uint64_t)cbuf->recBytes + pad + need <= cbuf->max) break;
+		
+		if (cbuf->flags & FCBUF_DO_NOT_OVERWRITE)
+		{
+			pthread_mutex_unlock(&cbuf->mutex);
+			return -1;
+		}
+		circular_buf_drop_record(cbuf);
+		cbuf->overwrites++;
+	}
+	
+	if (pad)
+	{
+		*(uint32_t *)(p + cbuf->head) = CBUF_RECORD_SKIP;
+		cbuf->recBytes += pad;
 		cbuf->head = 0;
 	}
-	cbuf->full = (cbuf->head == cbuf->tail);
-    
+	
+	*(uint32_t *)(p + cbuf->head) = len;
+	memcpy(p + cbuf->head + sizeof(uint32_t),data,len);
+	cbuf->head += need;
+	if (cbuf->head == cbuf->max) cbuf->head = 0;
+	cbuf->recBytes += need;
+	cbuf->recCount++;
+	cbuf->full = (cbuf->recBytes == cbuf->max);
+	CBUF_STAT_HIGH_WATER(cbuf,cbuf->recCount);
+	
+	pthread_mutex_unlock(&cbuf->mutex);
+	return 0;
 }
 
-static void retreat_pointer(cbuf_handle_t cbuf)
+static int circular_buf_get_record_mutex(cbuf_handle_t cbuf, void * data)
 {
-	assert(cbuf);
-    
-    cbuf->full = false;
-	if (++(cbuf->tail) == cbuf->max) 
-	{ 
+	char *p = (char *)cbuf->buffer;
+	uint32_t len;
+	
+	circular_buf_lock(cbuf);
+	
+	if (cbuf->recCount == 0)
+	{
+		pthread_mutex_unlock(&cbuf->mutex);
+		return -1;
+	}
+	
+	if (*(uint32_t *)(p + cbuf->tail) == CBUF_RECORD_SKIP)
+	{
+		cbuf->recBytes -= cbuf->max - (uint32_t)cbuf->tail;
 		cbuf->tail = 0;
 	}
-    
+	len = *(uint32_t *)(p + cbuf->tail);
+	memcpy(data,p + cbuf->tail + sizeof(uint32_t),len);
+	circular_buf_drop_record(cbuf);
+	cbuf->consumed++;
+	
+	pthread_mutex_unlock(&cbuf->mutex);
+	return (int)len;
 }
 
-void circular_buf_put(cbuf_handle_t cbuf, const void * data)
+// Moves tail past the oldest record (and past the skip marker in front of it, if any), caller holds the lock
+static void circular_buf_drop_record(cbuf_handle_t cbuf)
 {
-	assert(cbuf && cbuf->buffer);
-
-    pthread_mutex_lock(&cbuf->mutex); 
-    
-    //cbuf->buffer[cbuf->head] = data;
-    char *p = (char *)cbuf->buffer;
-    p += (cbuf->head*cbuf->elemSize);
-    memcpy(p,data,cbuf->elemSize);
-    
-    //memcpy(&cbuf->buffer[cbuf->head],data,cbuf->elemSize);
-    advance_pointer(cbuf);
-    pthread_mutex_unlock(&cbuf->mutex);
+	char *p = (char *)cbuf->buffer;
+	uint32_t need;
+	
+	if (*(uint32_t *)(p + cbuf->tail) == CBUF_RECORD_SKIP)
+	{
+		cbuf->recBytes -= cbuf->max - (uint32_t)cbuf->tail;
+		cbuf->tail = 0;
+	}
+	need = sizeof(uint32_t) + ((*(uint32_t *)(p + cbuf->tail) + CBUF_RECORD_ALIGN - 1) & ~(CBUF_RECORD_ALIGN - 1));
+	cbuf->tail += need;
+	if (cbuf->tail == cbuf->max) cbuf->tail = 0;
+	cbuf->recBytes -= need;
+	cbuf->recCount--;
+	cbuf->full = false;
 }
 
-int circular_buf_get(cbuf_handle_t cbuf, void * data)
+cbuf_handle_t circular_buf_init(uint32_t size,uint32_t elemSize)
 {
-    int result;
-    assert(cbuf && data && cbuf->buffer);
-    
-    pthread_mutex_lock(&cbuf->mutex);
-    if(!circular_buf_empty(cbuf))
-    {
-        
-         char *p = (char *)cbuf->buffer;
-         p += (cbuf->tail*cbuf->elemSize);
-         memcpy(data,p,cbuf->elemSize);
-         //memmove(data,p,cbuf->elemSize);
-        //*data = cbuf->buffer[cbuf->tail];
-        //memcpy(data,&cbuf->buffer[cbuf->tail],cbuf->elemSize);
-        retreat_pointer(cbuf);
-        cbuf->full = false;
-        result = 0;
-    } else 
-      result = -1;
-    
-    pthread_mutex_unlock(&cbuf->mutex);
-    
-    return result;
+	return circular_buf_init_flags(size,elemSize,FCBUF_OVERWRITE);
 }
 
-uint8_t circular_buf_get2(cbuf_handle_t cbuf)
+cbuf_handle_t circular_buf_init_flags(uint32_t size,uint32_t elemSize,uint32_t flags)
+{
+	return circular_buf_init_numa(size,elemSize,flags,-1);
+}
+
+// circular_buf_init_flags with the buffer pages bound to NUMA node (-1 = no binding), for rings whose
+// producers and consumers all run on that node. Fails when the node can not be bound.
+cbuf_handle_t circular_buf_init_numa(uint32_t size,uint32_t elemSize,uint32_t flags,int node)
+{
+	if ( size > MAXCBFSIZE ) return NULL;
+	if ( node >= CBUF_NUMA_NODES ) return NULL;
+	if ( (flags & FCBUF_HUGETLB) && (flags & FCBUF_THP) ) return NULL;
+	if ( (flags & (FCBUF_HUGETLB|FCBUF_THP)) && (flags & FCBUF_MIRRORED) ) return NULL;
+	if (flags & FCBUF_SHARED) return NULL; // circular_buf_init_shm
+	if ( (flags & FCBUF_SEGMENTED) && (flags & (FCBUF_LOCKFREE|FCBUF_MIRRORED|FCBUF_RECORDS|FCBUF_BROADCAST|FCBUF_RESIZE_AUTO|FCBUF_HUGETLB|FCBUF_THP)) ) return NULL;
+	if (flags & FCBUF_SEGMENTED) flags |= FCBUF_POW2; // chunks of a power of two slots must tile the ring
+	if ( (flags & FCBUF_SNAPSHOT) && (flags & (FCBUF_LOCKFREE|FCBUF_RECORDS|FCBUF_BROADCAST|FCBUF_SEGMENTED|FCBUF_RESIZE_AUTO)) ) return NULL;
+	if (flags & FCBUF_SNAPSHOT) flags |= FCBUF_POW2; // seq holds free running positions
+	if ( (flags & FCBUF_LOCKFREE) && size == 0 ) return NULL;
+	if ( (flags & FCBUF_SPSC) && (flags & FCBUF_MPMC) ) return NULL;
+	if ( (flags & FCBUF_RESIZE_AUTO) && (flags & (FCBUF_LOCKFREE|FCBUF_MIRRORED)) ) return NULL;
+	if ( (flags & FCBUF_RECORDS) && (flags & (FCBUF_LOCKFREE|FCBUF_MIRRORED|FCBUF_RESIZE_AUTO|FCBUF_POW2)) ) return NULL;
+	if ( (flags & FCBUF_WRITE_TIMESTAMP) && (flags & (FCBUF_LOCKFREE|FCBUF_RECORDS)) ) return NULL; // stamps follow ring order under the lock
+	if ( (flags & FCBUF_BROADCAST) && ((flags & (FCBUF_LOCKFREE|FCBUF_RECORDS|FCBUF_RESIZE_AUTO|FCBUF_WRITE_TIMESTAMP|FCBUF_BLOCKING_GET|FCBUF_BLOCKING_PUT)) || size == 0) ) return NULL;
+	if (flags & FCBUF_POW2) {
+	  size = circular_buf_round_pow2(size);
+	  if (size == 0) return NULL;
+	}
+	if (flags & FCBUF_RECORDS) {
+	  if ( size > MAXCBFSIZE - CBUF_RECORD_ALIGN || elemSize > MAXCBFSIZE - 2*CBUF_RECORD_ALIGN ) return NULL;
+	  size = (size + CBUF_RECORD_ALIGN - 1) & ~(CBUF_RECORD_ALIGN - 1);
+	  if ( sizeof(uint32_t) + ((elemSize + CBUF_RECORD_ALIGN - 1) & ~(CBUF_RECORD_ALIGN - 1)) > size ) return NULL; // the biggest record must fit
+	}
+	
+	cbuf_handle_t cbuf;
+	// the structure keeps head and tail on separate cache lines, so it must be cache line aligned too
+	if (posix_memalign((void **)&cbuf,CBUF_CACHELINE,sizeof(circular_buf_t)) != 0) return NULL;
+	memset(cbuf,0,sizeof(circular_buf_t));
+    
+	cbuf->max = size;
+	circular_buf_reset(cbuf);
+    cbuf->elemSize = elemSize;   
+    cbuf->flags = flags;
+    cbuf->numaNode = node;
+    if (circular_buf_alloc_buffer(cbuf) != 0) {
+      free(cbuf);
+      return NULL;
+    }
+    size = cbuf->max; // may have been rounded up
+    cbuf->mask = size - 1; // the mirror rounds to a multiple of pagesize/gcd(pagesize,elemSize) elements, a power of two too
+    if (flags & (FCBUF_SPSC|FCBUF_BLOCKING_PUT|FCBUF_RESIZE_AUTO)) cbuf->flags |= FCBUF_DO_NOT_OVERWRITE;
+    cbuf->resizeLimit = MAXCBFSIZE;
+    if (flags & FCBUF_MPMC) {
+      uint32_t i;
+      cbuf->seq = malloc((size_t)size*sizeof(uint64_t));
+      if (cbuf->seq == NULL) {
+        circular_buf_free_buffer(cbuf);
+        free(cbuf);
+        return NULL;
+      }
+      for (i = 0; i < size; i++) cbuf->seq[i] = i;
+    }
+    if (flags & FCBUF_SNAPSHOT) {
+      cbuf->seq = calloc(size,sizeof(uint64_t)); // position + 1 of the item in each slot, 0 = never written
+      if (cbuf->seq == NULL) {
+        circular_buf_free_buffer(cbuf);
+        free(cbuf);
+        return NULL;
+      }
+    }
+    if (flags & FCBUF_BROADCAST) {
+      cbuf->seq = calloc(size,sizeof(uint64_t)); // position + 1 of the item in each slot, 0 = never written
+      if ( cbuf->seq == NULL || posix_memalign((void **)&cbuf->cursors,CBUF_CACHELINE,CBUF_BROADCAST_CONSUMERS*sizeof(circular_buf_cursor_t)) != 0 ) {
+        free(cbuf->seq);
+        circular_buf_free_buffer(cbuf);
+        free(cbuf);
+        return NULL;
+      }
+      memset(cbuf->cursors,0,CBUF_BROADCAST_CONSUMERS*sizeof(circular_buf_cursor_t));
+    }
+    if (flags & FCBUF_WRITE_TIMESTAMP) {
+      cbuf->stamps = calloc(size ? size : 1,sizeof(uint64_t));
+      if (cbuf->stamps == NULL) {
+        circular_buf_free_buffer(cbuf);
+        free(cbuf->seq);
+        free(cbuf);
+        return NULL;
+      }
+    }
+    pthread_mutex_init(&cbuf->mutex,NULL);
+    pthread_mutex_init(&cbuf->resizeMutex,NULL);
+    if ((flags & FCBUF_EVENTFD) && circular_buf_open_events(cbuf) != 0) {
+      circular_buf_free(cbuf);
+      return NULL;
+    }
+	assert(circular_buf_empty(cbuf));
+
+	return cbuf;
+}
+
+// Smallest power of two >= size (at least 1), 0 when it does not fit in 32 bits
+static uint32_t circular_buf_round_pow2(uint32_t size)
+{
+	if (size <= 1) return 1;
+	if (size > 0x80000000u) return 0;
+	return 1u << (32 - __builtin_clz(size - 1));
+}
+
+// Allocates cbuf->buffer for cbuf->max elements of cbuf->elemSize bytes.
+// FCBUF_MIRRORED maps the same memfd pages twice, one right after the other, so reading or writing up to
+// max elements from any slot never has to care about the wrap. The mapping must be a whole number of
+// pages and of elements, so max is rounded up to the next size where both agree.
+static int circular_buf_alloc_buffer(cbuf_handle_t cbuf)
+{
+	size_t bytes = (cbuf->flags & FCBUF_RECORDS) ? cbuf->max : (size_t)cbuf->max*cbuf->elemSize;
+	
+	cbuf->mapSize = 0;
+	
+	if (cbuf->flags & FCBUF_MIRRORED)
+	{
+		size_t page = (size_t)sysconf(_SC_PAGESIZE);
+		size_t a = page, b = cbuf->elemSize, lcm;
+		int fd;
+		char *base;
+		
+		if (bytes == 0) return -1;
+		while (b) { size_t t = a % b; a = b; b = t; }
+		lcm = page / a * cbuf->elemSize;
+		bytes = (bytes + lcm - 1) / lcm * lcm;
+		if (bytes / cbuf->elemSize > MAXCBFSIZE) return -1;
+		
+		fd = memfd_create("circular_buf",MFD_CLOEXEC);
+		if (fd < 0) return -1;
+		if (ftruncate(fd,bytes) != 0) { close(fd); return -1; }
+		
+		// reserve the address range first, then put the two views of the file on top of it
+		base = mmap(NULL,2*bytes,PROT_NONE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+		if (base == MAP_FAILED) { close(fd); return -1; }
+		if ( (mmap(base,bytes,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_FIXED,fd,0) == MAP_FAILED) ||
+		     (mmap(base + bytes,bytes,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_FIXED,fd,0) == MAP_FAILED) )
+		{
+			munmap(base,2*bytes);
+			close(fd);
+			return -1;
+		}
+		close(fd); // the mappings keep the memory alive
+		if (circular_buf_place(cbuf,base,bytes) != 0)
+		{
+			munmap(base,2*bytes);
+			return -1;
+		}
+		
+		cbuf->buffer = (uint32_t *)base;
+		cbuf->mapSize = 2*bytes;
+		cbuf->max = (uint32_t)(bytes / cbuf->elemSize);
+		return 0;
+	}
+	
+	if (cbuf->flags & FCBUF_SEGMENTED)
+	{
+		size_t page = (size_t)sysconf(_SC_PAGESIZE);
+		uint32_t slots = 1;
+		
+		while ( slots < cbuf->max && (size_t)slots*2*cbuf->elemSize <= CBUF_SEGMENT_BYTES ) slots *= 2;
+		cbuf->segShift = __builtin_ctz(slots);
+		cbuf->segMask = slots - 1;
+		cbuf->segBytes = ((size_t)slots*cbuf->elemSize + page - 1) / page * page;
+		cbuf->segments = calloc(cbuf->max >> cbuf->segShift,sizeof(void *));
+		cbuf->buffer = (uint32_t *)cbuf->segments; // not the slots, they are only reached through the chunks
+		return (cbuf->segments == NULL) ? -1 : 0;
+	}
+	
+	if ( (cbuf->flags & (FCBUF_HUGETLB|FCBUF_THP|FCBUF_PREFAULT)) || cbuf->numaNode >= 0 )
+	{
+		cbuf->buffer = circular_buf_map_anon(cbuf,bytes,&cbuf->mapSize);
+		return (cbuf->buffer == NULL) ? -1 : 0;
+	}
+	
+	cbuf->buffer = malloc(bytes);
+	return (cbuf->buffer == NULL && bytes != 0) ? -1 : 0;
+}
+
+// Anonymous mapping for the buffer instead of malloc, when it has to be in huge pages, on a NUMA node or
+// prefaulted. The size is rounded up to whole (huge) pages, *mapSize gets it for munmap.
+static void *circular_buf_map_anon(cbuf_handle_t cbuf, size_t bytes, size_t * mapSize)
+{
+	size_t page = (cbuf->flags & (FCBUF_HUGETLB|FCBUF_THP)) ? CBUF_HUGEPAGE : (size_t)sysconf(_SC_PAGESIZE);
+	void *p;
+	
+	bytes = (bytes + page - 1) / page * page;
+	if (bytes == 0) bytes = page;
+	
+	p = mmap(NULL,bytes,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|((cbuf->flags & FCBUF_HUGETLB) ? MAP_HUGETLB : 0),-1,0);
+	if (p == MAP_FAILED) return NULL;
+	if (cbuf->flags & FCBUF_THP) madvise(p,bytes,MADV_HUGEPAGE); // only a hint, plain pages if THP is off
+	
+	if (circular_buf_place(cbuf,p,bytes) != 0)
+	{
+		munmap(p,bytes);
+		return NULL;
+	}
+	*mapSize = bytes;
+	return p;
+}
+
+// Binds fresh (untouched) buffer pages to cbuf->numaNode and prefaults them with FCBUF_PREFAULT.
+// The binding has to come first: a page lives on the node where it is faulted in.
+static int circular_buf_place(cbuf_handle_t cbuf, void * p, size_t bytes)
+{
+	if (cbuf->numaNode >= 0)
+	{
+		unsigned long mask[CBUF_NUMA_NODES / (8*sizeof(unsigned long))] = { 0 };
+		
+		mask[cbuf->numaNode / (8*sizeof(unsigned long))] |= 1ul << (cbuf->numaNode % (8*sizeof(unsigned long)));
+		if (syscall(SYS_mbind,p,bytes,MPOL_BIND,mask,(unsigned long)CBUF_NUMA_NODES,0) != 0) return -1;
+	}
+	
+	if (cbuf->flags & FCBUF_PREFAULT)
+	{
+		size_t page = (size_t)sysconf(_SC_PAGESIZE), off;
+		for (off = 0; off < bytes; off += page)
+			((volatile char *)p)[off] = 0; // a write, so it is a page of its own and not the shared zero page
+	}
+	return 0;
+}
+
+// FCBUF_SEGMENTED: the ring is a table of chunks of segMask + 1 slots. A chunk is mapped when the producer
+// first writes into it and given back once the consumer has drained it, so a ring sized for a rare burst only
+// holds the memory its items need. The last CBUF_SEGMENT_SPARES drained chunks are kept for the next ones,
+// so a ring going back and forth over a chunk boundary does not map and unmap all the time.
+// Everything runs under the lock (the lock free modes are refused), and reserve/peek stop at the end of a chunk.
+
+// Address of slot index, mapping its chunk first when alloc is set. NULL when that fails (or !alloc and no chunk).
+static char *circular_buf_segment_slot(cbuf_handle_t cbuf, uint32_t index, bool alloc)
+{
+	void **chunk = &cbuf->segments[index >> cbuf->segShift];
+	
+	if (*chunk == NULL)
+	{
+		size_t bytes;
+		
+		if (!alloc) return NULL;
+		if (cbuf->segSpares > 0)
+			*chunk = cbuf->segSpare[--cbuf->segSpares];
+		else if ((*chunk = circular_buf_map_anon(cbuf,cbuf->segBytes,&bytes)) == NULL)
+			return NULL;
+		cbuf->segCount++;
+	}
+	return (char *)*chunk + (size_t)(index & cbuf->segMask)*cbuf->elemSize;
+}
+
+// Maps the chunks of count slots from index on (wrapping), returns -1 when one of them can not be mapped
+static int circular_buf_segment_alloc(cbuf_handle_t cbuf, uint32_t index, uint32_t count)
+{
+	while (count > 0)
+	{
+		uint32_t run = cbuf->segMask + 1 - (index & cbuf->segMask);
+		
+		if (circular_buf_segment_slot(cbuf,index,true) == NULL) return -1;
+		if (run >= count) break;
+		count -= run;
+		index = (index + run) & cbuf->mask;
+	}
+	return 0;
+}
+
+// Copies count elements into (in) or out of the slots from index on, one memcpy per chunk.
+// A chunk never straddles the end of the ring, max is a multiple of the chunk size.
+static void circular_buf_segment_copy(cbuf_handle_t cbuf, uint32_t index, char * data, uint32_t count, bool in)
+{
+	while (count > 0)
+	{
+		uint32_t run = cbuf->segMask + 1 - (index & cbuf->segMask);
+		char *slot = (char *)cbuf->segments[index >> cbuf->segShift] + (size_t)(index & cbuf->segMask)*cbuf->elemSize;
+		
+		if (run > count) run = count;
+		if (in) memcpy(slot,data,(size_t)run*cbuf->elemSize);
+		else memcpy(data,slot,(size_t)run*cbuf->elemSize);
+		data += (size_t)run*cbuf->elemSize;
+		count -= run;
+		index = (index + run) & cbuf->mask;
+	}
+}
+
+// Gives back the chunks the tail has left, caller holds the lock. A chunk head is in again (or about to
+// enter: head is at its first slot) stays, the producer reuses it in place, and so does an overwritten one.
+static void circular_buf_segment_trim(cbuf_handle_t cbuf)
+{
+	uint32_t slots = cbuf->segMask + 1;
+	
+	while (cbuf->segTail + slots <= cbuf->tail)
+	{
+		uint32_t chunk = (uint32_t)(cbuf->segTail & cbuf->mask) >> cbuf->segShift;
+		void *p = cbuf->segments[chunk];
+		
+		if (p && cbuf->head < cbuf->segTail + cbuf->max)
+		{
+			cbuf->segments[chunk] = NULL;
+			cbuf->segCount--;
+			if (cbuf->segSpares < CBUF_SEGMENT_SPARES) cbuf->segSpare[cbuf->segSpares++] = p;
+			else munmap(p,cbuf->segBytes);
+		}
+		cbuf->segTail += slots;
+	}
+}
+
+// Persistent buffer: the slots and head/tail/overwrites live in the file at path, mapped shared, so what was
+// put survives a crash of the process (the page cache keeps it) and a restart reopens the ring as it was.
+// Puts only write to memory. msync, for surviving a crash of the machine too, happens after every
+// circular_buf_set_sync puts or ms, or on circular_buf_sync, and once more on circular_buf_free.
+// A new (missing or empty) file is created for size elements of elemSize bytes, rounded up to a power of
+// two. An existing file keeps its own capacity, but must have been created with the same elemSize.
+// The ring is a mutex one with free running positions (FCBUF_POW2 is implied). Returns NULL for lock free,
+// mirrored, records, broadcast, auto resize or timestamp flags, and for a file that is not a ring.
+cbuf_handle_t circular_buf_init_file(const char * path, uint32_t size, uint32_t elemSize, uint32_t flags)
+{
+	circular_buf_file_header_t *file;
+	cbuf_handle_t cbuf;
+	struct stat st;
+	size_t bytes;
+	bool created = false;
+	int fd;
+
+	assert(path);
+
+	if ( flags & (FCBUF_LOCKFREE|FCBUF_MIRRORED|FCBUF_RECORDS|FCBUF_BROADCAST|FCBUF_RESIZE_AUTO|FCBUF_WRITE_TIMESTAMP|FCBUF_SEGMENTED|FCBUF_SNAPSHOT|FCBUF_SHARED) ) return NULL;
+	if (elemSize == 0) return NULL;
+
+	fd = open(path,O_RDWR|O_CREAT|O_CLOEXEC,0644);
+	if (fd < 0) return NULL;
+	if (fstat(fd,&st) != 0) { close(fd); return NULL; }
+
+	if (st.st_size == 0)
+	{
+		size = circular_buf_round_pow2(size);
+		if (size == 0) { close(fd); return NULL; }
+		bytes = CBUF_FILE_HEADER + (size_t)size*elemSize;
+		if (ftruncate(fd,bytes) != 0) { close(fd); return NULL; }
+		created = true;
+	}
+	else if ((size_t)st.st_size >= CBUF_FILE_HEADER)
+		bytes = (size_t)st.st_size;
+	else { close(fd); return NULL; }
+
+	file = mmap(NULL,bytes,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	close(fd); // the mapping keeps the file open
+	if (file == MAP_FAILED) return NULL;
+
+	if (created)
+	{
+		file->elemSize = elemSize;
+		file->max = size;
+		file->flags = flags;
+		file->version = CBUF_FILE_VERSION;
+		file->magic = CBUF_FILE_MAGIC; // last, a file without it is not a ring yet
+	}
+	else if ( file->magic != CBUF_FILE_MAGIC || file->version != CBUF_FILE_VERSION || file->elemSize != elemSize ||
+	          file->max == 0 || (file->max & (file->max - 1)) || CBUF_FILE_HEADER + (size_t)file->max*elemSize > bytes )
+	{
+		munmap(file,bytes);
+		return NULL;
+	}
+
+	if (posix_memalign((void **)&cbuf,CBUF_CACHELINE,sizeof(circular_buf_t)) != 0)
+	{
+		munmap(file,bytes);
+		return NULL;
+	}
+	memset(cbuf,0,sizeof(circular_buf_t));
+
+	cbuf->file = file;
+	cbuf->mapSize = bytes;
+	cbuf->buffer = (uint32_t *)((char *)file + CBUF_FILE_HEADER);
+	cbuf->max = file->max;
+	cbuf->mask = file->max - 1;
+	cbuf->elemSize = elemSize;
+	cbuf->flags = flags | FCBUF_POW2 | FCBUF_PERSISTENT;
+	if (flags & FCBUF_BLOCKING_PUT) cbuf->flags |= FCBUF_DO_NOT_OVERWRITE;
+	cbuf->resizeLimit = MAXCBFSIZE;
+
+	// tail is written first (see circular_buf_persist), so a crash in the middle of an update can leave a
+	// tail that is ahead of head or more than max behind it
+	cbuf->head = file->head;
+	cbuf->tail = file->tail;
+	if (cbuf->tail > cbuf->head) cbuf->tail = cbuf->head;
+	if (cbuf->head - cbuf->tail > cbuf->max) cbuf->tail = cbuf->head - cbuf->max;
+	cbuf->overwrites = file->overwrites;
+	cbuf->syncLast = circular_buf_timestamp();
+
+	pthread_mutex_init(&cbuf->mutex,NULL);
+	pthread_mutex_init(&cbuf->resizeMutex,NULL);
+	if ((flags & FCBUF_EVENTFD) && circular_buf_open_events(cbuf) != 0)
+	{
+		circular_buf_free(cbuf);
+		return NULL;
+	}
+	return cbuf;
+}
+
+// FCBUF_PERSISTENT: copies the state to the file header, caller holds the lock
+static inline void circular_buf_persist(cbuf_handle_t cbuf)
+{
+	if (cbuf->file == NULL) return;
+	cbuf->file->tail = cbuf->tail;
+	cbuf->file->head = cbuf->head;
+	cbuf->file->overwrites = cbuf->overwrites;
+}
+
+// Writes the mapping back to the file and waits for it. Returns -1 when msync fails or not FCBUF_PERSISTENT.
+int circular_buf_sync(cbuf_handle_t cbuf)
+{
+	assert(cbuf);
+
+	if (cbuf->file == NULL) return -1;
+	__atomic_store_n(&cbuf->syncPending,0,__ATOMIC_RELAXED);
+	__atomic_store_n(&cbuf->syncLast,circular_buf_timestamp(),__ATOMIC_RELAXED);
+	return (msync(cbuf->file,cbuf->mapSize,MS_SYNC) == 0) ? 0 : -1;
+}
+
+// msync after everyPuts puts and/or when the last msync is older than everyMs (checked on puts, an idle ring
+// is not synced until its next put). 0 turns either off, both 0 (the default) leaves it to the kernel
+// writeback and circular_buf_sync.
+void circular_buf_set_sync(cbuf_handle_t cbuf, uint32_t everyPuts, uint32_t everyMs)
+{
+	assert(cbuf);
+	cbuf->syncEvery = everyPuts;
+	cbuf->syncMs = everyMs;
+}
+
+// Called after puts, outside the lock so the msync does not hold up the other threads
+static void circular_buf_sync_maybe(cbuf_handle_t cbuf, uint32_t puts)
+{
+	uint32_t pending = __atomic_add_fetch(&cbuf->syncPending,puts,__ATOMIC_RELAXED);
+
+	if ( (cbuf->syncEvery && pending >= cbuf->syncEvery) ||
+	     (cbuf->syncMs && circular_buf_timestamp() - __atomic_load_n(&cbuf->syncLast,__ATOMIC_RELAXED) >= (uint64_t)cbuf->syncMs*1000000) )
+		circular_buf_sync(cbuf);
+}
+
+// FCBUF_SHARED: a ring between processes. The header (head, tail, offsets), one state word per slot and the
+// slots live in the POSIX shared memory object name, created by the first circular_buf_init_shm for it and
+// opened by the others, which must use the same elemSize (the size of the first one wins). There is no lock:
+// head and tail are free running positions moved with CAS, and every slot has a state word that is
+// CBUF_SHM_WORD(position, state, pid). Producers claim a slot by moving its word from (pos, FREE) to
+// (pos, WRITING, their pid), then move head on and publish (pos, FULL). Consumers move it from (pos, FULL) to
+// (pos, READING, pid), move tail on and give the slot to the next lap with (pos + max, FREE). Whoever finds
+// a slot claimed while head (tail) still points at it moves head (tail) on for the claimant, so a process
+// that dies between the two steps does not stop the others. A process that dies while it copies leaves its
+// pid in the word: a consumer that finds a WRITING slot of a dead process frees it and skips the item, a
+// producer that finds a READING slot of a dead process frees it, and both count the lost item (see
+// circular_buf_get_overwrites). A dead process must have been reaped, a zombie still looks alive.
+// The ring never overwrites. Only put/get and the bulk calls apply, circular_buf_free unmaps the object but
+// keeps it, shm_unlink(name) removes it.
+static pid_t circular_buf_shm_pid; // this process, refreshed in the child after a fork
+static pthread_once_t circular_buf_shm_once = PTHREAD_ONCE_INIT;
+
+static void circular_buf_shm_forked(void)
+{
+	circular_buf_shm_pid = getpid();
+}
+
+static void circular_buf_shm_pid_init(void)
+{
+	circular_buf_shm_pid = getpid();
+	pthread_atfork(NULL,NULL,circular_buf_shm_forked);
+}
+
+// true when the process that left pid in a slot word is gone
+static bool circular_buf_shm_dead(pid_t pid)
+{
+	return pid != 0 && kill(pid,0) == -1 && errno == ESRCH;
+}
+
+cbuf_handle_t circular_buf_init_shm(const char * name, uint32_t size, uint32_t elemSize, uint32_t flags)
+{
+	circular_buf_shm_header_t *shm;
+	cbuf_handle_t cbuf;
+	struct stat st;
+	size_t bytes;
+	uint32_t i, waited;
+	int fd;
+	
+	assert(name);
+	
+	if (flags & ~(FCBUF_DO_NOT_OVERWRITE|FCBUF_POW2)) return NULL;
+	if (elemSize == 0) return NULL;
+	pthread_once(&circular_buf_shm_once,circular_buf_shm_pid_init);
+	
+	fd = shm_open(name,O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC,0600);
+	if (fd >= 0)
+	{
+		uint64_t seqOffset = (sizeof(circular_buf_shm_header_t) + CBUF_CACHELINE - 1) & ~(uint64_t)(CBUF_CACHELINE - 1), slotOffset;
+		
+		size = circular_buf_round_pow2(size);
+		if (size == 0 || size > 0x40000000u) { close(fd); shm_unlink(name); return NULL; } // slot words keep 32 bits of position, laps must not alias
+		slotOffset = (seqOffset + (uint64_t)size*sizeof(uint64_t) + CBUF_CACHELINE - 1) & ~(uint64_t)(CBUF_CACHELINE - 1);
+		bytes = slotOffset + (size_t)size*elemSize;
+		if (ftruncate(fd,bytes) != 0) { close(fd); shm_unlink(name); return NULL; }
+		shm = mmap(NULL,bytes,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+		close(fd);
+		if (shm == MAP_FAILED) { shm_unlink(name); return NULL; }
+		
+		for (i = 0; i < size; i++)
+			((uint64_t *)((char *)shm + seqOffset))[i] = CBUF_SHM_WORD(i,CBUF_SHM_FREE,0);
+		shm->elemSize = elemSize;
+		shm->max = size;
+		shm->seqOffset = seqOffset;
+		shm->slotOffset = slotOffset;
+		shm->version = CBUF_SHM_VERSION;
+		__atomic_store_n(&shm->magic,CBUF_SHM_MAGIC,__ATOMIC_RELEASE); // last, the others wait for it
+	}
+	else
+	{
+		if (errno != EEXIST || (fd = shm_open(name,O_RDWR|O_CLOEXEC,0)) < 0) return NULL;
+		
+		// the creator may still be between shm_open and ftruncate
+		for (waited = 0; fstat(fd,&st) == 0 && (size_t)st.st_size < sizeof(circular_buf_shm_header_t) && waited < CBUF_SHM_OPEN_WAIT_MS; waited++)
+			usleep(1000);
+		if (fstat(fd,&st) != 0 || (size_t)st.st_size < sizeof(circular_buf_shm_header_t)) { close(fd); return NULL; }
+		bytes = (size_t)st.st_size;
+		shm = mmap(NULL,bytes,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+		close(fd);
+		if (shm == MAP_FAILED) return NULL;
+		
+		for (; __atomic_load_n(&shm->magic,__ATOMIC_ACQUIRE) != CBUF_SHM_MAGIC && waited < CBUF_SHM_OPEN_WAIT_MS; waited++)
+			usleep(1000);
+		if ( shm->magic != CBUF_SHM_MAGIC || shm->version != CBUF_SHM_VERSION || shm->elemSize != elemSize ||
+		     shm->max == 0 || (shm->max & (shm->max - 1)) || shm->slotOffset + (uint64_t)shm->max*elemSize > bytes ||
+		     shm->seqOffset + (uint64_t)shm->max*sizeof(uint64_t) > shm->slotOffset )
+		{
+			munmap(shm,bytes);
+			return NULL;
+		}
+	}
+	
+	if (posix_memalign((void **)&cbuf,CBUF_CACHELINE,sizeof(circular_buf_t)) != 0)
+	{
+		munmap(shm,bytes);
+		return NULL;
+	}
+	memset(cbuf,0,sizeof(circular_buf_t));
+	
+	cbuf->shm = shm;
+	cbuf->mapSize = bytes;
+	cbuf->seq = (uint64_t *)((char *)shm + shm->seqOffset);
+	cbuf->buffer = (uint32_t *)((char *)shm + shm->slotOffset);
+	cbuf->max = shm->max;
+	cbuf->mask = shm->max - 1;
+	cbuf->elemSize = elemSize;
+	cbuf->flags = flags | FCBUF_POW2 | FCBUF_DO_NOT_OVERWRITE | FCBUF_SHARED;
+	cbuf->resizeLimit = MAXCBFSIZE;
+	pthread_mutex_init(&cbuf->mutex,NULL); // only for the stats and circular_buf_free, the ring never takes it
+	pthread_mutex_init(&cbuf->resizeMutex,NULL);
+	return cbuf;
+}
+
+static int circular_buf_put_shm(cbuf_handle_t cbuf, const void * data)
+{
+	circular_buf_shm_header_t *shm = cbuf->shm;
+	
+	for (;;)
+	{
+		uint64_t pos = __atomic_load_n(&shm->head,__ATOMIC_ACQUIRE);
+		uint64_t *slot = &cbuf->seq[pos & cbuf->mask];
+		uint64_t word = __atomic_load_n(slot,__ATOMIC_ACQUIRE);
+		
+		if (word == CBUF_SHM_WORD(pos,CBUF_SHM_FREE,0))
+		{
+			if (!__atomic_compare_exchange_n(slot,&word,CBUF_SHM_WORD(pos,CBUF_SHM_WRITING,circular_buf_shm_pid),false,__ATOMIC_ACQ_REL,__ATOMIC_RELAXED))
+				continue;
+			__atomic_compare_exchange_n(&shm->head,&pos,pos + 1,false,__ATOMIC_RELEASE,__ATOMIC_RELAXED); // or somebody did it for us
+			circular_buf_copy_elem(cbuf,(char *)cbuf->buffer + (size_t)(pos & cbuf->mask)*cbuf->elemSize,data);
+			__atomic_store_n(slot,CBUF_SHM_WORD(pos,CBUF_SHM_FULL,0),__ATOMIC_RELEASE);
+			return 0;
+		}
+		if (CBUF_SHM_POS(word) == (uint32_t)pos)
+		{
+			// claimed by a producer that has not moved head yet (or never will)
+			__atomic_compare_exchange_n(&shm->head,&pos,pos + 1,false,__ATOMIC_RELEASE,__ATOMIC_RELAXED);
+			continue;
+		}
+		if (CBUF_SHM_POS(word) == (uint32_t)(pos - cbuf->max))
+		{
+			// the item of the previous lap is still there: full, unless the consumer reading it died
+			if ( CBUF_SHM_STATE(word) == CBUF_SHM_READING && circular_buf_shm_dead(CBUF_SHM_PID(word)) &&
+			     __atomic_compare_exchange_n(slot,&word,CBUF_SHM_WORD(pos,CBUF_SHM_FREE,0),false,__ATOMIC_ACQ_REL,__ATOMIC_RELAXED) )
+			{
+				__atomic_fetch_add(&shm->lost,1,__ATOMIC_RELAXED);
+				continue;
+			}
+			return -1;
+		}
+		if (CBUF_SHM_POS(word) == (uint32_t)(pos + cbuf->max))
+		{
+			// a consumer already freed it from a dead producer, head was left behind
+			__atomic_compare_exchange_n(&shm->head,&pos,pos + 1,false,__ATOMIC_RELEASE,__ATOMIC_RELAXED);
+			continue;
+		}
+		if (__atomic_load_n(&shm->head,__ATOMIC_ACQUIRE) == pos) return -1; // should not happen, never spin on it
+	}
+}
+
+static int circular_buf_get_shm(cbuf_handle_t cbuf, void * data)
+{
+	circular_buf_shm_header_t *shm = cbuf->shm;
+	
+	for (;;)
+	{
+		uint64_t pos = __atomic_load_n(&shm->tail,__ATOMIC_ACQUIRE);
+		uint64_t *slot = &cbuf->seq[pos & cbuf->mask];
+		uint64_t word = __atomic_load_n(slot,__ATOMIC_ACQUIRE);
+		
+		if (word == CBUF_SHM_WORD(pos,CBUF_SHM_FULL,0))
+		{
+			if (!__atomic_compare_exchange_n(slot,&word,CBUF_SHM_WORD(pos,CBUF_SHM_READING,circular_buf_shm_pid),false,__ATOMIC_ACQ_REL,__ATOMIC_RELAXED))
+				continue;
+			__atomic_compare_exchange_n(&shm->tail,&pos,pos + 1,false,__ATOMIC_RELEASE,__ATOMIC_RELAXED);
+			circular_buf_copy_elem(cbuf,data,(char *)cbuf->buffer + (size_t)(pos & cbuf->mask)*cbuf->elemSize);
+			__atomic_store_n(slot,CBUF_SHM_WORD(pos + cbuf->max,CBUF_SHM_FREE,0),__ATOMIC_RELEASE);
+			return 0;
+		}
+		if (CBUF_SHM_POS(word) == (uint32_t)pos)
+		{
+			if (CBUF_SHM_STATE(word) == CBUF_SHM_READING)
+			{
+				__atomic_compare_exchange_n(&shm->tail,&pos,pos + 1,false,__ATOMIC_RELEASE,__ATOMIC_RELAXED);
+				continue;
+			}
+			// being written: not there yet, or never will be when the producer died
+			if ( CBUF_SHM_STATE(word) == CBUF_SHM_WRITING && circular_buf_shm_dead(CBUF_SHM_PID(word)) &&
+			     __atomic_compare_exchange_n(slot,&word,CBUF_SHM_WORD(pos + cbuf->max,CBUF_SHM_FREE,0),false,__ATOMIC_ACQ_REL,__ATOMIC_RELAXED) )
+			{
+				uint64_t head = pos;
+				// it may have died before moving head too: never leave tail ahead of head
+				__atomic_compare_exchange_n(&shm->head,&head,pos + 1,false,__ATOMIC_RELEASE,__ATOMIC_RELAXED);
+				__atomic_compare_exchange_n(&shm->tail,&pos,pos + 1,false,__ATOMIC_RELEASE,__ATOMIC_RELAXED);
+				__atomic_fetch_add(&shm->lost,1,__ATOMIC_RELAXED);
+				continue;
+			}
+			return -1;
+		}
+		if (CBUF_SHM_POS(word) == (uint32_t)(pos - cbuf->max)) return -1; // previous lap still being read: empty
+		if (CBUF_SHM_POS(word) == (uint32_t)(pos + cbuf->max))
+		{
+			// already handed to the next lap (a producer freed it from a dead consumer), tail was left behind
+			__atomic_compare_exchange_n(&shm->tail,&pos,pos + 1,false,__ATOMIC_RELEASE,__ATOMIC_RELAXED);
+			continue;
+		}
+		if (__atomic_load_n(&shm->tail,__ATOMIC_ACQUIRE) == pos) return -1;
+	}
+}
+
+static void circular_buf_free_buffer(cbuf_handle_t cbuf)
+{
+	if (cbuf->file)
+	{
+		circular_buf_sync(cbuf);
+		munmap(cbuf->file,cbuf->mapSize);
+		cbuf->file = NULL;
+	}
+	else if (cbuf->shm)
+	{
+		munmap(cbuf->shm,cbuf->mapSize);
+		cbuf->shm = NULL;
+		cbuf->seq = NULL; // in the mapping too
+	}
+	else if (cbuf->segments)
+	{
+		uint32_t i;
+		
+		for (i = 0; i < (cbuf->max >> cbuf->segShift); i++)
+			if (cbuf->segments[i]) munmap(cbuf->segments[i],cbuf->segBytes);
+		while (cbuf->segSpares > 0)
+			munmap(cbuf->segSpare[--cbuf->segSpares],cbuf->segBytes);
+		free(cbuf->segments); // buffer is the same pointer
+		cbuf->segments = NULL;
+	}
+	else if (cbuf->mapSize)
+		munmap(cbuf->buffer,cbuf->mapSize);
+	else
+		free(cbuf->buffer);
+	cbuf->buffer = NULL;
+}
+
+static void circular_buf_reset(cbuf_handle_t cbuf)
+{
+    assert(cbuf);
+
+    cbuf->head = 0;
+    cbuf->tail = 0;
+    cbuf->tailCache = 0;
+    cbuf->headCache = 0;
+    cbuf->reserved = 0;
+    cbuf->peeked = 0;
+    cbuf->full = false;
+    cbuf->overwrites = 0;
+    cbuf->consumed = 0;
+    cbuf->recBytes = 0;
+    cbuf->recCount = 0;
+}
+
+void circular_buf_free(cbuf_handle_t cbuf)
+{
+	assert(cbuf);
+	circular_buf_free_buffer(cbuf);
+	free(cbuf->seq);
+	free(cbuf->stamps);
+	free(cbuf->cursors);
+	if (cbuf->flags & FCBUF_EVENTFD)
+	{
+		if (cbuf->readFd >= 0) close(cbuf->readFd);
+		if (cbuf->writeFd >= 0) close(cbuf->writeFd);
+	}
+	pthread_mutex_destroy(&cbuf->mutex);
+	pthread_mutex_destroy(&cbuf->resizeMutex);
+	free(cbuf);
+}
+
+bool circular_buf_full(cbuf_handle_t cbuf)
+{
+	assert(cbuf);
+	if (cbuf->flags & (FCBUF_LOCKFREE|FCBUF_POW2|FCBUF_BROADCAST))
+		return (circular_buf_size(cbuf) == cbuf->max);
+	return cbuf->full;
+}
+
+uint32_t circular_buf_capacity(cbuf_handle_t cbuf)
+{
+	assert(cbuf);
+	return cbuf->max;
+}
+
+uint32_t circular_buf_size(cbuf_handle_t cbuf)
+{
+	assert(cbuf);
+	
+	if (cbuf->flags & FCBUF_BROADCAST)
+	{
+		// the items the slowest consumer has not read yet
+		uint64_t head = __atomic_load_n(&cbuf->head,__ATOMIC_ACQUIRE);
+		uint64_t tail = circular_buf_slowest_cursor(cbuf,head);
+		return (uint32_t)((head - tail) > cbuf->max ? cbuf->max : (head - tail));
+	}
+	
+	if (cbuf->flags & FCBUF_SHARED)
+	{
+		uint64_t tail = __atomic_load_n(&cbuf->shm->tail,__ATOMIC_ACQUIRE);
+		uint64_t head = __atomic_load_n(&cbuf->shm->head,__ATOMIC_ACQUIRE);
+		return (uint32_t)((head - tail) > cbuf->max ? cbuf->max : (head - tail));
+	}
+	
+	if (cbuf->flags & (FCBUF_LOCKFREE|FCBUF_POW2))
+	{
+		// tail first: head can only move forward meanwhile, so the difference is never negative
+		uint64_t tail = __atomic_load_n(&cbuf->tail,__ATOMIC_ACQUIRE);
+		uint64_t head = __atomic_load_n(&cbuf->head,__ATOMIC_ACQUIRE);
+		return (uint32_t)((head - tail) > cbuf->max ? cbuf->max : (head - tail));
+	}
+	
+	circular_buf_lock(cbuf);
+	uint32_t size = circular_buf_size_locked(cbuf);
+    pthread_mutex_unlock(&cbuf->mutex);
+
+	return size;
+}
+
+// Same as circular_buf_size for the mutex modes, caller holds the lock
+static uint32_t circular_buf_size_locked(cbuf_handle_t cbuf)
+{
+	uint32_t size = cbuf->max;
+	
+	if (cbuf->flags & FCBUF_RECORDS) return cbuf->recCount;
+	if (cbuf->flags & FCBUF_POW2) return (uint32_t)(cbuf->head - cbuf->tail);
+    
+	if(!cbuf->full)
+	{
+		if(cbuf->head >= cbuf->tail)
+		{
+			size = (cbuf->head - cbuf->tail);
+		}
+		else
+		{
+			size = (cbuf->max + cbuf->head - cbuf->tail);
+		}
+	}
+	
+	return size;
+}
+
+static inline bool circular_buf_full_locked(cbuf_handle_t cbuf)
+{
+	if (cbuf->flags & FCBUF_POW2) return (cbuf->head - cbuf->tail == cbuf->max);
+	return cbuf->full;
+}
+
+// Slot of a head/tail value: free running positions are reduced with the mask (FCBUF_POW2) or a modulo
+// (lock free modes), the plain mutex mode already keeps indexes
+static inline uint32_t circular_buf_index(cbuf_handle_t cbuf, uint64_t pos)
+{
+	if (cbuf->flags & FCBUF_POW2) return (uint32_t)(pos & cbuf->mask);
+	if (cbuf->flags & (FCBUF_LOCKFREE|FCBUF_BROADCAST)) return (uint32_t)(pos % cbuf->max);
+	return (uint32_t)pos;
+}
+
+// head/tail value n items after pos
+static inline uint64_t circular_buf_forward(cbuf_handle_t cbuf, uint64_t pos, uint32_t n)
+{
+	if (cbuf->flags & (FCBUF_POW2|FCBUF_LOCKFREE|FCBUF_BROADCAST)) return pos + n;
+	return (pos + n) % cbuf->max;
+}
+
+// Wall clock in ns. clock() adds up the CPU time of every thread, which says nothing about how long
+// a multi-threaded run took.
+static uint64_t circular_buf_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec*1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+#ifdef CBUF_STATS
+// Each thread gets a shard number the first time it counts something, and keeps it for every buffer
+static circular_buf_stat_shard_t *circular_buf_stat_shard(cbuf_handle_t cbuf)
+{
+	static uint32_t nextShard;
+	static __thread uint32_t shard; // 0 = not assigned yet
+	
+	if (shard == 0) shard = __atomic_add_fetch(&nextShard,1,__ATOMIC_RELAXED);
+	return &cbuf->stats[(shard - 1) % CBUF_STATS_SHARDS];
+}
+
+static void circular_buf_stat_high_water(cbuf_handle_t cbuf, uint64_t size)
+{
+	uint64_t seen = __atomic_load_n(&cbuf->highWater,__ATOMIC_RELAXED);
+	
+	while (size > seen && !__atomic_compare_exchange_n(&cbuf->highWater,&seen,size,true,__ATOMIC_RELAXED,__ATOMIC_RELAXED))
+		;
+}
+
+#ifdef CBUF_STATS_LATENCY
+static void circular_buf_stat_latency(uint64_t * hist, uint64_t ns)
+{
+	uint32_t bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+	__atomic_fetch_add(&hist[bucket < CBUF_STATS_BUCKETS ? bucket : CBUF_STATS_BUCKETS - 1],1,__ATOMIC_RELAXED);
+}
+#endif
+#endif
+
+// Takes cbuf->mutex. With CBUF_STATS an uncontended lock costs one trylock as before, only when it
+// is busy the wait is counted and timed.
+static inline void circular_buf_lock(cbuf_handle_t cbuf)
+{
+#ifdef CBUF_STATS
+	uint64_t start;
+	
+	if (pthread_mutex_trylock(&cbuf->mutex) == 0) return;
+	start = circular_buf_now_ns();
+	pthread_mutex_lock(&cbuf->mutex);
+	CBUF_STAT_ADD(cbuf,lockContended,1);
+	CBUF_STAT_ADD(cbuf,lockWaitNs,circular_buf_now_ns() - start);
+#else
+	pthread_mutex_lock(&cbuf->mutex);
+#endif
+}
+
+// Adds up the shards into stats. The counters are read without stopping the threads, so a snapshot taken
+// while they run is only consistent counter by counter. Returns -1 (and zeroes except overwrites) when the
+// statistics were not compiled in.
+int circular_buf_get_stats(cbuf_handle_t cbuf, circular_buf_stats_t * stats)
+{
+	assert(cbuf && stats);
+	
+	memset(stats,0,sizeof(*stats));
+	stats->overwrites = circular_buf_get_overwrites(cbuf);
+#ifdef CBUF_STATS
+	uint32_t i;
+	
+	stats->highWater = __atomic_load_n(&cbuf->highWater,__ATOMIC_RELAXED);
+	for (i = 0; i < CBUF_STATS_SHARDS; i++)
+	{
+		circular_buf_stat_shard_t *shard = &cbuf->stats[i];
+		stats->puts += __atomic_load_n(&shard->puts,__ATOMIC_RELAXED);
+		stats->gets += __atomic_load_n(&shard->gets,__ATOMIC_RELAXED);
+		stats->emptyGets += __atomic_load_n(&shard->emptyGets,__ATOMIC_RELAXED);
+		stats->lockContended += __atomic_load_n(&shard->lockContended,__ATOMIC_RELAXED);
+		stats->lockWaitNs += __atomic_load_n(&shard->lockWaitNs,__ATOMIC_RELAXED);
+		stats->waitSpins += __atomic_load_n(&shard->waitSpins,__ATOMIC_RELAXED);
+		stats->waitYields += __atomic_load_n(&shard->waitYields,__ATOMIC_RELAXED);
+		stats->waitParks += __atomic_load_n(&shard->waitParks,__ATOMIC_RELAXED);
+		stats->waitNs += __atomic_load_n(&shard->waitNs,__ATOMIC_RELAXED);
+#ifdef CBUF_STATS_LATENCY
+		uint32_t j;
+		for (j = 0; j < CBUF_STATS_BUCKETS; j++)
+		{
+			stats->putLatency[j] += __atomic_load_n(&shard->putLatency[j],__ATOMIC_RELAXED);
+			stats->getLatency[j] += __atomic_load_n(&shard->getLatency[j],__ATOMIC_RELAXED);
+		}
+#endif
+	}
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+void circular_buf_reset_stats(cbuf_handle_t cbuf)
+{
+	assert(cbuf);
+#ifdef CBUF_STATS
+	memset(cbuf->stats,0,sizeof(cbuf->stats));
+	cbuf->highWater = 0;
+#endif
+}
+
+// FCBUF_WRITE_TIMESTAMP clock: CLOCK_MONOTONIC_COARSE in ns, a vDSO read of the last tick (a few ms resolution),
+// much cheaper than the precise clock on every put. Use it to build the windows for circular_buf_find_time.
+uint64_t circular_buf_timestamp(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE,&ts);
+	return (uint64_t)ts.tv_sec*1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Stamps the n slots starting at position pos with the same time, called under the lock so the
+// stamps never go backwards in ring order
+static void circular_buf_stamp(cbuf_handle_t cbuf, uint64_t pos, uint32_t n)
+{
+	uint64_t now = circular_buf_timestamp();
+	uint32_t index = circular_buf_index(cbuf,pos);
+	
+	while (n--)
+	{
+		cbuf->stamps[index] = now;
+		if (++index == cbuf->max) index = 0;
+	}
+}
+
+// Binary search over the items in ring order (offset 0 is the oldest): first offset whose stamp is >= t,
+// or > t when after is set. Returns size when there is none.
+static uint32_t circular_buf_search_time(cbuf_handle_t cbuf, uint32_t size, uint64_t t, bool after)
+{
+	uint32_t lo = 0, hi = size;
+	
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo)/2;
+		uint64_t stamp = cbuf->stamps[circular_buf_index(cbuf,circular_buf_forward(cbuf,cbuf->tail,mid))];
+		if (stamp < t || (after && stamp == t))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// Finds the items put between from and to (ns of circular_buf_timestamp, both included) in O(log n).
+// first/last get the offsets of the oldest and newest of them, counted from the oldest item in the buffer,
+// ready for circular_buf_read_at. Returns -1 when no item falls in the window (or no FCBUF_WRITE_TIMESTAMP).
+// The offsets are only good until a consumer or an overwrite moves the tail.
+int circular_buf_find_time(cbuf_handle_t cbuf, uint64_t from, uint64_t to, uint32_t * first, uint32_t * last)
+{
+	uint32_t size, lo, hi;
+	
+	assert(cbuf && first && last);
+	
+	if (cbuf->stamps == NULL || from > to) return -1;
+	
+	circular_buf_lock(cbuf);
+	size = circular_buf_size_locked(cbuf);
+	lo = circular_buf_search_time(cbuf,size,from,false);
+	hi = circular_buf_search_time(cbuf,size,to,true);
+	pthread_mutex_unlock(&cbuf->mutex);
+	
+	if (lo >= hi) return -1;
+	*first = lo;
+	*last = hi - 1;
+	return 0;
+}
+
+// Copies up to n items starting offset items after the oldest one, without taking them out.
+// Returns the number of items copied. Mutex modes only.
+uint32_t circular_buf_read_at(cbuf_handle_t cbuf, uint32_t offset, void * data, uint32_t n)
+{
+	uint32_t size;
+	
+	assert(cbuf && (data || n == 0));
+	
+	if (cbuf->flags & (FCBUF_LOCKFREE|FCBUF_RECORDS|FCBUF_BROADCAST|FCBUF_SHARED)) return 0;
+	
+	circular_buf_lock(cbuf);
+	size = circular_buf_size_locked(cbuf);
+	if (offset >= size) n = 0;
+	else if (n > size - offset) n = size - offset;
+	if (n > 0)
+		circular_buf_copy_out(cbuf,circular_buf_index(cbuf,circular_buf_forward(cbuf,cbuf->tail,offset)),data,n);
+	pthread_mutex_unlock(&cbuf->mutex);
+	return n;
+}
+
+// Calls visit on the items in the buffer, oldest first, in place and without taking them out: once for the
+// run up to the end of the buffer and once for the run after the wrap (once with FCBUF_MIRRORED, once per
+// chunk with FCBUF_SEGMENTED). The lock is held meanwhile, so nothing is put, taken or overwritten under the
+// visitor's feet, and the visitor must not call into the same buffer. Mutex modes only.
+// Returns -1 when the mode has no in place scan, otherwise 0 or the non zero value visit stopped with.
+int circular_buf_scan(cbuf_handle_t cbuf, circular_buf_visit_t visit, void * arg)
+{
+	uint32_t size, index, run;
+	int result = 0;
+	
+	assert(cbuf && visit);
+	
+	if (cbuf->flags & (FCBUF_LOCKFREE|FCBUF_RECORDS|FCBUF_BROADCAST|FCBUF_SHARED)) return -1;
+	
+	circular_buf_lock(cbuf);
+	size = circular_buf_size_locked(cbuf);
+	index = circular_buf_index(cbuf,cbuf->tail);
+	while (size > 0 && result == 0)
+	{
+		if (cbuf->segments) run = cbuf->segMask + 1 - (index & cbuf->segMask);
+		else run = (cbuf->flags & FCBUF_MIRRORED) ? size : cbuf->max - index;
+		if (run > size) run = size;
+		result = visit(cbuf->segments ? circular_buf_segment_slot(cbuf,index,false) : (char *)cbuf->buffer + (size_t)index*cbuf->elemSize,run,arg);
+		size -= run;
+		index = (index + run == cbuf->max) ? 0 : index + run;
+	}
+	pthread_mutex_unlock(&cbuf->mutex);
+	return result;
+}
+
+// Aggregate kernels, one per element type. Each keeps CBUF_AGGREGATE_LANES sums, minimums, maximums and
+// match counts that do not depend on each other, so at -O3 the compiler turns the inner loop into vector
+// instructions (SSE2 by default, AVX2/AVX-512 with -march) without -ffast-math: no reassociation is needed,
+// lane j only ever sees items j, j + LANES, ... The lanes are combined once per span.
+#define CIRCULAR_BUF_AGGREGATE_KERNEL(name, type, acc, minValue, maxValue, isInt)                             \
+static void name(const type * p, uint32_t n, const type * lo, const type * hi, circular_buf_aggregate_t * agg) \
+{                                                                                                            \
+	acc sum[CBUF_AGGREGATE_LANES] = { 0 };                                                                   \
+	type mn[CBUF_AGGREGATE_LANES], mx[CBUF_AGGREGATE_LANES];                                                 \
+	uint32_t hits[CBUF_AGGREGATE_LANES] = { 0 };                                                             \
+	type low = lo ? *lo : (minValue), high = hi ? *hi : (maxValue);                                          \
+	acc total = 0;                                                                                           \
+	uint32_t i, j;                                                                                           \
+	                                                                                                         \
+	for (j = 0; j < CBUF_AGGREGATE_LANES; j++) { mn[j] = (maxValue); mx[j] = (minValue); }                   \
+	for (i = 0; i + CBUF_AGGREGATE_LANES <= n; i += CBUF_AGGREGATE_LANES)                                    \
+		for (j = 0; j < CBUF_AGGREGATE_LANES; j++)                                                           \
+		{                                                                                                    \
+			type v = p[i + j];                                                                               \
+			sum[j] += (v == v) ? v : 0; /* NaN never equals itself, integers always do */                   \
+			mn[j] = (v < mn[j]) ? v : mn[j];                                                                 \
+			mx[j] = (v > mx[j]) ? v : mx[j];                                                                 \
+			hits[j] += (v >= low) & (v <= high);                                                             \
+		}                                                                                                    \
+	for (; i < n; i++)                                                                                       \
+	{                                                                                                        \
+		type v = p[i];                                                                                       \
+		sum[0] += (v == v) ? v : 0;                                                                          \
+		mn[0] = (v < mn[0]) ? v : mn[0];                                                                     \
+		mx[0] = (v > mx[0]) ? v : mx[0];                                                                     \
+		hits[0] += (v >= low) & (v <= high);                                                                 \
+	}                                                                                                        \
+	                                                                                                         \
+	for (j = 0; j < CBUF_AGGREGATE_LANES; j++)                                                               \
+	{                                                                                                        \
+		total += sum[j];                                                                                     \
+		agg->matches += hits[j];                                                                             \
+		if (mn[j] < agg->min) agg->min = mn[j];                                                              \
+		if (mx[j] > agg->max) agg->max = mx[j];                                                              \
+	}                                                                                                        \
+	agg->count += n;                                                                                         \
+	agg->sum += (double)total;                                                                               \
+	if (isInt) agg->isum += (int64_t)total;                                                                  \
+}
+
+CIRCULAR_BUF_AGGREGATE_KERNEL(circular_buf_aggregate_u32, uint32_t, uint64_t, 0, UINT32_MAX, 1)
+CIRCULAR_BUF_AGGREGATE_KERNEL(circular_buf_aggregate_i32, int32_t, int64_t, INT32_MIN, INT32_MAX, 1)
+CIRCULAR_BUF_AGGREGATE_KERNEL(circular_buf_aggregate_f32, float, double, -__builtin_inff(), __builtin_inff(), 0)
+CIRCULAR_BUF_AGGREGATE_KERNEL(circular_buf_aggregate_f64, double, double, -__builtin_inf(), __builtin_inf(), 0)
+
+typedef struct {
+	uint32_t type;
+	const void * lo;
+	const void * hi;
+	circular_buf_aggregate_t * agg;
+} circular_buf_aggregate_arg_t;
+
+// count, count if (lo <= value <= hi, NULL = no bound), sum, min and max of a buffer of CBUF_TYPE_* items,
+// computed in place over circular_buf_scan, nothing is copied or taken out. NaNs are in count, but left
+// out of the sum, the min, the max and the matches. Returns 0, -1 when elemSize does not fit the type or the mode has no scan.
+int circular_buf_aggregate(cbuf_handle_t cbuf, uint32_t type, const void * lo, const void * hi, circular_buf_aggregate_t * agg)
+{
+	static const uint32_t sizes[] = { sizeof(uint32_t), sizeof(int32_t), sizeof(float), sizeof(double) };
+	circular_buf_aggregate_arg_t arg = { type, lo, hi, agg };
+	
+	assert(cbuf && agg && type <= CBUF_TYPE_F64);
+	
+	memset(agg,0,sizeof(*agg));
+	agg->min = __builtin_inf();
+	agg->max = -__builtin_inf();
+	if (cbuf->elemSize != sizes[type]) return -1;
+	return circular_buf_scan(cbuf,circular_buf_aggregate_visit,&arg);
+}
+
+static int circular_buf_aggregate_visit(const void * items, uint32_t n, void * arg)
+{
+	circular_buf_aggregate_arg_t *a = arg;
+	
+	switch (a->type)
+	{
+		case CBUF_TYPE_U32: circular_buf_aggregate_u32(items,n,a->lo,a->hi,a->agg); break;
+		case CBUF_TYPE_I32: circular_buf_aggregate_i32(items,n,a->lo,a->hi,a->agg); break;
+		case CBUF_TYPE_F32: circular_buf_aggregate_f32(items,n,a->lo,a->hi,a->agg); break;
+		default: circular_buf_aggregate_f64(items,n,a->lo,a->hi,a->agg); break;
+	}
+	return 0;
+}
+
+// Copies count elements into the buffer starting at slot index, at most two memcpy (before and after the wrap),
+// only one with FCBUF_MIRRORED
+static void circular_buf_copy_in(cbuf_handle_t cbuf, uint32_t index, const char * src, uint32_t count)
+{
+	uint32_t first = cbuf->max - index;
+	
+	if (cbuf->segments) { circular_buf_segment_copy(cbuf,index,(char *)src,count,true); return; }
+	if ((cbuf->flags & FCBUF_MIRRORED) || first > count) first = count;
+	memcpy((char *)cbuf->buffer + (size_t)index*cbuf->elemSize,src,(size_t)first*cbuf->elemSize);
+	if (count > first)
+		memcpy(cbuf->buffer,src + (size_t)first*cbuf->elemSize,(size_t)(count - first)*cbuf->elemSize);
+}
+
+// Copies count elements out of the buffer starting at slot index, at most two memcpy (before and after the wrap)
+static void circular_buf_copy_out(cbuf_handle_t cbuf, uint32_t index, char * dst, uint32_t count)
+{
+	uint32_t first = cbuf->max - index;
+	
+	if (cbuf->segments) { circular_buf_segment_copy(cbuf,index,dst,count,false); return; }
+	if ((cbuf->flags & FCBUF_MIRRORED) || first > count) first = count;
+	memcpy(dst,(char *)cbuf->buffer + (size_t)index*cbuf->elemSize,(size_t)first*cbuf->elemSize);
+	if (count > first)
+		memcpy(dst + (size_t)first*cbuf->elemSize,cbuf->buffer,(size_t)(count - first)*cbuf->elemSize);
+}
+
+// Copies count elements from ring src (srcMax slots, starting at slot srcIndex) to ring dst (dstMax slots,
+// starting at slot dstIndex), wrapping on both sides
+static void circular_buf_copy_ring(uint32_t elemSize, char * dst, uint32_t dstMax, uint32_t dstIndex, const char * src, uint32_t srcMax, uint32_t srcIndex, uint32_t count)
+{
+	while (count > 0)
+	{
+		uint32_t run = count;
+		
+		if (run > srcMax - srcIndex) run = srcMax - srcIndex;
+		if (run > dstMax - dstIndex) run = dstMax - dstIndex;
+		memcpy(dst + (size_t)dstIndex*elemSize,src + (size_t)srcIndex*elemSize,(size_t)run*elemSize);
+		
+		count -= run;
+		srcIndex = (srcIndex + run) % srcMax;
+		dstIndex = (dstIndex + run) % dstMax;
+	}
+}
+
+// One item. For 4, 8 and 16 byte items the memcpy has a constant size, so the compiler makes it a single
+// load and store (one SSE move for 16 bytes) instead of a call into memcpy that first has to look at the size.
+// Runs of items (the bulk calls, copy_in/copy_out across the wrap, segmented chunks) keep calling memcpy: glibc
+// already picks an AVX2/AVX-512 version for the CPU at load time, and no hand written loop beat it here.
+static inline void circular_buf_copy_elem(cbuf_handle_t cbuf, void * dst, const void * src)
+{
+	switch (cbuf->elemSize)
+	{
+		case 4: memcpy(dst,src,4); break;
+		case 8: memcpy(dst,src,8); break;
+		case 16: memcpy(dst,src,16); break;
+		default: memcpy(dst,src,cbuf->elemSize);
+	}
+}
+
+static void advance_pointer(cbuf_handle_t cbuf)
+{
+	assert(cbuf);
+	
+	if (cbuf->flags & FCBUF_POW2)
+	{
+		// no wrap and no full flag: full is head - tail == max
+		if (cbuf->head - cbuf->tail == cbuf->max)
+		{
+			__atomic_store_n(&cbuf->tail,cbuf->tail + 1,__ATOMIC_RELEASE);
+			cbuf->overwrites++;
+		}
+		__atomic_store_n(&cbuf->head,cbuf->head + 1,__ATOMIC_RELEASE);
+		if (cbuf->segments) circular_buf_segment_trim(cbuf);
+		return;
+	}
+
+    if(cbuf->full)
+   	{
+		if (++(cbuf->tail) == cbuf->max) 
+		{ 
+			cbuf->tail = 0;
+		}
+	    cbuf->overwrites++;
+	}
+
+	if (++(cbuf->head) == cbuf->max) 
+	{ 
+		cbuf->head = 0;
+	}
+	cbuf->full = (cbuf->head == cbuf->tail);
+    
+}
+
+static void retreat_pointer(cbuf_handle_t cbuf)
+{
+	assert(cbuf);
+    
+    cbuf->full = false;
+    cbuf->consumed++;
+    if (cbuf->flags & FCBUF_POW2)
+    {
+        __atomic_store_n(&cbuf->tail,cbuf->tail + 1,__ATOMIC_RELEASE);
+        if (cbuf->segments) circular_buf_segment_trim(cbuf);
+        return;
+    }
+	if (++(cbuf->tail) == cbuf->max) 
+	{ 
+		cbuf->tail = 0;
+	}
+}
+
+ // Returns 0 when the item was stored, -1 when the buffer is full and must not be overwritten
+ // (with FCBUF_BLOCKING_PUT only after waiting for space up to the timeout)
+int circular_buf_put(cbuf_handle_t cbuf, const void * data)
+{
+	int result;
+	CBUF_STAT_CLOCK(start);
+	
+	assert(cbuf); // not cbuf->buffer: circular_buf_resize swaps it under the lock, init already refuses a ring without one
+
+    if (cbuf->flags & FCBUF_BLOCKING_PUT) result = circular_buf_put_timed(cbuf,data,cbuf->timeoutUs);
+    else result = circular_buf_try_put(cbuf,data);
+    CBUF_STAT_LATENCY(cbuf,putLatency,start);
+    return result;
+}
+
+ // Returns 0 when an item was read, -1 when the buffer is empty
+ // (with FCBUF_BLOCKING_GET only after waiting for data up to the timeout)
+int circular_buf_get(cbuf_handle_t cbuf, void * data)
+{
+    int result;
+    CBUF_STAT_CLOCK(start);
+    
+    assert(cbuf && data);
+    
+    if (cbuf->flags & FCBUF_BLOCKING_GET) result = circular_buf_get_timed(cbuf,data,cbuf->timeoutUs);
+    else result = circular_buf_try_get(cbuf,data);
+    CBUF_STAT_LATENCY(cbuf,getLatency,start);
+    return result;
+}
+
+static int circular_buf_try_put(cbuf_handle_t cbuf, const void * data)
+{
+    int result;
+    
+    if (cbuf->flags & FCBUF_SHARED) result = circular_buf_put_shm(cbuf,data);
+    else if (cbuf->flags & FCBUF_SPSC) result = circular_buf_put_spsc(cbuf,data);
+    else if (cbuf->flags & FCBUF_MPMC) result = circular_buf_put_mpmc(cbuf,data);
+    else if (cbuf->flags & FCBUF_BROADCAST) result = circular_buf_put_broadcast(cbuf,data);
+    else if (cbuf->flags & FCBUF_RECORDS) result = circular_buf_put_record_mutex(cbuf,data,cbuf->elemSize);
+    else {
+      result = circular_buf_put_mutex(cbuf,data);
+      while (result == -1 && (cbuf->flags & FCBUF_RESIZE_AUTO) && circular_buf_grow(cbuf,0) == 0)
+        result = circular_buf_put_mutex(cbuf,data);
+    }
+    
+    if (result == 0)
+    {
+      CBUF_STAT_ADD(cbuf,puts,1);
+      if (cbuf->file) circular_buf_sync_maybe(cbuf,1);
+      if (cbuf->flags & (FCBUF_LOCKFREE|FCBUF_SHARED)) CBUF_STAT_HIGH_WATER(cbuf,circular_buf_size(cbuf)); // the locked paths do it under the lock
+    }
+    if (result == 0 && (cbuf->flags & FCBUF_BLOCKING_GET))
+      circular_buf_wake(&cbuf->dataEvent,&cbuf->dataWaiters,1);
+    if (result == 0 && (cbuf->flags & FCBUF_EVENTFD))
+      circular_buf_signal(cbuf->readFd,&cbuf->readArmed);
+    return result;
+}
+
+static int circular_buf_try_get(cbuf_handle_t cbuf, void * data)
+{
+    int result;
+    
+    if (cbuf->flags & FCBUF_SHARED) result = circular_buf_get_shm(cbuf,data);
+    else if (cbuf->flags & FCBUF_SPSC) result = circular_buf_get_spsc(cbuf,data);
+    else if (cbuf->flags & FCBUF_MPMC) result = circular_buf_get_mpmc(cbuf,data);
+    else if (cbuf->flags & FCBUF_BROADCAST) result = -1; // consumers read with circular_buf_get_from
+    else if (cbuf->flags & FCBUF_RECORDS) result = (circular_buf_get_record_mutex(cbuf,data) < 0) ? -1 : 0;
+    else result = circular_buf_get_mutex(cbuf,data);
+    
+    if (result == 0) CBUF_STAT_ADD(cbuf,gets,1);
+    else if (!(cbuf->flags & FCBUF_BLOCKING_GET)) CBUF_STAT_ADD(cbuf,emptyGets,1); // blocking gets count when they give up
+    if (result == 0 && (cbuf->flags & FCBUF_BLOCKING_PUT))
+      circular_buf_wake(&cbuf->spaceEvent,&cbuf->spaceWaiters,1);
+    if (result == 0 && (cbuf->flags & FCBUF_EVENTFD))
+      circular_buf_signal(cbuf->writeFd,&cbuf->writeArmed);
+    return result;
+}
+
+static int circular_buf_put_mutex(cbuf_handle_t cbuf, const void * data)
+{
+    circular_buf_lock(cbuf); 
+    
+    // the slots at head may be reserved, and a full buffer can not drop a peeked item
+    if (cbuf->reserved || (((cbuf->flags & FCBUF_DO_NOT_OVERWRITE) || cbuf->peeked) && circular_buf_full_locked(cbuf)))
+    {
+        pthread_mutex_unlock(&cbuf->mutex);
+        return -1;
+    }
+    
+    //cbuf->buffer[cbuf->head] = data;
+    char *p = (char *)cbuf->buffer;
+    if (cbuf->segments)
+    {
+        if ((p = circular_buf_segment_slot(cbuf,circular_buf_index(cbuf,cbuf->head),true)) == NULL)
+        {
+            pthread_mutex_unlock(&cbuf->mutex);
+            return -1;
+        }
+    }
+    else
+        p += ((size_t)circular_buf_index(cbuf,cbuf->head)*cbuf->elemSize);
+    if (cbuf->seq) circular_buf_seq_begin(cbuf,cbuf->head,1);
+    circular_buf_copy_elem(cbuf,p,data);
+    if (cbuf->seq) circular_buf_seq_end(cbuf,cbuf->head,1);
+    if (cbuf->stamps) circular_buf_stamp(cbuf,cbuf->head,1);
+    
+    //memcpy(&cbuf->buffer[cbuf->head],data,cbuf->elemSize);
+    advance_pointer(cbuf);
+    circular_buf_persist(cbuf);
+    CBUF_STAT_HIGH_WATER(cbuf,circular_buf_size_locked(cbuf));
+    pthread_mutex_unlock(&cbuf->mutex);
+    return 0;
+}
+
+static int circular_buf_get_mutex(cbuf_handle_t cbuf, void * data)
+{
+    int result;
+    
+    circular_buf_lock(cbuf);
+    if(!cbuf->peeked && !circular_buf_empty(cbuf))
+    {
+        
+         char *p = (char *)cbuf->buffer;
+         if (cbuf->segments) p = circular_buf_segment_slot(cbuf,circular_buf_index(cbuf,cbuf->tail),false);
+         else p += ((size_t)circular_buf_index(cbuf,cbuf->tail)*cbuf->elemSize);
+         circular_buf_copy_elem(cbuf,data,p);
+         //memmove(data,p,cbuf->elemSize);
+        //*data = cbuf->buffer[cbuf->tail];
+        //memcpy(data,&cbuf->buffer[cbuf->tail],cbuf->elemSize);
+        retreat_pointer(cbuf);
+        cbuf->full = false;
+        circular_buf_persist(cbuf);
+        result = 0;
+    } else 
+      result = -1;
+    
+    pthread_mutex_unlock(&cbuf->mutex);
+    
+    return result;
+}
+
+// Blocking put/get.
+// Waiters register in *Waiters before checking the buffer one last time and then sleep on the futex *Event
+// with the value they saw before registering. The other side only pays a fence and a load per operation:
+// it bumps the event and calls futex_wake only when there is somebody registered, so a missed wakeup is
+// impossible (either the waiter sees the new item, or the waker sees the waiter) and idle rings make no syscalls.
+// Only available when the ring was created with FCBUF_BLOCKING_GET / FCBUF_BLOCKING_PUT, otherwise the
+// calls below behave like a plain (non blocking) get/put. timeoutUs = 0 waits forever.
+// They wait the way circular_buf_set_wait chose (by default they park right away).
+int circular_buf_put_timed(cbuf_handle_t cbuf, const void * data, uint32_t timeoutUs)
+{
+	if (!(cbuf->flags & FCBUF_BLOCKING_PUT)) return circular_buf_try_put(cbuf,data);
+	return circular_buf_wait(cbuf,(void *)data,true,timeoutUs,cbuf->waitStrategy);
+}
+
+int circular_buf_get_timed(cbuf_handle_t cbuf, void * data, uint32_t timeoutUs)
+{
+	if (!(cbuf->flags & FCBUF_BLOCKING_GET)) return circular_buf_try_get(cbuf,data);
+	return circular_buf_wait(cbuf,data,false,timeoutUs,cbuf->waitStrategy);
+}
+
+// Like put_timed/get_timed, but with this call's CBUF_WAIT_* strategy and on any ring. CBUF_WAIT_PARK needs
+// the ring's FCBUF_BLOCKING_PUT (GET) for somebody to wake it up, without it the call yields instead.
+int circular_buf_put_wait(cbuf_handle_t cbuf, const void * data, uint32_t timeoutUs, uint32_t strategy)
+{
+	assert(cbuf && strategy <= CBUF_WAIT_YIELD);
+	return circular_buf_wait(cbuf,(void *)data,true,timeoutUs,strategy);
+}
+
+int circular_buf_get_wait(cbuf_handle_t cbuf, void * data, uint32_t timeoutUs, uint32_t strategy)
+{
+	assert(cbuf && data && strategy <= CBUF_WAIT_YIELD);
+	return circular_buf_wait(cbuf,data,false,timeoutUs,strategy);
+}
+
+void circular_buf_set_timeout(cbuf_handle_t cbuf, uint32_t timeoutUs)
+{
+	assert(cbuf);
+	cbuf->timeoutUs = timeoutUs;
+}
+
+// How blocking put/get of this ring wait: a CBUF_WAIT_* strategy and the rounds spun before yielding or
+// parking (ignored by CBUF_WAIT_SPIN). Each round pauses twice as long as the one before, up to
+// CBUF_WAIT_BACKOFF_MAX pauses, so a budget of a few dozen rounds covers some microseconds.
+void circular_buf_set_wait(cbuf_handle_t cbuf, uint32_t strategy, uint32_t spins)
+{
+	assert(cbuf && strategy <= CBUF_WAIT_YIELD);
+	cbuf->waitStrategy = strategy;
+	cbuf->waitSpins = spins;
+}
+
+// Puts (gets) data, waiting up to timeoutUs (0 = forever) for room (an item). A waiting get only tries again
+// once circular_buf_size (atomic loads, or just the lock in the plain mutex mode) says there is an item, so it
+// does not bump the empty get counter on every round. A put that finds no room counts nothing, it just tries.
+static int circular_buf_wait(cbuf_handle_t cbuf, void * data, bool put, uint32_t timeoutUs, uint32_t strategy)
+{
+	uint32_t *event = put ? &cbuf->spaceEvent : &cbuf->dataEvent;
+	uint32_t *waiters = put ? &cbuf->spaceWaiters : &cbuf->dataWaiters;
+	uint32_t round, backoff = 1, i;
+	uint64_t deadline;
+	struct timespec ts;
+	int result;
+	
+	result = put ? circular_buf_try_put(cbuf,data) : circular_buf_try_get(cbuf,data);
+	if (result == 0) return 0;
+	
+	if (strategy == CBUF_WAIT_PARK && !(cbuf->flags & (put ? FCBUF_BLOCKING_PUT : FCBUF_BLOCKING_GET)))
+		strategy = CBUF_WAIT_YIELD; // nobody would wake it
+	deadline = circular_buf_now_ns() + (uint64_t)timeoutUs*1000;
+	ts.tv_sec = deadline / 1000000000ull;
+	ts.tv_nsec = deadline % 1000000000ull;
+#ifdef CBUF_STATS
+	uint64_t start = circular_buf_now_ns();
+#endif
+	
+	for (round = 0; ; round++)
+	{
+		if (strategy == CBUF_WAIT_SPIN || round < cbuf->waitSpins)
+		{
+			for (i = 0; i < backoff; i++)
+				circular_buf_cpu_relax();
+			if (backoff < CBUF_WAIT_BACKOFF_MAX) backoff <<= 1;
+			CBUF_STAT_ADD(cbuf,waitSpins,1);
+		}
+		else if (strategy == CBUF_WAIT_YIELD)
+		{
+			sched_yield();
+			CBUF_STAT_ADD(cbuf,waitYields,1);
+		}
+		else
+		{
+			uint32_t seen = __atomic_load_n(event,__ATOMIC_ACQUIRE);
+			__atomic_fetch_add(waiters,1,__ATOMIC_SEQ_CST);
+			result = put ? circular_buf_try_put(cbuf,data) : circular_buf_try_get(cbuf,data);
+			if (result != 0)
+			{
+				circular_buf_futex_wait(event,seen,timeoutUs ? &ts : NULL);
+				CBUF_STAT_ADD(cbuf,waitParks,1);
+			}
+			__atomic_fetch_sub(waiters,1,__ATOMIC_RELAXED);
+			if (result == 0) break;
+		}
+		
+		if (put || circular_buf_size(cbuf) > 0)
+		{
+			result = put ? circular_buf_try_put(cbuf,data) : circular_buf_try_get(cbuf,data);
+			if (result == 0) break;
+		}
+		if (timeoutUs && circular_buf_now_ns() >= deadline)
+		{
+			if (!put && (cbuf->flags & FCBUF_BLOCKING_GET)) CBUF_STAT_ADD(cbuf,emptyGets,1); // try_get did not count it
+			break;
+		}
+	}
+#ifdef CBUF_STATS
+	CBUF_STAT_ADD(cbuf,waitNs,circular_buf_now_ns() - start);
+#endif
+	return result;
+}
+
+// The pause of a spin wait: tells the core we are spinning (on x86 it also saves the pipeline flush when the
+// line we watch changes) and is a compiler barrier, so the next look at the ring really loads again.
+static inline void circular_buf_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__asm__ __volatile__("pause" ::: "memory");
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield" ::: "memory");
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+static void circular_buf_wake(uint32_t * event, uint32_t * waiters, uint32_t count)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST); // pairs with the waiter registering before its last check
+	if (__atomic_load_n(waiters,__ATOMIC_RELAXED) == 0) return;
+	
+	__atomic_fetch_add(event,1,__ATOMIC_RELEASE);
+	syscall(SYS_futex,event,FUTEX_WAKE_PRIVATE,count > INT_MAX ? INT_MAX : (int)count,NULL,NULL,0);
+}
+
+// FCBUF_EVENTFD: readiness for event loops. The ring owns two non blocking eventfds, one that becomes readable
+// when items arrive (CBUF_EVENT_READABLE) and one when room frees up (CBUF_EVENT_WRITABLE), to add to an
+// epoll set. Like the futex wakeups above, they are written only when somebody asked: after a signal the
+// fd stays quiet until circular_buf_event_ack, so a burst of puts costs one write, not one per item.
+// The loop acks first and then gets until the ring is empty (puts until it is full), never the other way
+// round: whatever comes after the ack signals again, and whatever came before it is drained by that loop.
+// Returns the fd, -1 when the ring was not created with FCBUF_EVENTFD. circular_buf_free closes them.
+int circular_buf_event_fd(cbuf_handle_t cbuf, uint32_t event)
+{
+	assert(cbuf && (event == CBUF_EVENT_READABLE || event == CBUF_EVENT_WRITABLE));
+	
+	if (!(cbuf->flags & FCBUF_EVENTFD)) return -1;
+	return (event == CBUF_EVENT_READABLE) ? cbuf->readFd : cbuf->writeFd;
+}
+
+// Clears the eventfd and arms it again, see circular_buf_event_fd
+void circular_buf_event_ack(cbuf_handle_t cbuf, uint32_t event)
+{
+	uint64_t value;
+	
+	assert(cbuf && (event == CBUF_EVENT_READABLE || event == CBUF_EVENT_WRITABLE));
+	
+	if (!(cbuf->flags & FCBUF_EVENTFD)) return;
+	(void)!read((event == CBUF_EVENT_READABLE) ? cbuf->readFd : cbuf->writeFd,&value,sizeof(value)); // EAGAIN when not signalled
+	__atomic_store_n((event == CBUF_EVENT_READABLE) ? &cbuf->readArmed : &cbuf->writeArmed,1,__ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST); // armed before the caller looks at the ring again, pairs with circular_buf_signal
+}
+
+// Creates the eventfds, armed, and signals the ones whose condition already holds (a reopened file ring
+// may have items)
+static int circular_buf_open_events(cbuf_handle_t cbuf)
+{
+	cbuf->readFd = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+	cbuf->writeFd = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+	if (cbuf->readFd < 0 || cbuf->writeFd < 0) return -1;
+	
+	cbuf->readArmed = 1;
+	cbuf->writeArmed = 1;
+	if (!circular_buf_empty(cbuf)) circular_buf_signal(cbuf->readFd,&cbuf->readArmed);
+	if (!circular_buf_full(cbuf)) circular_buf_signal(cbuf->writeFd,&cbuf->writeArmed);
+	return 0;
+}
+
+// Writes to the eventfd if it is armed, disarming it
+static void circular_buf_signal(int fd, uint32_t * armed)
+{
+	uint64_t one = 1;
+	
+	__atomic_thread_fence(__ATOMIC_SEQ_CST); // pairs with circular_buf_event_ack arming before the ring is looked at
+	if (!__atomic_load_n(armed,__ATOMIC_RELAXED) || !__atomic_exchange_n(armed,0,__ATOMIC_ACQ_REL)) return;
+	(void)!write(fd,&one,sizeof(one));
+}
+
+// Sleeps while *event == seen, until woken or the absolute CLOCK_MONOTONIC deadline (NULL = no deadline).
+// Returns 1 when the deadline has passed, 0 otherwise (woken, spurious wakeup or *event already moved).
+static int circular_buf_futex_wait(uint32_t * event, uint32_t seen, const struct timespec * deadline)
+{
+	long ret = syscall(SYS_futex,event,FUTEX_WAIT_BITSET_PRIVATE,seen,deadline,NULL,FUTEX_BITSET_MATCH_ANY);
+	
+	return (ret == -1 && errno == ETIMEDOUT) ? 1 : 0;
+}
+
+uint8_t circular_buf_get2(cbuf_handle_t cbuf)
 {
     uint8_t aux;
     
-    if(!circular_buf_empty(cbuf))
-    {
-        aux = cbuf->buffer[cbuf->tail];
-        retreat_pointer(cbuf);
-        return aux; 
+    if(!circular_buf_empty(cbuf))
+    {
+        aux = cbuf->buffer[circular_buf_index(cbuf,cbuf->tail)];
+        retreat_pointer(cbuf);
+        return aux; 
+    }
+
+    return 0;
+}
+
+bool circular_buf_empty(circular_buf_t* cbuf)
+{
+	// We define empty as head == tail
+    //return (cbuf->head == cbuf->tail);
+    if (cbuf->flags & (FCBUF_BROADCAST|FCBUF_SHARED))
+        return (circular_buf_size(cbuf) == 0);
+    if (cbuf->flags & (FCBUF_LOCKFREE|FCBUF_POW2))
+        return (__atomic_load_n(&cbuf->head,__ATOMIC_ACQUIRE) == __atomic_load_n(&cbuf->tail,__ATOMIC_ACQUIRE));
+    return (cbuf->head == cbuf->tail && !(cbuf->full));
+}
+
+// FCBUF_SPSC: exactly one thread calls put and exactly one thread calls get.
+// Each side owns its position and only publishes it with a release store, the other side reads it with
+// an acquire load, so no lock is needed. Each side caches the last position seen from the other one and
+// only touches the other cache line again when the cached value says the buffer is full (or empty).
+static int circular_buf_put_spsc(cbuf_handle_t cbuf, const void * data)
+{
+	uint64_t head = cbuf->head; // only the producer writes head
+	
+	if (head - cbuf->tailCache >= cbuf->max)
+	{
+		cbuf->tailCache = __atomic_load_n(&cbuf->tail,__ATOMIC_ACQUIRE);
+		if (head - cbuf->tailCache >= cbuf->max) return -1;
+	}
+	
+	char *p = (char *)cbuf->buffer;
+	p += (size_t)circular_buf_index(cbuf,head)*cbuf->elemSize;
+	circular_buf_copy_elem(cbuf,p,data);
+	
+	__atomic_store_n(&cbuf->head,head + 1,__ATOMIC_RELEASE);
+	return 0;
+}
+
+static int circular_buf_get_spsc(cbuf_handle_t cbuf, void * data)
+{
+	uint64_t tail = cbuf->tail; // only the consumer writes tail
+	
+	if (tail == cbuf->headCache)
+	{
+		cbuf->headCache = __atomic_load_n(&cbuf->head,__ATOMIC_ACQUIRE);
+		if (tail == cbuf->headCache) return -1;
+	}
+	
+	char *p = (char *)cbuf->buffer;
+	p += (size_t)circular_buf_index(cbuf,tail)*cbuf->elemSize;
+	circular_buf_copy_elem(cbuf,data,p);
+	
+	__atomic_store_n(&cbuf->tail,tail + 1,__ATOMIC_RELEASE);
+	return 0;
+}
+
+uint64_t circular_buf_get_overwrites(cbuf_handle_t cbuf)
+{
+   if (cbuf->flags & FCBUF_SHARED) return __atomic_load_n(&cbuf->shm->lost,__ATOMIC_RELAXED); // never overwrites, but can lose items
+   return __atomic_load_n(&cbuf->overwrites,__ATOMIC_RELAXED);
+}
+
+// Bytes of memory the slots take right now: the whole buffer, except with FCBUF_SEGMENTED where it is
+// the chunks mapped (spares included), which follows how many items the ring holds.
+size_t circular_buf_get_resident(cbuf_handle_t cbuf)
+{
+   size_t bytes;
+   
+   assert(cbuf);
+   if (!cbuf->segments) return cbuf->mapSize ? cbuf->mapSize : ((cbuf->flags & FCBUF_RECORDS) ? cbuf->max : (size_t)cbuf->max*cbuf->elemSize);
+   circular_buf_lock(cbuf);
+   bytes = (size_t)(cbuf->segCount + cbuf->segSpares)*cbuf->segBytes;
+   pthread_mutex_unlock(&cbuf->mutex);
+   return bytes;
+}
+
+// FCBUF_MPMC: bounded queue with one sequence number per slot (D. Vyukov).
+// A slot whose sequence equals the head position is free for that position, a slot whose sequence equals
+// position + 1 holds the item for that position. Producers and consumers claim a position with one CAS on
+// head (or tail), copy the element, and hand the slot over by publishing the next sequence number, so
+// nobody ever waits on a global lock. Only threads racing for the very same position retry.
+static int circular_buf_put_mpmc(cbuf_handle_t cbuf, const void * data)
+{
+	uint64_t pos = __atomic_load_n(&cbuf->head,__ATOMIC_RELAXED);
+	uint64_t *seq;
+	
+	for (;;)
+	{
+		seq = &cbuf->seq[circular_buf_index(cbuf,pos)];
+		int64_t diff = (int64_t)(__atomic_load_n(seq,__ATOMIC_ACQUIRE) - pos);
+		
+		if (diff == 0)
+		{
+			if (__atomic_compare_exchange_n(&cbuf->head,&pos,pos + 1,true,__ATOMIC_RELAXED,__ATOMIC_RELAXED))
+				break;
+		}
+		else if (diff < 0)
+		{
+			// the slot still holds the item from one lap ago
+			// signed: pos may be stale and a consumer already past it, then this is not full at all
+			if ((int64_t)(pos - __atomic_load_n(&cbuf->tail,__ATOMIC_ACQUIRE)) >= (int64_t)cbuf->max)
+			{
+				if (cbuf->flags & FCBUF_DO_NOT_OVERWRITE) return -1;
+				circular_buf_drop_oldest_mpmc(cbuf);
+			}
+			// else a consumer already claimed it and is still copying it out, just try again
+			pos = __atomic_load_n(&cbuf->head,__ATOMIC_RELAXED);
+		}
+		else
+			pos = __atomic_load_n(&cbuf->head,__ATOMIC_RELAXED);
+	}
+	
+	char *p = (char *)cbuf->buffer;
+	p += (size_t)circular_buf_index(cbuf,pos)*cbuf->elemSize;
+	circular_buf_copy_elem(cbuf,p,data);
+	
+	__atomic_store_n(seq,pos + 1,__ATOMIC_RELEASE);
+	return 0;
+}
+
+static int circular_buf_get_mpmc(cbuf_handle_t cbuf, void * data)
+{
+	uint64_t pos = __atomic_load_n(&cbuf->tail,__ATOMIC_RELAXED);
+	uint64_t *seq;
+	
+	for (;;)
+	{
+		seq = &cbuf->seq[circular_buf_index(cbuf,pos)];
+		int64_t diff = (int64_t)(__atomic_load_n(seq,__ATOMIC_ACQUIRE) - (pos + 1));
+		
+		if (diff == 0)
+		{
+			if (__atomic_compare_exchange_n(&cbuf->tail,&pos,pos + 1,true,__ATOMIC_RELAXED,__ATOMIC_RELAXED))
+				break;
+		}
+		else if (diff < 0)
+			return -1; // empty (or the producer of this position has not finished yet)
+		else
+			pos = __atomic_load_n(&cbuf->tail,__ATOMIC_RELAXED);
+	}
+	
+	char *p = (char *)cbuf->buffer;
+	p += (size_t)circular_buf_index(cbuf,pos)*cbuf->elemSize;
+	circular_buf_copy_elem(cbuf,data,p);
+	
+	__atomic_store_n(seq,pos + cbuf->max,__ATOMIC_RELEASE);
+	return 0;
+}
+
+// Overwrite mode: a producer that finds the buffer full consumes the oldest item itself, without copying it
+static int circular_buf_drop_oldest_mpmc(cbuf_handle_t cbuf)
+{
+	uint64_t pos = __atomic_load_n(&cbuf->tail,__ATOMIC_RELAXED);
+	uint64_t *seq = &cbuf->seq[circular_buf_index(cbuf,pos)];
+	
+	if (__atomic_load_n(seq,__ATOMIC_ACQUIRE) != pos + 1) return -1;
+	if (!__atomic_compare_exchange_n(&cbuf->tail,&pos,pos + 1,false,__ATOMIC_RELAXED,__ATOMIC_RELAXED)) return -1;
+	
+	__atomic_store_n(seq,pos + cbuf->max,__ATOMIC_RELEASE);
+	__atomic_fetch_add(&cbuf->overwrites,1,__ATOMIC_RELAXED);
+	return 0;
+}
+
+static uint32_t circular_buf_put_n_spsc(cbuf_handle_t cbuf, const char * data, uint32_t n)
+{
+	uint64_t head = cbuf->head;
+	
+	if (head - cbuf->tailCache + n > cbuf->max)
+		cbuf->tailCache = __atomic_load_n(&cbuf->tail,__ATOMIC_ACQUIRE);
+	
+	uint32_t count = cbuf->max - (uint32_t)(head - cbuf->tailCache);
+	if (count > n) count = n;
+	if (count == 0) return 0;
+	
+	circular_buf_copy_in(cbuf,circular_buf_index(cbuf,head),data,count);
+	__atomic_store_n(&cbuf->head,head + count,__ATOMIC_RELEASE);
+	return count;
+}
+
+static uint32_t circular_buf_get_n_spsc(cbuf_handle_t cbuf, char * data, uint32_t n)
+{
+	uint64_t tail = cbuf->tail;
+	
+	if (cbuf->headCache - tail < n)
+		cbuf->headCache = __atomic_load_n(&cbuf->head,__ATOMIC_ACQUIRE);
+	
+	uint32_t count = (uint32_t)(cbuf->headCache - tail);
+	if (count > n) count = n;
+	if (count == 0) return 0;
+	
+	circular_buf_copy_out(cbuf,circular_buf_index(cbuf,tail),data,count);
+	__atomic_store_n(&cbuf->tail,tail + count,__ATOMIC_RELEASE);
+	return count;
+}
+
+// FCBUF_MPMC bulk put: claims as many consecutive free slots as possible with a single CAS.
+// A slot that is free for its position stays free until someone claims that position, so checking the
+// run first and then moving head over all of it at once is safe. When not even one slot is free it falls
+// back to the single put, which knows how to overwrite (or refuse).
+static uint32_t circular_buf_put_n_mpmc(cbuf_handle_t cbuf, const char * data, uint32_t n)
+{
+	uint32_t done = 0;
+	
+	while (done < n)
+	{
+		uint64_t pos = __atomic_load_n(&cbuf->head,__ATOMIC_RELAXED);
+		uint32_t k = 0;
+		
+		while (done + k < n && __atomic_load_n(&cbuf->seq[circular_buf_index(cbuf,pos + k)],__ATOMIC_ACQUIRE) == pos + k)
+			k++;
+		
+		if (k == 0)
+		{
+			if (circular_buf_put_mpmc(cbuf,data + (size_t)done*cbuf->elemSize) != 0) break;
+			done++;
+			continue;
+		}
+		
+		if (!__atomic_compare_exchange_n(&cbuf->head,&pos,pos + k,false,__ATOMIC_RELAXED,__ATOMIC_RELAXED))
+			continue;
+		
+		circular_buf_copy_in(cbuf,circular_buf_index(cbuf,pos),data + (size_t)done*cbuf->elemSize,k);
+		for (uint32_t i = 0; i < k; i++)
+			__atomic_store_n(&cbuf->seq[circular_buf_index(cbuf,pos + i)],pos + i + 1,__ATOMIC_RELEASE);
+		done += k;
+	}
+	
+	return done;
+}
+
+static uint32_t circular_buf_get_n_mpmc(cbuf_handle_t cbuf, char * data, uint32_t n)
+{
+	uint32_t done = 0;
+	
+	while (done < n)
+	{
+		uint64_t pos = __atomic_load_n(&cbuf->tail,__ATOMIC_RELAXED);
+		uint32_t k = 0;
+		
+		while (done + k < n && __atomic_load_n(&cbuf->seq[circular_buf_index(cbuf,pos + k)],__ATOMIC_ACQUIRE) == pos + k + 1)
+			k++;
+		
+		if (k == 0)
+		{
+			if (circular_buf_get_mpmc(cbuf,data + (size_t)done*cbuf->elemSize) != 0) break;
+			done++;
+			continue;
+		}
+		
+		if (!__atomic_compare_exchange_n(&cbuf->tail,&pos,pos + k,false,__ATOMIC_RELAXED,__ATOMIC_RELAXED))
+			continue;
+		
+		circular_buf_copy_out(cbuf,circular_buf_index(cbuf,pos),data + (size_t)done*cbuf->elemSize,k);
+		for (uint32_t i = 0; i < k; i++)
+			__atomic_store_n(&cbuf->seq[circular_buf_index(cbuf,pos + i)],pos + i + cbuf->max,__ATOMIC_RELEASE);
+		done += k;
+	}
+	
+	return done;
+}
+
+// Sharded set: count independent buffers of size elements each, for many producers and consumers that would
+// all be fighting over a single lock (or a single head/tail line). A thread puts into the shard of the core it
+// runs on (cpu % count) and gets from it too. Only when its own shard is empty it steals from the others,
+// starting with the next one, and circular_buf_set_get_n takes whole batches from each victim.
+// Order: items leave a shard in the order they entered it, whoever takes them, but there is no order across
+// shards. Two items put by the same thread can come out swapped if it moved to another core in between.
+// flags apply to every shard. With FCBUF_DO_NOT_OVERWRITE a put goes to the next shard with room, and only
+// fails when all of them are full. FCBUF_SPSC can not be used since several threads share each shard.
+// shards = 0 means one per online CPU.
+cbuf_set_handle_t circular_buf_set_init(uint32_t shards, uint32_t size, uint32_t elemSize, uint32_t flags)
+{
+	cbuf_set_handle_t set;
+	uint32_t i;
+	
+	if (flags & FCBUF_SPSC) return NULL;
+	if (shards == 0)
+	{
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		shards = (cpus > 0) ? (uint32_t)cpus : 1;
+	}
+	
+	set = calloc(1,sizeof(circular_buf_set_t) + (size_t)shards*sizeof(cbuf_handle_t));
+	if (set == NULL) return NULL;
+	set->count = shards;
+	set->elemSize = elemSize;
+	
+	for (i = 0; i < shards; i++)
+	{
+		set->shards[i] = circular_buf_init_flags(size,elemSize,flags);
+		if (set->shards[i] == NULL)
+		{
+			circular_buf_set_free(set);
+			return NULL;
+		}
+	}
+	return set;
+}
+
+void circular_buf_set_free(cbuf_set_handle_t set)
+{
+	uint32_t i;
+	
+	assert(set);
+	for (i = 0; i < set->count; i++)
+		if (set->shards[i]) circular_buf_free(set->shards[i]);
+	free(set);
+}
+
+// Shard of the calling thread: the core it runs on, or a fixed round robin pick when that is unknown
+static uint32_t circular_buf_set_local(cbuf_set_handle_t set)
+{
+	static uint32_t nextThread;
+	static __thread uint32_t thread; // 0 = not assigned yet
+	int cpu = sched_getcpu();
+	
+	if (cpu >= 0) return (uint32_t)cpu % set->count;
+	if (thread == 0) thread = __atomic_add_fetch(&nextThread,1,__ATOMIC_RELAXED);
+	return (thread - 1) % set->count;
+}
+
+int circular_buf_set_put(cbuf_set_handle_t set, const void * data)
+{
+	assert(set);
+	return circular_buf_set_put_to(set,circular_buf_set_local(set),data);
+}
+
+// Puts into a given shard (callers that already know which thread goes with which shard)
+int circular_buf_set_put_to(cbuf_set_handle_t set, uint32_t shard, const void * data)
+{
+	uint32_t i;
+	
+	assert(set && data && shard < set->count);
+	
+	if (circular_buf_put(set->shards[shard],data) == 0) return 0;
+	for (i = 1; i < set->count; i++)
+		if (circular_buf_put(set->shards[(shard + i) % set->count],data) == 0) return 0;
+	return -1;
+}
+
+// Returns 0 when an item was read, -1 when every shard is empty
+int circular_buf_set_get(cbuf_set_handle_t set, void * data)
+{
+	return (circular_buf_set_get_n(set,data,1) == 1) ? 0 : -1;
+}
+
+// Reads up to n items: from the local shard first, then batches stolen from the other ones.
+// Returns how many items were read.
+uint32_t circular_buf_set_get_n(cbuf_set_handle_t set, void * data, uint32_t n)
+{
+	uint32_t local, done, i;
+	
+	assert(set && (data || n == 0));
+	
+	local = circular_buf_set_local(set);
+	done = circular_buf_get_n(set->shards[local],data,n);
+	for (i = 1; i < set->count && done < n; i++)
+	{
+		cbuf_handle_t victim = set->shards[(local + i) % set->count];
+		if (circular_buf_empty(victim)) continue; // unlocked hint, skips the lock of the empty ones
+		done += circular_buf_get_n(victim,(char *)data + (size_t)done*set->elemSize,n - done);
+	}
+	return done;
+}
+
+uint32_t circular_buf_set_size(cbuf_set_handle_t set)
+{
+	uint64_t size = 0;
+	uint32_t i;
+	
+	assert(set);
+	for (i = 0; i < set->count; i++)
+		size += circular_buf_size(set->shards[i]);
+	return (size > UINT32_MAX) ? UINT32_MAX : (uint32_t)size;
+}
+
+// The buffer behind a shard, for its statistics, capacity and so on
+cbuf_handle_t circular_buf_set_shard(cbuf_set_handle_t set, uint32_t shard)
+{
+	assert(set && shard < set->count);
+	return set->shards[shard];
+}
+
+// Priority ring: lanes independent buffers of size elements each, lane lanes - 1 the most urgent. A get takes
+// the oldest item of the highest lane that has one, found with one count leading zeros on the nonEmpty mask,
+// so an urgent item waits behind other urgent items only, never behind the backlog of the lower lanes.
+// A put sets its lane's bit once the item is in. A get that finds its lane empty clears the bit and then looks
+// at the lane again, setting the bit back if an item slipped in meanwhile: either it sees that item or the
+// producer sees the cleared bit, so a lane with items never stays hidden.
+// Order: FIFO within a lane, by priority across lanes. flags apply to every lane, except FCBUF_BROADCAST and
+// FCBUF_BLOCKING_GET (a get must be able to move on from an empty lane). With FCBUF_SPSC there must be one
+// producer per lane and a single consumer. See circular_buf_prio_set_quota to keep the lower lanes moving.
+cbuf_prio_handle_t circular_buf_prio_init(uint32_t lanes, uint32_t size, uint32_t elemSize, uint32_t flags)
+{
+	cbuf_prio_handle_t prio;
+	uint32_t i;
+	
+	if (lanes == 0 || lanes > CBUF_PRIO_LANES) return NULL;
+	if (flags & (FCBUF_BROADCAST|FCBUF_BLOCKING_GET)) return NULL;
+	
+	prio = calloc(1,sizeof(circular_buf_prio_t) + (size_t)lanes*sizeof(cbuf_handle_t));
+	if (prio == NULL) return NULL;
+	prio->count = lanes;
+	prio->elemSize = elemSize;
+	prio->turn = lanes - 1;
+	
+	for (i = 0; i < lanes; i++)
+	{
+		prio->lanes[i] = circular_buf_init_flags(size,elemSize,flags);
+		if (prio->lanes[i] == NULL)
+		{
+			circular_buf_prio_free(prio);
+			return NULL;
+		}
+	}
+	return prio;
+}
+
+void circular_buf_prio_free(cbuf_prio_handle_t prio)
+{
+	uint32_t i;
+	
+	assert(prio);
+	for (i = 0; i < prio->count; i++)
+		if (prio->lanes[i]) circular_buf_free(prio->lanes[i]);
+	free(prio);
+}
+
+// Returns 0 when the item was stored, -1 when the lane is full and must not be overwritten
+int circular_buf_prio_put(cbuf_prio_handle_t prio, uint32_t lane, const void * data)
+{
+	uint64_t bit;
+	
+	assert(prio && data && lane < prio->count);
+	
+	if (circular_buf_put(prio->lanes[lane],data) != 0) return -1;
+	bit = 1ull << lane;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST); // the item before the look at the bit, pairs with the clear in circular_buf_prio_get
+	if (!(__atomic_load_n(&prio->nonEmpty,__ATOMIC_RELAXED) & bit)) // usually already set, skip the write to the shared line
+		__atomic_fetch_or(&prio->nonEmpty,bit,__ATOMIC_SEQ_CST);
+	return 0;
+}
+
+// Returns 0 when an item was read, and its lane in *lane (when not NULL), -1 when every lane is empty
+int circular_buf_prio_get(cbuf_prio_handle_t prio, void * data, uint32_t * lane)
+{
+	uint64_t mask, lower, bit;
+	uint32_t top, pick;
+	
+	assert(prio && data);
+	
+	while ((mask = __atomic_load_n(&prio->nonEmpty,__ATOMIC_ACQUIRE)) != 0)
+	{
+		top = 63 - __builtin_clzll(mask);
+		lower = mask & ((1ull << top) - 1);
+		pick = top;
+		if (lower == 0)
+			__atomic_store_n(&prio->streak,0,__ATOMIC_RELAXED);
+		else if (prio->quota && __atomic_add_fetch(&prio->streak,1,__ATOMIC_RELAXED) > prio->quota)
+		{
+			__atomic_store_n(&prio->streak,0,__ATOMIC_RELAXED);
+			pick = circular_buf_prio_starved(prio,lower);
+		}
+		
+		if (circular_buf_get(prio->lanes[pick],data) == 0)
+		{
+			if (lane) *lane = pick;
+			return 0;
+		}
+		bit = 1ull << pick;
+		__atomic_fetch_and(&prio->nonEmpty,~bit,__ATOMIC_SEQ_CST);
+		if (!circular_buf_empty(prio->lanes[pick])) __atomic_fetch_or(&prio->nonEmpty,bit,__ATOMIC_SEQ_CST);
+	}
+	return -1;
+}
+
+// Anti starvation: after quota gets in a row from the top lane while lower lanes have items, the next get
+// takes one item from a lower lane instead, the lower lanes taking turns from the highest down. 0 (the
+// default) is strict priority, where a busy top lane starves everything below it.
+void circular_buf_prio_set_quota(cbuf_prio_handle_t prio, uint32_t quota)
+{
+	assert(prio);
+	prio->quota = quota;
+	prio->streak = 0;
+}
+
+// The lower lane whose turn it is: the highest non empty one at or below turn, wrapping around to the highest
+static uint32_t circular_buf_prio_starved(cbuf_prio_handle_t prio, uint64_t lower)
+{
+	uint32_t turn = __atomic_load_n(&prio->turn,__ATOMIC_RELAXED);
+	uint64_t below = lower & ((2ull << turn) - 1); // turn 63: 2^64 wraps to 0, all lanes
+	uint32_t pick = 63 - __builtin_clzll(below ? below : lower);
+	
+	__atomic_store_n(&prio->turn,pick ? pick - 1 : prio->count - 1,__ATOMIC_RELAXED);
+	return pick;
+}
+
+uint32_t circular_buf_prio_size(cbuf_prio_handle_t prio)
+{
+	uint64_t size = 0;
+	uint32_t i;
+	
+	assert(prio);
+	for (i = 0; i < prio->count; i++)
+		size += circular_buf_size(prio->lanes[i]);
+	return (size > UINT32_MAX) ? UINT32_MAX : (uint32_t)size;
+}
+
+// The buffer behind a lane, for its statistics, capacity and so on
+cbuf_handle_t circular_buf_prio_lane(cbuf_prio_handle_t prio, uint32_t lane)
+{
+	assert(prio && lane < prio->count);
+	return prio->lanes[lane];
+}
+
+// FCBUF_BROADCAST: fan out. Every consumer subscribes once and then reads every item put after that with
+// circular_buf_get_from, at its own pace, from the one shared buffer. Producers take the lock among themselves,
+// consumers never take it: each one only moves its own cursor.
+// Every slot carries the position of the item in it (seq, position + 1) and is marked CBUF_SEQ_WRITING while
+// a producer replaces it, so a consumer copies an item and then checks its seq did not change meanwhile, the
+// way a seqlock reader does.
+// With FCBUF_DO_NOT_OVERWRITE a put fails when the slowest consumer still has max items to read. In overwrite
+// mode producers never wait, and a consumer that fell more than max items behind skips what was overwritten
+// and is told how many items it missed. circular_buf_get/get_n/peek do not apply to a broadcast buffer,
+// circular_buf_size is what the slowest consumer has left to read.
+// Returns the consumer id, -1 when CBUF_BROADCAST_CONSUMERS are already subscribed.
+int circular_buf_subscribe(cbuf_handle_t cbuf)
+{
+	int i;
+	
+	assert(cbuf && (cbuf->flags & FCBUF_BROADCAST));
+	
+	circular_buf_lock(cbuf); // no put in between: the new consumer starts exactly at head
+	for (i = 0; i < CBUF_BROADCAST_CONSUMERS; i++)
+	{
+		if (cbuf->cursors[i].active) continue;
+		cbuf->cursors[i].cursor = cbuf->head;
+		__atomic_store_n(&cbuf->cursors[i].active,1,__ATOMIC_RELEASE);
+		if ((uint32_t)i >= cbuf->cursorSlots) __atomic_store_n(&cbuf->cursorSlots,(uint32_t)i + 1,__ATOMIC_RELEASE);
+		pthread_mutex_unlock(&cbuf->mutex);
+		return i;
+	}
+	pthread_mutex_unlock(&cbuf->mutex);
+	return -1;
+}
+
+void circular_buf_unsubscribe(cbuf_handle_t cbuf, int consumer)
+{
+	assert(cbuf && (cbuf->flags & FCBUF_BROADCAST) && consumer >= 0 && consumer < CBUF_BROADCAST_CONSUMERS);
+	
+	circular_buf_lock(cbuf);
+	__atomic_store_n(&cbuf->cursors[consumer].active,0,__ATOMIC_RELEASE);
+	pthread_mutex_unlock(&cbuf->mutex);
+}
+
+// Position of the slowest subscribed consumer, head when there is none
+static uint64_t circular_buf_slowest_cursor(cbuf_handle_t cbuf, uint64_t head)
+{
+	uint32_t slots = __atomic_load_n(&cbuf->cursorSlots,__ATOMIC_ACQUIRE);
+	uint64_t slowest = head;
+	uint32_t i;
+	
+	for (i = 0; i < slots; i++)
+	{
+		if (!__atomic_load_n(&cbuf->cursors[i].active,__ATOMIC_ACQUIRE)) continue;
+		uint64_t cursor = __atomic_load_n(&cbuf->cursors[i].cursor,__ATOMIC_ACQUIRE);
+		if (head - cursor > head - slowest) slowest = cursor;
+	}
+	return slowest;
+}
+
+static int circular_buf_put_broadcast(cbuf_handle_t cbuf, const void * data)
+{
+	uint64_t head;
+	uint32_t index;
+	
+	circular_buf_lock(cbuf);
+	head = cbuf->head;
+	
+	// tailCache: the slowest cursor seen last time, consumers only move forward so it is only rescanned
+	// when the buffer looks full
+	if ((cbuf->flags & FCBUF_DO_NOT_OVERWRITE) && head - cbuf->tailCache >= cbuf->max)
+	{
+		cbuf->tailCache = circular_buf_slowest_cursor(cbuf,head);
+		if (head - cbuf->tailCache >= cbuf->max)
+		{
+			pthread_mutex_unlock(&cbuf->mutex);
+			return -1;
+		}
+	}
+	
+	index = circular_buf_index(cbuf,head);
+	__atomic_store_n(&cbuf->seq[index],CBUF_SEQ_WRITING,__ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE); // readers see the mark before any byte of the new item
+	circular_buf_copy_elem(cbuf,(char *)cbuf->buffer + (size_t)index*cbuf->elemSize,data);
+	__atomic_store_n(&cbuf->seq[index],head + 1,__ATOMIC_RELEASE);
+	__atomic_store_n(&cbuf->head,head + 1,__ATOMIC_RELEASE);
+	
+	pthread_mutex_unlock(&cbuf->mutex);
+	return 0;
+}
+
+// Reads the next item for consumer (only that consumer's thread may call it).
+// Returns 0 when an item was read, -1 when the consumer has read everything. missed (may be NULL) gets how
+// many items were overwritten before this consumer could read them since its previous call.
+int circular_buf_get_from(cbuf_handle_t cbuf, int consumer, void * data, uint64_t * missed)
+{
+	circular_buf_cursor_t *self;
+	uint64_t cursor, head, seq, lost = 0;
+	uint32_t index;
+	int result = -1;
+	
+	assert(cbuf && data && (cbuf->flags & FCBUF_BROADCAST) && consumer >= 0 && consumer < CBUF_BROADCAST_CONSUMERS);
+	
+	self = &cbuf->cursors[consumer];
+	cursor = self->cursor;
+	
+	for (;;)
+	{
+		head = __atomic_load_n(&cbuf->head,__ATOMIC_ACQUIRE);
+		if (cursor == head) break;
+		if (head - cursor > cbuf->max)
+		{
+			// lapped, only the last max items can still be there
+			lost += head - cbuf->max - cursor;
+			cursor = head - cbuf->max;
+		}
+		
+		index = circular_buf_index(cbuf,cursor);
+		seq = __atomic_load_n(&cbuf->seq[index],__ATOMIC_ACQUIRE);
+		if (seq == cursor + 1)
+		{
+			circular_buf_copy_elem(cbuf,data,(char *)cbuf->buffer + (size_t)index*cbuf->elemSize);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE); // the copy is done before seq is checked again
+			if (__atomic_load_n(&cbuf->seq[index],__ATOMIC_RELAXED) == seq)
+			{
+				cursor++;
+				result = 0;
+				break;
+			}
+		}
+		// being replaced (or already replaced) by a newer item: this one is lost
+		lost++;
+		cursor++;
+	}
+	
+	__atomic_store_n(&self->cursor,cursor,__ATOMIC_RELEASE);
+	if (missed) *missed = lost;
+	if (result == 0 && (cbuf->flags & FCBUF_EVENTFD))
+		circular_buf_signal(cbuf->writeFd,&cbuf->writeArmed); // may have been the slowest consumer
+	return result;
+}
+
+// FCBUF_SNAPSHOT: the producers (under the lock) mark the slots they are about to replace with CBUF_SEQ_WRITING
+// and then publish the position + 1 of the new items in seq, the same way as in FCBUF_BROADCAST mode.
+static inline void circular_buf_seq_begin(cbuf_handle_t cbuf, uint64_t pos, uint32_t count)
+{
+	uint32_t i;
+	
+	for (i = 0; i < count; i++)
+		__atomic_store_n(&cbuf->seq[circular_buf_index(cbuf,pos + i)],CBUF_SEQ_WRITING,__ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE); // readers see the marks before any byte of the new items
+}
+
+static inline void circular_buf_seq_end(cbuf_handle_t cbuf, uint64_t pos, uint32_t count)
+{
+	uint32_t i;
+	
+	for (i = 0; i < count; i++)
+		__atomic_store_n(&cbuf->seq[circular_buf_index(cbuf,pos + i)],pos + i + 1,__ATOMIC_RELEASE);
+}
+
+// Copies the latest (up to) n items in the buffer into data, oldest first, without taking them out and
+// without the lock, so monitoring never holds up a producer. Works on FCBUF_SNAPSHOT and FCBUF_BROADCAST rings.
+// Every slot is copied and then its seq checked again, like a seqlock reader. Producers overwrite the oldest
+// items first, so what they replaced during the copy is always at its start: those items are dropped and the
+// copy is started again (at most CBUF_SNAPSHOT_RETRIES times) from the new head.
+// Returns the number of items copied: what the ring held, at most n, fewer when producers kept overwriting.
+// Items consumed while the copy runs may still be in it. head and tail are never written.
+uint32_t circular_buf_snapshot(cbuf_handle_t cbuf, void * data, uint32_t n)
+{
+	char *dst = data;
+	uint32_t attempt, count = 0;
+	
+	assert(cbuf && (data || n == 0));
+	
+	if (!(cbuf->flags & (FCBUF_SNAPSHOT|FCBUF_BROADCAST))) return 0;
+	
+	for (attempt = 0; attempt <= CBUF_SNAPSHOT_RETRIES; attempt++)
+	{
+		// tail first, as in circular_buf_size. Broadcast rings keep no tail: all the last max items count.
+		uint64_t tail = __atomic_load_n(&cbuf->tail,__ATOMIC_ACQUIRE);
+		uint64_t head = __atomic_load_n(&cbuf->head,__ATOMIC_ACQUIRE);
+		uint64_t pos, start;
+		uint32_t want = (head - tail > cbuf->max) ? cbuf->max : (uint32_t)(head - tail);
+		
+		if (want > n) want = n;
+		start = head - want;
+		count = 0;
+		for (pos = start; pos < head; pos++)
+		{
+			uint32_t index = circular_buf_index(cbuf,pos);
+			uint64_t seq = __atomic_load_n(&cbuf->seq[index],__ATOMIC_ACQUIRE);
+			
+			if (seq == pos + 1)
+			{
+				circular_buf_copy_elem(cbuf,dst + (size_t)count*cbuf->elemSize,(char *)cbuf->buffer + (size_t)index*cbuf->elemSize);
+				__atomic_thread_fence(__ATOMIC_ACQUIRE); // the copy is done before seq is checked again
+				if (__atomic_load_n(&cbuf->seq[index],__ATOMIC_RELAXED) == seq)
+				{
+					count++;
+					continue;
+				}
+			}
+			count = 0; // overwritten: it and every older item copied so far are gone
+		}
+		if (count == want) break;
+	}
+	return count;
+}
+
+static int test_cbuffer_overwrite_empty();  // Creates a cbuf_overwrite and tries to read an item from an empty one.
+
+static int test_cbuffer_overwrite_empty()
+{
+  	
+  int cbufsize = 3;
+  uint32_t data;
+  int result;
+  
+  cbuf_handle_t cbuf = circular_buf_init(cbufsize,sizeof(uint32_t));
+  
+  if (circular_buf_get(cbuf,&data) == -1 ) 
+    result = 0;
+  else 
+    result = -1;  
+  
+  circular_buf_free(cbuf); 
+    
+  return result;     	
+}
+
+static int test_cbuffer_overwrite_full(); // Creates a cbuf_overwrite and fills it to maximum and verify it is full
+
+static int test_cbuffer_overwrite_full()
+{
+  int cbufsize = 3;
+  uint32_t data;
+  bool result;
+  int i;
+  cbuf_handle_t cbuf = circular_buf_init(cbufsize,sizeof(uint32_t));
+  
+  for ( i = 0; i < cbufsize; i++)
+    circular_buf_put(cbuf,(void *)&data);
+   
+  result = circular_buf_full(cbuf); 
+  
+  circular_buf_free(cbuf); 
+
+  if ( result == true ) 
+    return 0;
+  else
+    return -1;  
+  
+}
+
+static int test_cbuffer_overwrite_get_size(); // Creates a cbuf, insert x itens and verify the size
+
+static int test_cbuffer_overwrite_get_size()
+{
+
+  int cbufsize = 3;
+  uint32_t data;
+  int result;
+  
+  cbuf_handle_t cbuf = circular_buf_init(cbufsize,sizeof(uint32_t));
+  
+  circular_buf_put(cbuf,(void *)&data);
+  circular_buf_put(cbuf,(void *)&data);
+  
+  if ( circular_buf_size(cbuf)  == 2)
+    result = 0;
+  else
+    result = -1;  
+    
+  circular_buf_free(cbuf); 
+    
+  return result;     	
+}
+
+static int test_cbuffer_overwrite_do_one_overwrite(); // Creates a buf, and overwrite one item
+
+static int test_cbuffer_overwrite_do_one_overwrite()
+{
+	
+  int cbufsize = 3;
+  uint32_t data = 10;
+  int result;
+  
+  cbuf_handle_t cbuf = circular_buf_init(cbufsize,sizeof(uint32_t));
+  
+  circular_buf_put(cbuf,(void *)&data);
+  circular_buf_put(cbuf,(void *)&data);
+  circular_buf_put(cbuf,(void *)&data);
+  // buffer is full
+  
+  data = 50;
+  circular_buf_put(cbuf,(void *)&data);
+  // overwrite one element
+  
+  circular_buf_get(cbuf,&data);
+  //printf("data: %d\n",data);
+  circular_buf_get(cbuf,&data);
+  //printf("data: %d\n",data);
+  circular_buf_get(cbuf,&data);
+  //printf("data: %d\n",data);
+  // get all three elements, the third should be 50 and numberof overwrites = 1
+  
+  if ( ( circular_buf_get_overwrites(cbuf) == 1 ) && data == 50 )
+    result = 0;
+  else
+    result = -1;  
+    
+  circular_buf_free(cbuf); 
+    
+  return result;     	
+	
+}
+
+static int test_cbuffer_overwrite_partial_read(); 
+
+static int test_cbuffer_overwrite_partial_read()
+{
+
+  int cbufsize = 3;
+  uint32_t data = 10;
+  int result;
+  
+  cbuf_handle_t cbuf = circular_buf_init(cbufsize,sizeof(uint32_t));
+  
+  circular_buf_put(cbuf,(void *)&data);
+  circular_buf_put(cbuf,(void *)&data);
+  circular_buf_put(cbuf,(void *)&data);
+  // buffer is full
+     
+  circular_buf_get(cbuf,&data);
+  circular_buf_get(cbuf,&data);
+  // get two from three elements, size should be one
+  
+  if ( ( circular_buf_get_overwrites(cbuf) == 0 ) && (circular_buf_size(cbuf) == 1 ) && (!circular_buf_full(cbuf)) )
+    result = 0;
+  else
+    result = -1;  
+    
+  circular_buf_free(cbuf); 
+    
+  return result;     	
+
+}
+
+static int test_cbuffer_overwrite_full_read();
+
+static int test_cbuffer_overwrite_full_read() 
+{
+  int cbufsize = 3;
+  uint32_t data = 10;
+  int result;
+  
+  cbuf_handle_t cbuf = circular_buf_init(cbufsize,sizeof(uint32_t));
+  
+  circular_buf_put(cbuf,(void *)&data);
+  circular_buf_put(cbuf,(void *)&data);
+  circular_buf_put(cbuf,(void *)&data);
+  // buffer is full
+     
+  circular_buf_get(cbuf,&data);
+  circular_buf_get(cbuf,&data);
+  circular_buf_get(cbuf,&data);
+  
+  // get all elements
+  
+  if ( ( circular_buf_get_overwrites(cbuf) == 0 ) && (circular_buf_size(cbuf) == 0 ) && (!circular_buf_full(cbuf)) )
+    result = 0;
+  else
+    result = -1;  
+    
+  circular_buf_free(cbuf); 
+    
+  return result;     	
+}
+
+static int test_cbuffer_overwrite_resize();
+
+static int test_cbuffer_overwrite_resize() 
+{
+  int cbufsize = 3;
+  uint32_t data = 10;
+  int result;
+  
+  cbuf_handle_t cbuf = circular_buf_init(cbufsize,sizeof(uint32_t));
+  
+  circular_buf_put(cbuf,(void *)&data);
+  data += 10;
+  circular_buf_put(cbuf,(void *)&data);
+  
+  circular_buf_resize(cbuf,cbufsize+2);
+   
+  if ( (circular_buf_capacity(cbuf) == 5 ) && (!circular_buf_full(cbuf)) && (circular_buf_size(cbuf) == 2 ) )
+    result = 0;
+  else
+    result = -1;  
+    
+  circular_buf_free(cbuf); 
+    
+  return result;     	
+}
+
+static int test_cbuffer_overwrite_check_read_order();
+
+static int test_cbuffer_overwrite_check_read_order()
+{
+  int cbufsize = 3;
+  uint32_t data = 10;
+  int result = 0;
+  
+  cbuf_handle_t cbuf = circular_buf_init(cbufsize,sizeof(uint32_t));
+  
+  circular_buf_put(cbuf,(void *)&data);
+  data += 10;
+  circular_buf_put(cbuf,(void *)&data);
+  data += 10;
+  circular_buf_put(cbuf,(void *)&data);
+  // buffer is full
+     
+  circular_buf_get(cbuf,&data);
+  
+  if ( data != 10 ) result = -1;
+  
+  circular_buf_get(cbuf,&data);
+  
+  if ( data != 20 ) result = -1;
+  
+  circular_buf_get(cbuf,&data);
+  
+  if ( data != 30 ) result = -1;
+  
+  // get all elements
+  /*
+  printf("result after compare reading order %d\n",result);
+  printf("get overwrites: %d\n",circular_buf_get_overwrites(cbuf));
+  printf("get size: %d\n",circular_buf_size(cbuf));
+  printf("get if is full:%d\n",circular_buf_full(cbuf));
+  */
+  if ( ( circular_buf_get_overwrites(cbuf) == 0 ) && (circular_buf_size(cbuf) == 0 ) && (circular_buf_full(cbuf)==0) && (result == 0))
+    result = 0;
+  else
+    result = -1;  
+    
+  circular_buf_free(cbuf); 
+  
+  return result;
+
+}
+
+static int test_cbuffer_overwrite_resize_and_operate();
+
+static int test_cbuffer_overwrite_resize_and_operate() 
+{
+  int cbufsize = 3;
+  uint32_t data = 10;
+  int result;
+  
+  cbuf_handle_t cbuf = circular_buf_init(cbufsize,sizeof(uint32_t));
+  
+  circular_buf_put(cbuf,(void *)&data);
+  data += 10;
+  circular_buf_put(cbuf,(void *)&data);
+  
+  circular_buf_resize(cbuf,cbufsize+2);
+   
+  if ( (circular_buf_capacity(cbuf) == 5 ) && (!circular_buf_full(cbuf)) && (circular_buf_size(cbuf) == 2 ) )
+    result = 0;
+  else
+    result = -1;  
+    
+  circular_buf_get(cbuf,&data);
+  //printf("Resize ANd operate data1: %d\n",data);
+  circular_buf_get(cbuf,&data);
+  //printf("Resize ANd operate data2: %d\n",data);
+  
+  if ((circular_buf_capacity(cbuf) == 5 ) &&  (!circular_buf_full(cbuf)) && circular_buf_size(cbuf) == 0 && result == 0 )
+    result = 0;
+  else
+    result = -1;  
+    
+  circular_buf_free(cbuf); 
+    
+  return result;     	
+}
+
+static int test_cbuffer_overwrite_multiple_reading_threads() // one put, multiple gets simultaneously
+{
+
+  int cbufSize = 9000000;
+  uint32_t data;
+  bool result;
+  int i;
+  uint32_t *ptrCount[NUMBEROFTHREADS];
+  uint32_t sum = 0 ;
+  int thread;
+  uint64_t startTime,endTime;
+  
+  cbufglobal = circular_buf_init(cbufSize,sizeof(uint32_t));
+  startTime=circular_buf_now_ns();
+    
+  for (i=1;i<=cbufSize;i++)
+    circular_buf_put(cbufglobal,(void *)&i);
+   
+  for (thread = 0; thread < NUMBEROFTHREADS; thread++) 
+     pthread_create(&threads[thread], NULL, &circular_buf_get_all,NULL);
+   
+  for (thread = 0; thread < NUMBEROFTHREADS; thread++) 
+       pthread_join(threads[thread], (void **)&ptrCount[thread]);
+  
+  for (thread = 0; thread < NUMBEROFTHREADS; thread++) {
+   
+     printf("Value of return count from thread %d is : %d; Percentage of Processing: %d % \n",thread,*ptrCount[thread],((*ptrCount[thread]*100)/cbufSize));
+     sum += *ptrCount[thread];
+   }
+   
+  printf("Value of return count from All Threads is : %d\n",sum);
+      
+  circular_buf_free(cbufglobal); 
+  
+  endTime=circular_buf_now_ns();
+  printf("Time Elapsed: %.4f seconds\n",((double)(endTime - startTime)/1e9));
+  
+  if ( sum == cbufSize ) 
+    return 0;
+  else
+    return -1;  
+
+}
+
+static int test_cbuffer_overwrite_multiple_RW_threads() // multiple puts and gets simultaneously
+{
+
+  int cbufSize = 90000000;
+  uint32_t data;
+  bool result;
+  int i;
+  uint32_t *ptrCount[NUMBEROFTHREADS];
+  uint32_t *ptrCountPut[NUMBEROFTHREADS];
+  uint32_t sum = 0 ;
+  uint32_t sumPut = 0;
+  int thread;
+  uint64_t startTime, endTime;
+  
+  cbufglobal = circular_buf_init(cbufSize,sizeof(uint32_t));
+  startTime = circular_buf_now_ns();
+    
+  //for (i=1;i<=cbufSize;i++)
+  //  circular_buf_put(cbufglobal,(void *)&i);
+  
+  for (thread = 0; thread < NUMBEROFTHREADS; thread++) 
+     pthread_create(&threadsPut[thread], NULL, &circular_buf_put_all_sleep,NULL);
+   
+  for (thread = 0; thread < NUMBEROFTHREADS; thread++) 
+     pthread_create(&threads[thread], NULL, &circular_buf_get_all_sleep,NULL);
+   
+  for (thread = 0; thread < NUMBEROFTHREADS; thread++) 
+       pthread_join(threads[thread], (void **)&ptrCount[thread]);
+  
+  for (thread = 0; thread < NUMBEROFTHREADS; thread++) 
+       pthread_join(threadsPut[thread], (void **)&ptrCountPut[thread]);
+  
+  
+  for (thread = 0; thread < NUMBEROFTHREADS; thread++) {
+	sum += *ptrCount[thread];
+    sumPut += *ptrCountPut[thread];
+   }   
+    
+   for (thread = 0; thread < NUMBEROFTHREADS; thread++) {
+   
+     printf("Value of return count from thread Read %d is : %d; Percentage of Processing: %d % \n",thread,*ptrCount[thread],((*ptrCount[thread]*100)/sum));
+     printf("Value of return count from thread Write %d is : %d; Percentage of Processing: %d % \n",thread,*ptrCountPut[thread],((*ptrCountPut[thread]*100)/sumPut));
+     
+  } 
+  
+  printf("Value of return count from All Threads Get is : %d\n",sum);
+  printf("Value of return count from All Threads Put is : %d\n",sumPut);    
+  circular_buf_free(cbufglobal); 
+  endTime=circular_buf_now_ns();
+  
+  printf("Time Elapsed: %.4f seconds\n",((double)(endTime - startTime)/1e9));
+  
+  if ( sum == sumPut ) 
+    return 0;
+  else
+    return -1;  
+
+}
+
+static int test_cbuffer_spsc_full_and_order(); // SPSC buffer must refuse puts when full and keep FIFO order across the wrap
+
+static int test_cbuffer_spsc_full_and_order()
+{
+  int cbufsize = 3;
+  uint32_t data;
+  int result = 0;
+  int i;
+  
+  cbuf_handle_t cbuf = circular_buf_init_flags(cbufsize,sizeof(uint32_t),FCBUF_SPSC);
+  
+  for (data = 10; data <= 30; data += 10)
+    if (circular_buf_put(cbuf,&data) != 0) result = -1;
+  // buffer is full, the next put must fail and nothing is overwritten
+  
+  data = 40;
+  if ( (circular_buf_put(cbuf,&data) != -1) || (!circular_buf_full(cbuf)) ) result = -1;
+  
+  // wrap around a few times
+  for (i = 0; i < 10; i++) {
+    circular_buf_get(cbuf,&data);
+    if ( data != (uint32_t)(10 + i*10) ) result = -1;
+    data = 40 + i*10;
+    if (circular_buf_put(cbuf,&data) != 0) result = -1;
+  }
+  
+  if ( (circular_buf_size(cbuf) != 3) || (circular_buf_get_overwrites(cbuf) != 0) ) result = -1;
+  
+  circular_buf_free(cbuf);
+  
+  return result;
+}
+
+static void *circular_buf_get_spsc_check(void* param) // consumer side of test_cbuffer_spsc_threads, checks the sequence
+{
+  cbuf_handle_t cbuf = param;
+  uint32_t expected = 1;
+  uint32_t data;
+  
+  while (expected <= 1000000) {
+    if (circular_buf_get(cbuf,&data) == -1) { sched_yield(); continue; }
+    if (data != expected) return (void *)-1;
+    expected++;
+  }
+  return NULL;
+}
+
+static int test_cbuffer_spsc_threads(); // one producer and one consumer thread on a SPSC buffer, nothing lost or reordered
+
+static int test_cbuffer_spsc_threads()
+{
+  uint32_t data;
+  void *ret;
+  pthread_t consumer;
+  
+  cbuf_handle_t cbuf = circular_buf_init_flags(1024,sizeof(uint32_t),FCBUF_SPSC);
+  
+  pthread_create(&consumer, NULL, &circular_buf_get_spsc_check, cbuf);
+  
+  for (data = 1; data <= 1000000; data++)
+    while (circular_buf_put(cbuf,&data) == -1)
+      sched_yield();
+  
+  pthread_join(consumer,&ret);
+  
+  circular_buf_free(cbuf);
+  
+  return (ret == NULL) ? 0 : -1;
+}
+
+static int test_cbuffer_mpmc_overwrite(); // MPMC buffer in overwrite mode drops the oldest item like the mutex one
+
+static int test_cbuffer_mpmc_overwrite()
+{
+  int cbufsize = 3;
+  uint32_t data;
+  int result = 0;
+  
+  cbuf_handle_t cbuf = circular_buf_init_flags(cbufsize,sizeof(uint32_t),FCBUF_MPMC|FCBUF_OVERWRITE);
+  
+  for (data = 10; data <= 40; data += 10)
+    circular_buf_put(cbuf,&data);
+  // 10 was overwritten
+  
+  if ( (circular_buf_get_overwrites(cbuf) != 1) || (!circular_buf_full(cbuf)) ) result = -1;
+  
+  circular_buf_get(cbuf,&data);
+  if ( data != 20 ) result = -1;
+  circular_buf_get(cbuf,&data);
+  if ( data != 30 ) result = -1;
+  circular_buf_get(cbuf,&data);
+  if ( data != 40 ) result = -1;
+  
+  if ( (circular_buf_get(cbuf,&data) != -1) || (circular_buf_size(cbuf) != 0) ) result = -1;
+  
+  circular_buf_free(cbuf);
+  
+  return result;
+}
+
+#define MPMCITEMSPERTHREAD 100000
+uint64_t mpmcConsumed;
+uint64_t mpmcSum;
+
+static void *circular_buf_put_mpmc_all(void* param) // producer side of test_cbuffer_mpmc_threads
+{
+  cbuf_handle_t cbuf = param;
+  uint32_t data[4] = { 0 }; // only data[0] is the item, the rest keeps gcc's bounds check quiet about the 16 byte case of copy_elem
+  
+  for (data[0] = 1; data[0] <= MPMCITEMSPERTHREAD; data[0]++)
+    while (circular_buf_put(cbuf,data) == -1)
+      sched_yield();
+  return NULL;
+}
+
+static void *circular_buf_get_mpmc_all(void* param) // consumer side of test_cbuffer_mpmc_threads
+{
+  cbuf_handle_t cbuf = param;
+  uint32_t data;
+  
+  while (__atomic_load_n(&mpmcConsumed,__ATOMIC_RELAXED) < (uint64_t)MPMCITEMSPERTHREAD*NUMBEROFTHREADS) {
+    if (circular_buf_get(cbuf,&data) == -1) { sched_yield(); continue; }
+    __atomic_fetch_add(&mpmcSum,data,__ATOMIC_RELAXED);
+    __atomic_fetch_add(&mpmcConsumed,1,__ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+static int test_cbuffer_mpmc_threads(); // NUMBEROFTHREADS putters and getters on a non overwriting MPMC buffer, every item is read once
+
+static int test_cbuffer_mpmc_threads()
+{
+  int thread;
+  uint64_t expected = (uint64_t)MPMCITEMSPERTHREAD*(MPMCITEMSPERTHREAD + 1)/2*NUMBEROFTHREADS;
+  
+  cbuf_handle_t cbuf = circular_buf_init_flags(1000,sizeof(uint32_t),FCBUF_MPMC|FCBUF_DO_NOT_OVERWRITE);
+  mpmcConsumed = 0;
+  mpmcSum = 0;
+  
+  for (thread = 0; thread < NUMBEROFTHREADS; thread++) 
+     pthread_create(&threadsPut[thread], NULL, &circular_buf_put_mpmc_all, cbuf);
+  for (thread = 0; thread < NUMBEROFTHREADS; thread++) 
+     pthread_create(&threads[thread], NULL, &circular_buf_get_mpmc_all, cbuf);
+  
+  for (thread = 0; thread < NUMBEROFTHREADS; thread++) {
+     pthread_join(threadsPut[thread], NULL);
+     pthread_join(threads[thread], NULL);
+  }
+  
+  circular_buf_free(cbuf);
+  
+  return ( (mpmcSum == expected) ) ? 0 : -1;
+}
+
+static int test_cbuffer_bulk_put_get(); // put_n/get_n across the wrap, with overwrite and with FCBUF_DO_NOT_OVERWRITE
+
+static int test_cbuffer_bulk_put_get()
+{
+  uint32_t in[10] = {1,2,3,4,5,6,7,8,9,10};
+  uint32_t out[10];
+  int result = 0;
+  int i;
+  
+  cbuf_handle_t cbuf = circular_buf_init(5,sizeof(uint32_t));
+  
+  circular_buf_put_n(cbuf,in,3);
+  if ( (circular_buf_get_n(cbuf,out,2) != 2) || out[0] != 1 || out[1] != 2 ) result = -1;
+  // head = 3, tail = 2: next put wraps and overwrites 3 and 4
+  
+  if ( circular_buf_put_n(cbuf,&in[3],6) != 6 ) result = -1;
+  if ( (circular_buf_get_overwrites(cbuf) != 2) || (!circular_buf_full(cbuf)) ) result = -1;
+  if ( circular_buf_get_n(cbuf,out,10) != 5 ) result = -1;
+  for (i = 0; i < 5; i++)
+    if ( out[i] != (uint32_t)(i + 5) ) result = -1;
+  
+  // more than max in one call only keeps the last max
+  circular_buf_put_n(cbuf,in,10);
+  if ( (circular_buf_get_overwrites(cbuf) != 7) || (circular_buf_get_n(cbuf,out,10) != 5) || out[0] != 6 || out[4] != 10 ) result = -1;
+  
+  circular_buf_free(cbuf);
+  
+  cbuf = circular_buf_init_flags(5,sizeof(uint32_t),FCBUF_DO_NOT_OVERWRITE);
+  
+  if ( (circular_buf_put_n(cbuf,in,3) != 3) || (circular_buf_put_n(cbuf,&in[3],7) != 2) ) result = -1;
+  if ( (circular_buf_get_overwrites(cbuf) != 0) || (circular_buf_get_n(cbuf,out,10) != 5) || out[4] != 5 ) result = -1;
+  
+  circular_buf_free(cbuf);
+  
+  // the lock free modes wrap the same way
+  cbuf = circular_buf_init_flags(5,sizeof(uint32_t),FCBUF_SPSC);
+  circular_buf_put_n(cbuf,in,3);
+  circular_buf_get_n(cbuf,out,3);
+  if ( (circular_buf_put_n(cbuf,&in[3],7) != 5) || (circular_buf_get_n(cbuf,out,10) != 5) || out[0] != 4 || out[4] != 8 ) result = -1;
+  circular_buf_free(cbuf);
+  
+  cbuf = circular_buf_init_flags(5,sizeof(uint32_t),FCBUF_MPMC|FCBUF_DO_NOT_OVERWRITE);
+  circular_buf_put_n(cbuf,in,3);
+  circular_buf_get_n(cbuf,out,3);
+  if ( (circular_buf_put_n(cbuf,&in[3],7) != 5) || (circular_buf_get_n(cbuf,out,10) != 5) || out[0] != 4 || out[4] != 8 ) result = -1;
+  circular_buf_free(cbuf);
+  
+  return result;
+}
+
+static int test_cbuffer_reserve_peek(); // fill and drain strings in place with reserve/commit and peek/release, across the wrap
+
+static int test_cbuffer_reserve_peek()
+{
+  char str[100];
+  uint32_t n;
+  int result = 0;
+  int pass;
+  char *p;
+  
+  for (pass = 0; pass < 2; pass++) {
+    
+    cbuf_handle_t cbuf = circular_buf_init_flags(4,sizeof(str),(pass == 0) ? FCBUF_OVERWRITE : FCBUF_SPSC);
+    
+    strcpy(str,"Opa");
+    circular_buf_put(cbuf,str);
+    strcpy(str,"Nao");
+    circular_buf_put(cbuf,str);
+    circular_buf_get(cbuf,str);
+    // head = 2, tail = 1: only two contiguous slots before the wrap
+    
+    n = 3;
+    p = circular_buf_reserve(cbuf,&n);
+    if ( p == NULL || n != 2 ) result = -1;
+    else {
+      strcpy(p,"Sei");
+      strcpy(p + sizeof(str),"Se");
+      if (circular_buf_commit(cbuf,3) != -1) result = -1; // more than reserved
+      circular_buf_commit(cbuf,2);
     }
+    
+    n = 3;
+    p = circular_buf_reserve(cbuf,&n);
+    if ( p == NULL || n != 1 ) result = -1;
+    else {
+      strcpy(p,"Vai");
+      circular_buf_commit(cbuf,1);
+    }
+    
+    n = 1;
+    if ( (circular_buf_reserve(cbuf,&n) != NULL) || n != 0 || (!circular_buf_full(cbuf)) ) result = -1;
+    
+    n = 10;
+    p = circular_buf_peek(cbuf,&n);
+    if ( p == NULL || n != 3 || strcmp(p,"Nao") || strcmp(p + 2*sizeof(str),"Se") ) result = -1;
+    circular_buf_release(cbuf,3);
+    
+    n = 10;
+    p = circular_buf_peek(cbuf,&n);
+    if ( p == NULL || n != 1 || strcmp(p,"Vai") ) result = -1;
+    circular_buf_release(cbuf,1);
+    
+    if ( (circular_buf_size(cbuf) != 0) || (circular_buf_get_overwrites(cbuf) != 0) ) result = -1;
+    
+    circular_buf_free(cbuf);
+  }
+  
+  return result;
+}
 
-    return 0;
+static int test_cbuffer_reserve_peek_guard(); // with the lock, puts keep off a reservation and gets (and overwrites) off a peek
+
+static int test_cbuffer_reserve_peek_guard()
+{
+  uint32_t data, out, bulk[4] = { 7, 8, 9, 10 };
+  uint32_t n;
+  uint32_t *p;
+  int result = 0;
+  
+  cbuf_handle_t cbuf = circular_buf_init_flags(4,sizeof(uint32_t),FCBUF_OVERWRITE);
+  
+  for (data = 1; data <= 2; data++)
+    circular_buf_put(cbuf,&data);
+  
+  // the slot at head is handed out: neither put may write it, nor may commit publish somebody else's item
+  n = 1;
+  if ( (p = circular_buf_reserve(cbuf,&n)) == NULL || n != 1 ) return -1;
+  if ( circular_buf_put(cbuf,&data) != -1 || circular_buf_put_n(cbuf,bulk,2) != 0 ) result = -1;
+  *p = 100;
+  circular_buf_commit(cbuf,1);
+  data = 3;
+  if ( circular_buf_put(cbuf,&data) != 0 || !circular_buf_full(cbuf) ) result = -1;
+  
+  // 1 and 2 are peeked: gets do not move past them and the full buffer does not overwrite them
+  n = 2;
+  if ( (p = circular_buf_peek(cbuf,&n)) == NULL || n != 2 || p[0] != 1 || p[1] != 2 ) return -1;
+  if ( circular_buf_get(cbuf,&out) != -1 || circular_buf_get_n(cbuf,bulk,4) != 0 ) result = -1;
+  if ( circular_buf_put(cbuf,&data) != -1 || circular_buf_put_n(cbuf,bulk,2) != 0 ) result = -1;
+  if ( circular_buf_resize(cbuf,8) != -1 || circular_buf_get_overwrites(cbuf) != 0 ) result = -1;
+  if ( p[0] != 1 || p[1] != 2 ) result = -1;
+  circular_buf_release(cbuf,2);
+  
+  // the two slots the release freed take new items, everything comes out in order
+  bulk[0] = 4; bulk[1] = 5;
+  if ( circular_buf_put_n(cbuf,bulk,2) != 2 || circular_buf_get_n(cbuf,bulk,4) != 4 ) result = -1;
+  if ( bulk[0] != 100 || bulk[1] != 3 || bulk[2] != 4 || bulk[3] != 5 ) result = -1;
+  
+  circular_buf_free(cbuf);
+  return result;
+}
+
+static int test_cbuffer_mirrored(); // a mirrored buffer hands out wrapped runs as one contiguous span
+
+static int test_cbuffer_mirrored()
+{
+  char str[100];
+  uint32_t i;
+  uint32_t n;
+  int result = 0;
+  char *p;
+  
+  cbuf_handle_t cbuf = circular_buf_init_flags(6,sizeof(str),FCBUF_MIRRORED);
+  if (cbuf == NULL) return -1;
+  
+  // rounded up so the mapping is a whole number of pages and of 100 byte items
+  if ( (circular_buf_capacity(cbuf) < 6) || ((circular_buf_capacity(cbuf)*sizeof(str)) % sysconf(_SC_PAGESIZE)) ) result = -1;
+  
+  // move head and tail close to the end, then write a run that wraps
+  for (i = 0; i < circular_buf_capacity(cbuf) - 2; i++) {
+    circular_buf_put(cbuf,str);
+    circular_buf_get(cbuf,str);
+  }
+  
+  n = 5;
+  p = circular_buf_reserve(cbuf,&n);
+  if ( p == NULL || n != 5 ) result = -1;
+  else {
+    for (i = 0; i < 5; i++) sprintf(p + i*sizeof(str),"item %u",i);
+    circular_buf_commit(cbuf,5);
+  }
+  
+  // the third item went through the second view, it must be in slot 0 of the first one
+  if ( strcmp((char *)cbuf->buffer,"item 2") ) result = -1;
+  
+  n = 5;
+  p = circular_buf_peek(cbuf,&n);
+  if ( p == NULL || n != 5 || strcmp(p + 4*sizeof(str),"item 4") ) result = -1;
+  circular_buf_release(cbuf,1);
+  
+  if ( (circular_buf_get(cbuf,str) != 0) || strcmp(str,"item 1") || (circular_buf_size(cbuf) != 3) ) result = -1;
+  
+  circular_buf_free(cbuf);
+  
+  return result;
+}
+
+static int test_cbuffer_do_not_overwrite(); // FCBUF_DO_NOT_OVERWRITE refuses puts on a full buffer and keeps the oldest items
+
+static int test_cbuffer_do_not_overwrite()
+{
+  int cbufsize = 3;
+  uint32_t data;
+  int result = 0;
+  
+  cbuf_handle_t cbuf = circular_buf_init_flags(cbufsize,sizeof(uint32_t),FCBUF_DO_NOT_OVERWRITE);
+  
+  for (data = 10; data <= 30; data += 10)
+    if (circular_buf_put(cbuf,&data) != 0) result = -1;
+  // buffer is full
+  
+  data = 40;
+  if ( circular_buf_put(cbuf,&data) != -1 ) result = -1;
+  
+  circular_buf_get(cbuf,&data);
+  if ( data != 10 || (circular_buf_get_overwrites(cbuf) != 0) || (circular_buf_size(cbuf) != 2) ) result = -1;
+  
+  circular_buf_free(cbuf);
+  
+  return result;
+}
+
+static void *circular_buf_blocking_worker(void* param) // helper of test_cbuffer_blocking: gets 3 items slowly, then puts one late
+{
+  cbuf_handle_t cbuf = param;
+  uint32_t data;
+  uintptr_t sum = 0;
+  int i;
+  
+  usleep(20000);
+  for (i = 0; i < 3; i++) {
+    circular_buf_get(cbuf,&data); // blocks until the main thread puts
+    sum += data;
+  }
+  usleep(20000);
+  data = 100;
+  circular_buf_put(cbuf,&data);
+  return (void *)sum;
+}
+
+static int test_cbuffer_blocking(); // blocking put waits for space, blocking get waits for data, timed get times out
+
+static int test_cbuffer_blocking()
+{
+  uint32_t data;
+  int result = 0;
+  void *ret;
+  pthread_t worker;
+  struct timespec t0, t1;
+  
+  cbuf_handle_t cbuf = circular_buf_init_flags(1,sizeof(uint32_t),FCBUF_BLOCKING_GET|FCBUF_BLOCKING_PUT);
+  
+  pthread_create(&worker, NULL, &circular_buf_blocking_worker, cbuf);
+  
+  // only one slot: the second and third put wait for the worker to get
+  for (data = 1; data <= 3; data++)
+    if (circular_buf_put(cbuf,&data) != 0) result = -1;
+  
+  // let the worker take the last one, then it puts 100 after a while and get must wait for it
+  while (!circular_buf_empty(cbuf))
+    usleep(1000);
+  if ( (circular_buf_get(cbuf,&data) != 0) || data != 100 ) result = -1;
+  
+  pthread_join(worker,&ret);
+  if ( (uintptr_t)ret != 6 ) result = -1;
+  
+  // nothing will come now
+  clock_gettime(CLOCK_MONOTONIC,&t0);
+  if ( circular_buf_get_timed(cbuf,&data,10000) != -1 ) result = -1;
+  clock_gettime(CLOCK_MONOTONIC,&t1);
+  if ( (t1.tv_sec - t0.tv_sec)*1000000000L + (t1.tv_nsec - t0.tv_nsec) < 10000000L ) result = -1;
+  
+  circular_buf_free(cbuf);
+  
+  return result;
+}
+
+static int test_cbuffer_resize_wrapped(); // resize a full buffer whose items wrap, the order must survive
+
+static int test_cbuffer_resize_wrapped()
+{
+  int cbufsize = 3;
+  uint32_t data = 10;
+  int result = 0;
+  
+  cbuf_handle_t cbuf = circular_buf_init(cbufsize,sizeof(uint32_t));
+  
+  circular_buf_put(cbuf,&data);
+  data = 20;
+  circular_buf_put(cbuf,&data);
+  circular_buf_get(cbuf,&data);
+  data = 30;
+  circular_buf_put(cbuf,&data);
+  data = 40;
+  circular_buf_put(cbuf,&data);
+  // full, tail = 1, head = 1: 20 30 | 40
+  
+  if ( circular_buf_resize(cbuf,cbufsize+2) != 0 ) result = -1;
+  
+  data = 50;
+  circular_buf_put(cbuf,&data);
+  
+  for (data = 20; data <= 50; data += 10) {
+    uint32_t out;
+    if ( (circular_buf_get(cbuf,&out) != 0) || out != data ) result = -1;
+  }
+  
+  if ( (circular_buf_capacity(cbuf) != 5) || (circular_buf_size(cbuf) != 0) ) result = -1;
+  
+  circular_buf_free(cbuf);
+  
+  return result;
+}
+
+static int test_cbuffer_resize_auto(); // FCBUF_RESIZE_AUTO grows instead of refusing, in order, up to the limit
+
+static int test_cbuffer_resize_auto()
+{
+  uint32_t data;
+  uint32_t out[300];
+  int result = 0;
+  
+  cbuf_handle_t cbuf = circular_buf_init_flags(4,sizeof(uint32_t),FCBUF_RESIZE_AUTO);
+  circular_buf_set_resize_limit(cbuf,200);
+  
+  // keep the items wrapped while it grows
+  for (data = 1; data <= 2; data++)
+    circular_buf_put(cbuf,&data);
+  circular_buf_get(cbuf,&data);
+  
+  for (data = 3; data <= 150; data++)
+    if ( circular_buf_put(cbuf,&data) != 0 ) result = -1;
+  
+  for (data = 151; data <= 300; data++)
+    out[data - 151] = data;
+  if ( circular_buf_put_n(cbuf,out,150) != 51 ) result = -1; // 149 + 51 hits the limit
+  
+  if ( (circular_buf_capacity(cbuf) != 200) || (!circular_buf_full(cbuf)) || (circular_buf_get_overwrites(cbuf) != 0) ) result = -1;
+  
+  if ( circular_buf_get_n(cbuf,out,300) != 200 ) result = -1;
+  for (data = 0; data < 200; data++)
+    if ( out[data] != data + 2 ) result = -1;
+  
+  circular_buf_free(cbuf);
+  
+  return result;
+}
+
+static void *circular_buf_resize_reader(void* param) // helper of test_cbuffer_resize_concurrent, reads until it saw every item
+{
+  cbuf_handle_t cbuf = param;
+  uint32_t expected = 1;
+  uint32_t data;
+  
+  while (expected <= 200000) {
+    if (circular_buf_get(cbuf,&data) == -1) { sched_yield(); continue; }
+    if (data != expected) return (void *)-1;
+    expected++;
+  }
+  return NULL;
+}
+
+static int test_cbuffer_resize_concurrent(); // grow while a reader drains, nothing lost or reordered
+
+static int test_cbuffer_resize_concurrent()
+{
+  uint32_t data;
+  void *ret;
+  pthread_t reader;
+  
+  cbuf_handle_t cbuf = circular_buf_init_flags(16,sizeof(uint32_t),FCBUF_RESIZE_AUTO);
+  circular_buf_set_resize_limit(cbuf,100000);
+  
+  pthread_create(&reader, NULL, &circular_buf_resize_reader, cbuf);
+  
+  for (data = 1; data <= 200000; data++)
+    while (circular_buf_put(cbuf,&data) == -1)
+      sched_yield();
+  
+  pthread_join(reader,&ret);
+  circular_buf_free(cbuf);
+  
+  return (ret == NULL) ? 0 : -1;
+}
+
+static int test_cbuffer_records(); // short strings packed tightly, wrapping with a skip marker, overwriting whole records
+
+static int test_cbuffer_records()
+{
+  const char *words[] = { "Opa", "Não", "Sei", "Se", "Vai", "Funcionar", "Epa! Sobrescrevi!" };
+  char str[100];
+  int result = 0;
+  int len;
+  int i;
+  
+  // 48 bytes, records up to 24 bytes: a 4 byte header plus the payload rounded up to 4 bytes each
+  cbuf_handle_t cbuf = circular_buf_init_flags(48,24,FCBUF_RECORDS);
+  
+  for (i = 0; i < 7; i++)
+    circular_buf_put_record(cbuf,words[i],strlen(words[i]) + 1);
+  // "Funcionar" (16 bytes) and "Epa! Sobrescrevi!" (24 bytes) pushed out the 5 oldest
+  
+  if ( (circular_buf_size(cbuf) != 2) || (circular_buf_get_overwrites(cbuf) != 5) ) result = -1;
+  
+  for (i = 5; i < 7; i++) {
+    len = circular_buf_get_record(cbuf,str);
+    if ( len != (int)strlen(words[i]) + 1 || strcmp(str,words[i]) ) result = -1;
+  }
+  if ( circular_buf_get_record(cbuf,str) != -1 ) result = -1;
+  
+  circular_buf_free(cbuf);
+  
+  // a record that does not fit before the end goes to offset 0
+  cbuf = circular_buf_init_flags(48,24,FCBUF_RECORDS|FCBUF_DO_NOT_OVERWRITE);
+  
+  for (i = 0; i < 5; i++)
+    circular_buf_put_record(cbuf,words[i],strlen(words[i]) + 1); // 44 bytes used
+  circular_buf_get_record(cbuf,str);
+  circular_buf_get_record(cbuf,str);
+  
+  if ( circular_buf_put_record(cbuf,words[5],strlen(words[5]) + 1) != 0 ) result = -1; // skips the last 4 bytes
+  if ( circular_buf_put_record(cbuf,words[6],strlen(words[6]) + 1) != -1 ) result = -1; // no room
+  if ( circular_buf_put_record(cbuf,str,25) != -1 ) result = -1; // bigger than elemSize
+  
+  for (i = 2; i < 6; i++) {
+    len = circular_buf_get_record(cbuf,str);
+    if ( len != (int)strlen(words[i]) + 1 || strcmp(str,words[i]) ) result = -1;
+  }
+  
+  if ( (circular_buf_size(cbuf) != 0) || (!circular_buf_empty(cbuf)) || (circular_buf_get_overwrites(cbuf) != 0) ) result = -1;
+  
+  circular_buf_free(cbuf);
+  
+  return result;
+}
+
+CIRCULAR_BUF_DEFINE(cbuf_u32, uint32_t, 4096)
+CIRCULAR_BUF_DEFINE(cbuf_float, float, 4)
+
+static int test_cbuffer_typed(); // compile time typed rings: full, wrap and order, for uint32_t and float
+
+static int test_cbuffer_typed()
+{
+  static cbuf_u32_t ring;
+  cbuf_float_t ringFloat;
+  uint32_t data;
+  float value = 1.50;
+  int result = 0;
+  
+  cbuf_u32_init(&ring);
+  
+  for (data = 0; data < 4096; data++)
+    if (cbuf_u32_put(&ring,data) != 0) result = -1;
+  if ( (cbuf_u32_put(&ring,data) != -1) || (!cbuf_u32_full(&ring)) ) result = -1;
+  
+  // wrap a few times
+  for (data = 0; data < 10000; data++) {
+    uint32_t out;
+    if ( (cbuf_u32_get(&ring,&out) != 0) || out != data ) result = -1;
+    cbuf_u32_put(&ring,data + 4096);
+  }
+  if ( cbuf_u32_size(&ring) != 4096 ) result = -1;
+  
+  cbuf_float_init(&ringFloat);
+  for (data = 0; data < 4; data++, value += 1.55)
+    cbuf_float_put(&ringFloat,value);
+  cbuf_float_get(&ringFloat,&value);
+  if ( value != 1.50f || cbuf_float_size(&ringFloat) != 3 || cbuf_float_capacity(&ringFloat) != 4 ) result = -1;
+  while (cbuf_float_get(&ringFloat,&value) == 0)
+    ;
+  if ( !cbuf_float_empty(&ringFloat) ) result = -1;
+  
+  return result;
+}
+
+static int test_cbuffer_pow2(); // power of two capacity: rounding, overwrites, order across the wrap, bulk and resize
+
+static int test_cbuffer_pow2()
+{
+  uint32_t data, out, i;
+  uint32_t bulk[8];
+  uint64_t pos;
+  int result = 0;
+  
+  cbuf_handle_t cbuf = circular_buf_init_flags(5,sizeof(uint32_t),FCBUF_POW2);
+  
+  if ( circular_buf_capacity(cbuf) != 8 ) result = -1;
+  
+  // 20 puts into 8 slots: the last 8 survive
+  for (data = 0; data < 20; data++)
+    circular_buf_put(cbuf,&data);
+  if ( (!circular_buf_full(cbuf)) || (circular_buf_size(cbuf) != 8) || (circular_buf_get_overwrites(cbuf) != 12) ) result = -1;
+  
+  for (i = 12; i < 20; i++)
+    if ( circular_buf_get(cbuf,&out) != 0 || out != i ) result = -1;
+  if ( (!circular_buf_empty(cbuf)) || (circular_buf_get(cbuf,&out) != -1) ) result = -1;
+  
+  // bulk calls across the wrap
+  for (i = 0; i < 8; i++) bulk[i] = 100 + i;
+  circular_buf_put_n(cbuf,bulk,6);
+  circular_buf_get_n(cbuf,bulk,3);
+  for (i = 0; i < 8; i++) bulk[i] = 200 + i;
+  if ( circular_buf_put_n(cbuf,bulk,8) != 8 || circular_buf_get_overwrites(cbuf) != 15 ) result = -1; // 103..105 pushed out
+  if ( circular_buf_get_n(cbuf,bulk,8) != 8 ) result = -1;
+  for (i = 0; i < 8; i++)
+    if ( bulk[i] != 200 + i ) result = -1;
+  
+  // growing keeps the capacity a power of two, the items in order and the free running positions where they were
+  for (data = 0; data < 7; data++)
+    circular_buf_put(cbuf,&data);
+  pos = cbuf->tail;
+  if ( (circular_buf_resize(cbuf,10) != 0) || (circular_buf_capacity(cbuf) != 16) || (circular_buf_size(cbuf) != 7) ) result = -1;
+  if ( cbuf->tail != pos || cbuf->head != pos + 7 ) result = -1;
+  for (data = 7; data < 16; data++)
+    circular_buf_put(cbuf,&data);
+  if ( !circular_buf_full(cbuf) ) result = -1;
+  for (i = 0; i < 16; i++)
+    if ( circular_buf_get(cbuf,&out) != 0 || out != i ) result = -1;
+  
+  circular_buf_free(cbuf);
+  
+  // the mirror rounding keeps it a power of two, even for odd element sizes
+  if ( (cbuf = circular_buf_init_flags(5,12,FCBUF_POW2|FCBUF_MIRRORED)) == NULL ) return -1;
+  if ( circular_buf_capacity(cbuf) & (circular_buf_capacity(cbuf) - 1) ) result = -1;
+  circular_buf_free(cbuf);
+  if ( (cbuf = circular_buf_init_flags(5,sizeof(uint32_t),FCBUF_POW2|FCBUF_SPSC)) == NULL ) return -1;
+  for (data = 0; data < 8; data++)
+    circular_buf_put(cbuf,&data);
+  if ( (circular_buf_put(cbuf,&data) != -1) || (circular_buf_capacity(cbuf) != 8) ) result = -1;
+  for (i = 0; i < 8; i++)
+    if ( circular_buf_get(cbuf,&out) != 0 || out != i ) result = -1;
+  circular_buf_free(cbuf);
+  
+  return result;
+}
+
+static int test_cbuffer_timestamp(); // FCBUF_WRITE_TIMESTAMP: time window search over a wrapped buffer, kept by resize
+
+static int test_cbuffer_timestamp()
+{
+  uint32_t data, first, last, i;
+  uint32_t out[5];
+  uint64_t t1, t2;
+  int result = 0;
+  
+  cbuf_handle_t cbuf = circular_buf_init_flags(12,sizeof(uint32_t),FCBUF_WRITE_TIMESTAMP);
+  
+  // three batches of 5, the stamps are coarse so keep the batches well apart
+  for (data = 0; data < 5; data++)
+    circular_buf_put(cbuf,&data);
+  usleep(20000);
+  t1 = circular_buf_timestamp();
+  for (data = 5; data < 10; data++)
+    circular_buf_put(cbuf,&data);
+  t2 = circular_buf_timestamp();
+  usleep(20000);
+  for (data = 10; data < 15; data++)
+    circular_buf_put(cbuf,&data); // overwrites 0..2
+  
+  // offset 0 is 3, so the second batch sits at offsets 2..6
+  if ( circular_buf_find_time(cbuf,t1,t2,&first,&last) != 0 || first != 2 || last != 6 ) result = -1;
+  if ( circular_buf_read_at(cbuf,first,out,last - first + 1) != 5 ) result = -1;
+  for (i = 0; i < 5; i++)
+    if ( out[i] != 5 + i ) result = -1;
+  
+  // everything after t2, and nothing before the first put
+  if ( circular_buf_find_time(cbuf,t2 + 1,UINT64_MAX,&first,&last) != 0 || first != 7 || last != 11 ) result = -1;
+  if ( circular_buf_find_time(cbuf,0,t1/2,&first,&last) != -1 ) result = -1;
+  
+  // the stamps move with the items
+  circular_buf_get(cbuf,&data);
+  if ( circular_buf_resize(cbuf,20) != 0 ) result = -1;
+  if ( circular_buf_find_time(cbuf,t1,t2,&first,&last) != 0 || first != 1 || last != 5 ) result = -1;
+  
+  circular_buf_free(cbuf);
+  
+  if ( circular_buf_init_flags(12,sizeof(uint32_t),FCBUF_WRITE_TIMESTAMP|FCBUF_SPSC) != NULL ) result = -1;
+  
+  return result;
 }
 
-bool circular_buf_empty(circular_buf_t* cbuf)
+static int test_cbuffer_stats(); // counters of the CBUF_STATS build (only overwrites without it)
+
+static int test_cbuffer_stats()
 {
-	// We define empty as head == tail
-    //return (cbuf->head == cbuf->tail);
-    return (cbuf->head == cbuf->tail && !(cbuf->full));
+  circular_buf_stats_t stats;
+  uint32_t data[8];
+  uint32_t i;
+  uint64_t calls = 0;
+  int result = 0;
+  
+  cbuf_handle_t cbuf = circular_buf_init(4,sizeof(uint32_t));
+  
+  for (i = 0; i < 6; i++)
+    circular_buf_put(cbuf,&i); // 2 overwrites
+  for (i = 0; i < 5; i++)
+    circular_buf_get(cbuf,data); // the 5th finds nothing
+  circular_buf_put_n(cbuf,data,3);
+  if ( circular_buf_get_n(cbuf,data,8) != 3 || circular_buf_get_n(cbuf,data,8) != 0 ) result = -1;
+  
+  if ( circular_buf_get_stats(cbuf,&stats) != 0 ) {
+    // statistics compiled out
+    if ( stats.overwrites != 2 || stats.puts != 0 ) result = -1;
+    circular_buf_free(cbuf);
+    return result;
+  }
+  
+  if ( stats.puts != 9 || stats.gets != 7 || stats.emptyGets != 2 || stats.overwrites != 2 || stats.highWater != 4 ) result = -1;
+  if ( (stats.lockContended == 0) != (stats.lockWaitNs == 0) ) result = -1;
+#ifdef CBUF_STATS_LATENCY
+  for (i = 0; i < CBUF_STATS_BUCKETS; i++)
+    calls += stats.putLatency[i];
+  if ( calls != 7 ) result = -1; // 6 puts and 1 put_n
+#endif
+  (void)calls;
+  
+  circular_buf_reset_stats(cbuf);
+  circular_buf_get_stats(cbuf,&stats);
+  if ( stats.puts != 0 || stats.highWater != 0 ) result = -1;
+  
+  circular_buf_free(cbuf);
+  return result;
 }
 
-uint32_t circular_buf_get_overwrites(cbuf_handle_t cbuf)
+static int test_cbuffer_set(); // sharded set: per shard order, stealing from the other shards, threads
+
+#define SETITEMSPERTHREAD 50000
+static cbuf_set_handle_t cbufSet;
+static uint32_t setConsumed;
+static uint64_t setSum;
+static uint32_t setProducersDone;
+
+static void *circular_buf_set_producer(void* param)
 {
-   return cbuf->overwrites;
+  uint32_t i;
+  
+  (void)param;
+  for (i = 1; i <= SETITEMSPERTHREAD; i++)
+    while (circular_buf_set_put(cbufSet,&i) != 0)
+      sched_yield();
+  return NULL;
 }
 
-static int test_cbuffer_overwrite_empty();  // Creates a cbuf_overwrite and tries to read an item from an empty one.
+static void *circular_buf_set_consumer(void* param)
+{
+  uint32_t data[16];
+  uint32_t n, i;
+  
+  (void)param;
+  for (;;) {
+    n = circular_buf_set_get_n(cbufSet,data,16);
+    if (n == 0) {
+      if (__atomic_load_n(&setProducersDone,__ATOMIC_ACQUIRE) && circular_buf_set_size(cbufSet) == 0) break;
+      sched_yield();
+      continue;
+    }
+    for (i = 0; i < n; i++)
+      __atomic_fetch_add(&setSum,data[i],__ATOMIC_RELAXED);
+    __atomic_fetch_add(&setConsumed,n,__ATOMIC_RELAXED);
+  }
+  return NULL;
+}
 
-static int test_cbuffer_overwrite_empty()
+static int test_cbuffer_set()
 {
-  	
-  int cbufsize = 3;
-  uint32_t data;
-  int result;
+  uint32_t data, last[4] = { 0, 0, 0, 0 };
+  uint32_t i, shard;
+  pthread_t producers[4], consumers[4];
+  int result = 0;
   
-  cbuf_handle_t cbuf = circular_buf_init(cbufsize,sizeof(uint32_t));
+  cbufSet = circular_buf_set_init(4,8,sizeof(uint32_t),FCBUF_DO_NOT_OVERWRITE);
   
-  if (circular_buf_get(cbuf,&data) == -1 ) 
-    result = 0;
-  else 
-    result = -1;  
+  // value = shard * 1000 + n, whichever shard the reader runs on it must get every shard in order
+  for (i = 1; i <= 6; i++)
+    for (shard = 1; shard < 4; shard++) {
+      data = shard*1000 + i;
+      circular_buf_set_put_to(cbufSet,shard,&data);
+    }
+  if ( circular_buf_set_size(cbufSet) != 18 ) result = -1;
+  for (i = 0; i < 18; i++) {
+    if ( circular_buf_set_get(cbufSet,&data) != 0 ) result = -1;
+    shard = data/1000;
+    if ( shard == 0 || shard > 3 || data%1000 != last[shard] + 1 ) result = -1;
+    else last[shard] = data%1000;
+  }
+  if ( circular_buf_set_get(cbufSet,&data) != -1 ) result = -1;
   
-  circular_buf_free(cbuf); 
-    
-  return result;     	
+  // a full shard spills over to the next one, the set is full only when all of them are
+  for (i = 0; i < 32; i++)
+    if ( circular_buf_set_put_to(cbufSet,2,&i) != 0 ) result = -1;
+  if ( circular_buf_set_put_to(cbufSet,2,&i) != -1 || circular_buf_size(circular_buf_set_shard(cbufSet,2)) != 8 ) result = -1;
+  while (circular_buf_set_get(cbufSet,&data) == 0)
+    ;
+  
+  for (i = 0; i < 4; i++) {
+    pthread_create(&producers[i],NULL,&circular_buf_set_producer,NULL);
+    pthread_create(&consumers[i],NULL,&circular_buf_set_consumer,NULL);
+  }
+  for (i = 0; i < 4; i++)
+    pthread_join(producers[i],NULL);
+  __atomic_store_n(&setProducersDone,1,__ATOMIC_RELEASE);
+  for (i = 0; i < 4; i++)
+    pthread_join(consumers[i],NULL);
+  
+  if ( setConsumed != 4*SETITEMSPERTHREAD || setSum != 4*((uint64_t)SETITEMSPERTHREAD*(SETITEMSPERTHREAD + 1)/2) ) result = -1;
+  
+  circular_buf_set_free(cbufSet);
+  return result;
 }
 
-static int test_cbuffer_overwrite_full(); // Creates a cbuf_overwrite and fills it to maximum and verify it is full
+static int test_cbuffer_broadcast(); // every consumer reads every item, slowest consumer limits, missed counts
 
-static int test_cbuffer_overwrite_full()
+#define BROADCASTITEMS 100000
+static cbuf_handle_t cbufBroadcast;
+
+// Reads until it has seen the last item, returns -1 in *result if anything came out of order
+// or got + missed does not add up
+static void *circular_buf_broadcast_reader(void* param)
 {
-  int cbufsize = 3;
-  uint32_t data;
-  bool result;
-  int i;
-  cbuf_handle_t cbuf = circular_buf_init(cbufsize,sizeof(uint32_t));
+  int consumer = *(int *)param;
+  uint32_t data, last = 0;
+  uint64_t missed, got = 0, lost = 0;
   
-  for ( i = 0; i < cbufsize; i++)
-    circular_buf_put(cbuf,(void *)&data);
-   
-  result = circular_buf_full(cbuf); 
+  while (last < BROADCASTITEMS) {
+    if (circular_buf_get_from(cbufBroadcast,consumer,&data,&missed) != 0) {
+      lost += missed;
+      sched_yield();
+      continue;
+    }
+    lost += missed;
+    if (data <= last) *(int *)param = -1;
+    last = data;
+    got++;
+  }
+  if (got + lost != BROADCASTITEMS) *(int *)param = -1;
+  else if (*(int *)param != -1) *(int *)param = 0;
+  return NULL;
+}
+
+static int test_cbuffer_broadcast_threads(uint32_t flags)
+{
+  pthread_t readers[3];
+  int consumers[3];
+  uint32_t i;
+  int result = 0;
   
-  circular_buf_free(cbuf); 
+  cbufBroadcast = circular_buf_init_flags(64,sizeof(uint32_t),FCBUF_BROADCAST|flags);
+  for (i = 0; i < 3; i++) {
+    consumers[i] = circular_buf_subscribe(cbufBroadcast);
+    pthread_create(&readers[i],NULL,&circular_buf_broadcast_reader,&consumers[i]);
+  }
+  for (i = 1; i <= BROADCASTITEMS; i++)
+    while (circular_buf_put(cbufBroadcast,&i) != 0)
+      sched_yield();
+  for (i = 0; i < 3; i++) {
+    pthread_join(readers[i],NULL);
+    if (consumers[i] != 0) result = -1;
+  }
+  circular_buf_free(cbufBroadcast);
+  return result;
+}
 
-  if ( result == true ) 
-    return 0;
-  else
-    return -1;  
+static int test_cbuffer_broadcast()
+{
+  uint32_t data, i;
+  uint64_t missed;
+  int a, b;
+  int result = 0;
+  
+  cbuf_handle_t cbuf = circular_buf_init_flags(4,sizeof(uint32_t),FCBUF_BROADCAST);
+  a = circular_buf_subscribe(cbuf);
+  b = circular_buf_subscribe(cbuf);
+  
+  for (i = 0; i < 3; i++)
+    circular_buf_put(cbuf,&i);
+  for (i = 0; i < 3; i++)
+    if ( circular_buf_get_from(cbuf,a,&data,&missed) != 0 || data != i || missed != 0 ) result = -1;
+  if ( circular_buf_get_from(cbuf,a,&data,&missed) != -1 || circular_buf_size(cbuf) != 3 ) result = -1;
+  
+  for (i = 3; i < 9; i++)
+    circular_buf_put(cbuf,&i);
+  // b is 9 items behind and a 6, only 5..8 are left
+  if ( circular_buf_get_from(cbuf,b,&data,&missed) != 0 || data != 5 || missed != 5 ) result = -1;
+  if ( circular_buf_get_from(cbuf,a,&data,&missed) != 0 || data != 5 || missed != 2 ) result = -1;
+  for (i = 6; i < 9; i++)
+    if ( circular_buf_get_from(cbuf,b,&data,&missed) != 0 || data != i || missed != 0 ) result = -1;
+  if ( circular_buf_get(cbuf,&data) != -1 ) result = -1;
+  circular_buf_free(cbuf);
+  
+  // not overwriting: the slowest consumer holds the producer back
+  cbuf = circular_buf_init_flags(4,sizeof(uint32_t),FCBUF_BROADCAST|FCBUF_DO_NOT_OVERWRITE);
+  a = circular_buf_subscribe(cbuf);
+  b = circular_buf_subscribe(cbuf);
+  for (i = 0; i < 4; i++)
+    circular_buf_put(cbuf,&i);
+  if ( circular_buf_put(cbuf,&i) != -1 || !circular_buf_full(cbuf) ) result = -1;
+  while (circular_buf_get_from(cbuf,a,&data,NULL) == 0)
+    ;
+  if ( circular_buf_put(cbuf,&i) != -1 ) result = -1;
+  circular_buf_get_from(cbuf,b,&data,NULL);
+  if ( circular_buf_put(cbuf,&i) != 0 || circular_buf_put(cbuf,&i) != -1 ) result = -1;
+  circular_buf_unsubscribe(cbuf,b);
+  if ( circular_buf_size(cbuf) != 1 ) result = -1;
+  for (i = 0; i < 3; i++)
+    if ( circular_buf_put(cbuf,&i) != 0 ) result = -1;
+  if ( circular_buf_put(cbuf,&i) != -1 ) result = -1;
+  circular_buf_free(cbuf);
   
+  if ( test_cbuffer_broadcast_threads(FCBUF_DO_NOT_OVERWRITE) != 0 ) result = -1;
+  if ( test_cbuffer_broadcast_threads(FCBUF_OVERWRITE) != 0 ) result = -1;
+  
+  return result;
 }
 
-static int test_cbuffer_overwrite_get_size(); // Creates a cbuf, insert x itens and verify the size
+static int test_cbuffer_persistent(); // file backed buffer: contents survive a reopen and a crashed process
 
-static int test_cbuffer_overwrite_get_size()
+static int test_cbuffer_persistent()
 {
-
-  int cbufsize = 3;
-  uint32_t data;
-  int result;
+  char path[] = "/tmp/cbuf_test_XXXXXX";
+  uint32_t data, i;
+  int status, fd;
+  pid_t pid;
+  int result = 0;
   
-  cbuf_handle_t cbuf = circular_buf_init(cbufsize,sizeof(uint32_t));
+  fd = mkstemp(path); // an empty file is created as a new ring
+  if (fd < 0) return -1;
+  close(fd);
   
-  circular_buf_put(cbuf,(void *)&data);
-  circular_buf_put(cbuf,(void *)&data);
+  cbuf_handle_t cbuf = circular_buf_init_file(path,6,sizeof(uint32_t),FCBUF_OVERWRITE);
+  if (cbuf == NULL) { unlink(path); return -1; }
+  for (data = 0; data < 10; data++)
+    circular_buf_put(cbuf,&data); // 8 slots: 0 and 1 overwritten
+  circular_buf_get(cbuf,&data);
+  circular_buf_free(cbuf);
   
-  if ( circular_buf_size(cbuf)  == 2)
-    result = 0;
-  else
-    result = -1;  
-    
-  circular_buf_free(cbuf); 
-    
-  return result;     	
+  // restart: the capacity comes from the file, and a different element size is refused
+  if ( circular_buf_init_file(path,6,sizeof(uint64_t),FCBUF_OVERWRITE) != NULL ) result = -1;
+  cbuf = circular_buf_init_file(path,100,sizeof(uint32_t),FCBUF_OVERWRITE);
+  if ( cbuf == NULL ) { unlink(path); return -1; }
+  if ( circular_buf_capacity(cbuf) != 8 || circular_buf_size(cbuf) != 7 || circular_buf_get_overwrites(cbuf) != 2 ) result = -1;
+  circular_buf_free(cbuf);
+  
+  // a process that dies without closing, or syncing, anything
+  pid = fork();
+  if (pid == 0) {
+    cbuf = circular_buf_init_file(path,0,sizeof(uint32_t),FCBUF_OVERWRITE);
+    for (data = 10; data < 13; data++)
+      circular_buf_put(cbuf,&data);
+    abort();
+  }
+  waitpid(pid,&status,0);
+  
+  cbuf = circular_buf_init_file(path,0,sizeof(uint32_t),FCBUF_OVERWRITE);
+  if ( cbuf == NULL ) { unlink(path); return -1; }
+  circular_buf_set_sync(cbuf,4,0);
+  if ( circular_buf_size(cbuf) != 8 || circular_buf_get_overwrites(cbuf) != 4 ) result = -1;
+  for (i = 5; i < 13; i++)
+    if ( circular_buf_get(cbuf,&data) != 0 || data != i ) result = -1;
+  if ( circular_buf_sync(cbuf) != 0 || circular_buf_resize(cbuf,16) != -1 ) result = -1;
+  circular_buf_free(cbuf);
+  
+  unlink(path);
+  return result;
 }
 
-static int test_cbuffer_overwrite_do_one_overwrite(); // Creates a buf, and overwrite one item
+static int test_cbuffer_alloc_options(); // huge pages, NUMA binding and prefault: the buffer works the same and survives a resize
 
-static int test_cbuffer_overwrite_do_one_overwrite()
+static int test_cbuffer_alloc_options()
 {
-	
-  int cbufsize = 3;
-  uint32_t data = 10;
-  int result;
+  uint32_t data, out, i;
+  int result = 0;
+  cbuf_handle_t cbuf;
   
-  cbuf_handle_t cbuf = circular_buf_init(cbufsize,sizeof(uint32_t));
+  // prefaulted: a private mapping instead of malloc, grown by resize into another one
+  if ( (cbuf = circular_buf_init_flags(1000,sizeof(uint32_t),FCBUF_PREFAULT)) == NULL ) return -1;
+  for (data = 0; data < 1000; data++)
+    circular_buf_put(cbuf,&data);
+  if ( circular_buf_resize(cbuf,5000) != 0 || circular_buf_size(cbuf) != 1000 ) result = -1;
+  for (data = 1000; data < 3000; data++)
+    circular_buf_put(cbuf,&data);
+  for (i = 0; i < 3000; i++)
+    if ( circular_buf_get(cbuf,&out) != 0 || out != i ) result = -1;
+  circular_buf_free(cbuf);
   
-  circular_buf_put(cbuf,(void *)&data);
-  circular_buf_put(cbuf,(void *)&data);
-  circular_buf_put(cbuf,(void *)&data);
-  // buffer is full
+  // transparent huge pages are only a hint, so this works with THP off as well
+  if ( (cbuf = circular_buf_init_flags(1 << 20,sizeof(uint32_t),FCBUF_THP|FCBUF_PREFAULT|FCBUF_POW2)) == NULL ) return -1;
+  for (data = 0; data < (1 << 21); data++)
+    circular_buf_put(cbuf,&data);
+  if ( circular_buf_get_overwrites(cbuf) != (1 << 20) || circular_buf_get(cbuf,&out) != 0 || out != (1 << 20) ) result = -1;
+  circular_buf_free(cbuf);
   
-  data = 50;
-  circular_buf_put(cbuf,(void *)&data);
-  // overwrite one element
+  // explicit huge pages need a reserved pool (vm.nr_hugepages): NULL without one, a working buffer with one
+  if ( (cbuf = circular_buf_init_flags(1000,sizeof(uint32_t),FCBUF_HUGETLB)) != NULL ) {
+    for (data = 0; data < 10; data++)
+      circular_buf_put(cbuf,&data);
+    for (i = 0; i < 10; i++)
+      if ( circular_buf_get(cbuf,&out) != 0 || out != i ) result = -1;
+    circular_buf_free(cbuf);
+  }
   
-  circular_buf_get(cbuf,&data);
-  //printf("data: %d\n",data);
-  circular_buf_get(cbuf,&data);
-  //printf("data: %d\n",data);
-  circular_buf_get(cbuf,&data);
-  //printf("data: %d\n",data);
-  // get all three elements, the third should be 50 and numberof overwrites = 1
+  // node 0 exists on every machine, but mbind is missing without CONFIG_NUMA (and in some sandboxes)
+  if ( (cbuf = circular_buf_init_numa(1000,sizeof(uint32_t),FCBUF_PREFAULT,0)) != NULL ) {
+    for (data = 0; data < 10; data++)
+      circular_buf_put(cbuf,&data);
+    for (i = 0; i < 10; i++)
+      if ( circular_buf_get(cbuf,&out) != 0 || out != i ) result = -1;
+    circular_buf_free(cbuf);
+  }
+  else if ( errno != ENOSYS && errno != EPERM ) result = -1;
   
-  if ( ( circular_buf_get_overwrites(cbuf) == 1 ) && data == 50 )
-    result = 0;
-  else
-    result = -1;  
-    
-  circular_buf_free(cbuf); 
-    
-  return result;     	
-	
+  // a mirrored buffer is two views of shared pages, it can not ask for huge ones
+  if ( circular_buf_init_flags(1000,sizeof(uint32_t),FCBUF_THP|FCBUF_MIRRORED) != NULL ) result = -1;
+  if ( circular_buf_init_flags(1000,sizeof(uint32_t),FCBUF_THP|FCBUF_HUGETLB) != NULL ) result = -1;
+  if ( circular_buf_init_numa(1000,sizeof(uint32_t),0,CBUF_NUMA_NODES) != NULL ) result = -1;
+  
+  return result;
 }
 
-static int test_cbuffer_overwrite_partial_read(); 
+static int test_cbuffer_segmented(); // chunked buffer: memory follows the items held, order kept across chunks and the wrap
 
-static int test_cbuffer_overwrite_partial_read()
+static int test_cbuffer_segmented()
 {
-
-  int cbufsize = 3;
-  uint32_t data = 10;
-  int result;
+  uint32_t data, out, i, n;
+  uint32_t item[4096], bulk[6*4096]; // 16 KiB items: 4 per chunk
+  uint32_t *slot;
+  int result = 0;
+  cbuf_handle_t cbuf;
   
-  cbuf_handle_t cbuf = circular_buf_init(cbufsize,sizeof(uint32_t));
+  // a ring for a million items holds nothing until used, and gives the chunks back when drained
+  if ( (cbuf = circular_buf_init_flags(1 << 20,sizeof(uint32_t),FCBUF_SEGMENTED|FCBUF_DO_NOT_OVERWRITE)) == NULL ) return -1;
+  if ( circular_buf_get_resident(cbuf) != 0 || circular_buf_capacity(cbuf) != (1 << 20) ) result = -1;
+  for (data = 0; data < 100; data++)
+    circular_buf_put(cbuf,&data);
+  if ( circular_buf_get_resident(cbuf) != CBUF_SEGMENT_BYTES ) result = -1;
+  for (data = 100; data < 200000; data++)
+    circular_buf_put(cbuf,&data);
+  if ( circular_buf_get_resident(cbuf) != (size_t)(200000 / (CBUF_SEGMENT_BYTES / 4) + 1)*CBUF_SEGMENT_BYTES ) result = -1;
+  for (i = 0; i < 200000; i++)
+    if ( circular_buf_get(cbuf,&out) != 0 || out != i ) result = -1;
+  if ( circular_buf_get_resident(cbuf) != (1 + CBUF_SEGMENT_SPARES)*CBUF_SEGMENT_BYTES ) result = -1; // the chunk of head and the spares
+  if ( circular_buf_resize(cbuf,1 << 21) != -1 ) result = -1;
+  circular_buf_free(cbuf);
   
-  circular_buf_put(cbuf,(void *)&data);
-  circular_buf_put(cbuf,(void *)&data);
-  circular_buf_put(cbuf,(void *)&data);
-  // buffer is full
-     
-  circular_buf_get(cbuf,&data);
-  circular_buf_get(cbuf,&data);
-  // get two from three elements, size should be one
+  // 4 chunks of 4 items, overwriting: bulk calls, reserve and peek across chunks and the wrap
+  if ( (cbuf = circular_buf_init_flags(15,sizeof(item),FCBUF_SEGMENTED)) == NULL ) return -1;
+  if ( circular_buf_capacity(cbuf) != 16 ) result = -1;
+  for (data = 0; data < 40; data++) {
+    item[0] = item[4095] = data;
+    circular_buf_put(cbuf,item);
+  }
+  if ( circular_buf_size(cbuf) != 16 || circular_buf_get_overwrites(cbuf) != 24 ) result = -1;
+  if ( circular_buf_read_at(cbuf,5,bulk,2) != 2 || bulk[0] != 29 || bulk[4096] != 30 ) result = -1;
+  if ( circular_buf_get_n(cbuf,bulk,6) != 6 ) result = -1;
+  for (i = 0; i < 6; i++)
+    if ( bulk[i*4096] != 24 + i || bulk[i*4096 + 4095] != 24 + i ) result = -1;
+  for (i = 0; i < 6; i++) bulk[i*4096] = 100 + i;
+  if ( circular_buf_put_n(cbuf,bulk,6) != 6 || circular_buf_size(cbuf) != 16 ) result = -1;
+  for (i = 30; i < 40; i++)
+    if ( circular_buf_get(cbuf,item) != 0 || item[0] != i || item[4095] != i ) result = -1;
   
-  if ( ( circular_buf_get_overwrites(cbuf) == 0 ) && (circular_buf_size(cbuf) == 1 ) && (!circular_buf_full(cbuf)) )
-    result = 0;
-  else
-    result = -1;  
-    
-  circular_buf_free(cbuf); 
-    
-  return result;     	
+  // peek stops at the end of the chunk: of the 6 items from slot 8 on, 4 are in the first chunk
+  n = 6;
+  if ( (slot = circular_buf_peek(cbuf,&n)) == NULL || n != 4 || slot[0] != 100 || slot[3*4096] != 103 ) result = -1;
+  circular_buf_release(cbuf,n);
+  n = 8;
+  if ( (slot = circular_buf_peek(cbuf,&n)) == NULL || n != 2 || slot[4096] != 105 ) result = -1;
+  circular_buf_release(cbuf,n);
+  n = 8;
+  if ( (slot = circular_buf_reserve(cbuf,&n)) == NULL || n != 2 ) result = -1; // head is at slot 14
+  else {
+    slot[0] = 200;
+    circular_buf_commit(cbuf,1);
+  }
+  if ( circular_buf_get(cbuf,item) != 0 || item[0] != 200 || !circular_buf_empty(cbuf) ) result = -1;
+  if ( circular_buf_get_resident(cbuf) > (1 + CBUF_SEGMENT_SPARES)*CBUF_SEGMENT_BYTES ) result = -1; // the chunk of head and the spares
+  circular_buf_free(cbuf);
+  
+  // the chunks are only reached under the lock
+  if ( circular_buf_init_flags(16,sizeof(uint32_t),FCBUF_SEGMENTED|FCBUF_SPSC) != NULL ) result = -1;
+  if ( circular_buf_init_flags(16,sizeof(uint32_t),FCBUF_SEGMENTED|FCBUF_MIRRORED) != NULL ) result = -1;
+  
+  return result;
+}
+
+#define SNAPSHOTITEMS 200000
+static cbuf_handle_t cbufSnapshot;
 
+// Puts SNAPSHOTITEMS items of 8 copies of the same number, as fast as it can
+static void *circular_buf_snapshot_writer(void* param)
+{
+  uint64_t item[8];
+  uint32_t i, j;
+  
+  for (i = 1; i <= SNAPSHOTITEMS; i++) {
+    for (j = 0; j < 8; j++) item[j] = i;
+    circular_buf_put(cbufSnapshot,item);
+  }
+  return param;
 }
 
-static int test_cbuffer_overwrite_full_read();
+static int test_cbuffer_snapshot(); // latest N items copied without the lock and without consuming them, also while a producer overwrites
 
-static int test_cbuffer_overwrite_full_read() 
+static int test_cbuffer_snapshot()
 {
-  int cbufsize = 3;
-  uint32_t data = 10;
-  int result;
+  uint32_t data, i, j, n;
+  uint32_t out[16];
+  uint64_t items[32][8];
+  pthread_t writer;
+  int result = 0;
   
-  cbuf_handle_t cbuf = circular_buf_init(cbufsize,sizeof(uint32_t));
+  cbuf_handle_t cbuf = circular_buf_init_flags(16,sizeof(uint32_t),FCBUF_SNAPSHOT);
+  if (cbuf == NULL) return -1;
   
-  circular_buf_put(cbuf,(void *)&data);
-  circular_buf_put(cbuf,(void *)&data);
-  circular_buf_put(cbuf,(void *)&data);
-  // buffer is full
-     
-  circular_buf_get(cbuf,&data);
-  circular_buf_get(cbuf,&data);
-  circular_buf_get(cbuf,&data);
+  if ( circular_buf_snapshot(cbuf,out,4) != 0 ) result = -1;
+  for (data = 0; data < 3; data++)
+    circular_buf_put(cbuf,&data);
+  if ( circular_buf_snapshot(cbuf,out,4) != 3 || out[0] != 0 || out[2] != 2 ) result = -1;
   
-  // get all elements
+  // after the wrap: the latest ones, oldest first, and the ring is left as it was
+  for (data = 3; data < 40; data++)
+    circular_buf_put(cbuf,&data);
+  if ( circular_buf_snapshot(cbuf,out,5) != 5 || out[0] != 35 || out[4] != 39 ) result = -1;
+  if ( circular_buf_snapshot(cbuf,out,100) != 16 || out[0] != 24 || out[15] != 39 ) result = -1;
+  if ( circular_buf_size(cbuf) != 16 || circular_buf_get(cbuf,&data) != 0 || data != 24 ) result = -1;
   
-  if ( ( circular_buf_get_overwrites(cbuf) == 0 ) && (circular_buf_size(cbuf) == 0 ) && (!circular_buf_full(cbuf)) )
-    result = 0;
-  else
-    result = -1;  
-    
-  circular_buf_free(cbuf); 
-    
-  return result;     	
+  // bulk puts publish their slots too, and consumed items are gone from the snapshot
+  for (i = 0; i < 16; i++) out[i] = 100 + i;
+  circular_buf_put_n(cbuf,out,6);
+  circular_buf_get_n(cbuf,out,12);
+  if ( circular_buf_snapshot(cbuf,out,16) != 4 || out[0] != 102 || out[3] != 105 ) result = -1;
+  if ( circular_buf_resize(cbuf,64) != -1 || circular_buf_reserve(cbuf,&n) != NULL ) result = -1;
+  circular_buf_free(cbuf);
+  
+  // a reader never sees a torn item, and always a run of consecutive ones
+  if ( (cbufSnapshot = circular_buf_init_flags(32,sizeof(items[0]),FCBUF_SNAPSHOT)) == NULL ) return -1;
+  pthread_create(&writer,NULL,&circular_buf_snapshot_writer,NULL);
+  do {
+    n = circular_buf_snapshot(cbufSnapshot,items,32);
+    for (i = 0; i < n; i++) {
+      for (j = 1; j < 8; j++)
+        if ( items[i][j] != items[i][0] ) result = -1;
+      if ( i > 0 && items[i][0] != items[i-1][0] + 1 ) result = -1;
+    }
+  } while ( n == 0 || items[n-1][0] != SNAPSHOTITEMS );
+  pthread_join(writer,NULL);
+  if ( circular_buf_snapshot(cbufSnapshot,items,32) != 32 || items[0][0] != SNAPSHOTITEMS - 31 ) result = -1;
+  circular_buf_free(cbufSnapshot);
+  
+  // broadcast rings carry the same sequence numbers
+  if ( (cbuf = circular_buf_init_flags(8,sizeof(uint32_t),FCBUF_BROADCAST)) == NULL ) return -1;
+  for (data = 0; data < 10; data++)
+    circular_buf_put(cbuf,&data);
+  if ( circular_buf_snapshot(cbuf,out,3) != 3 || out[0] != 7 || out[2] != 9 ) result = -1;
+  circular_buf_free(cbuf);
+  
+  if ( circular_buf_init_flags(16,sizeof(uint32_t),FCBUF_SNAPSHOT|FCBUF_SPSC) != NULL ) result = -1;
+  
+  return result;
 }
 
-static int test_cbuffer_overwrite_resize();
+#define EVENTFDITEMS 100000
+static cbuf_handle_t cbufEventfd;
 
-static int test_cbuffer_overwrite_resize() 
+// Puts EVENTFDITEMS items, waiting on the writable eventfd whenever the ring is full
+static void *circular_buf_eventfd_producer(void* param)
 {
-  int cbufsize = 3;
-  uint32_t data = 10;
-  int result;
-  
-  cbuf_handle_t cbuf = circular_buf_init(cbufsize,sizeof(uint32_t));
-  
-  circular_buf_put(cbuf,(void *)&data);
-  data += 10;
-  circular_buf_put(cbuf,(void *)&data);
+  struct epoll_event ev = { .events = EPOLLIN };
+  int ep = epoll_create1(EPOLL_CLOEXEC);
+  uint32_t data = 0;
   
-  circular_buf_resize(cbuf,cbufsize+2);
-   
-  if ( (circular_buf_capacity(cbuf) == 5 ) && (!circular_buf_full(cbuf)) && (circular_buf_size(cbuf) == 2 ) )
-    result = 0;
-  else
-    result = -1;  
-    
-  circular_buf_free(cbuf); 
-    
-  return result;     	
+  epoll_ctl(ep,EPOLL_CTL_ADD,circular_buf_event_fd(cbufEventfd,CBUF_EVENT_WRITABLE),&ev);
+  while (data < EVENTFDITEMS) {
+    if (epoll_wait(ep,&ev,1,5000) != 1) { *(int *)param = -1; break; }
+    circular_buf_event_ack(cbufEventfd,CBUF_EVENT_WRITABLE);
+    while (data < EVENTFDITEMS && circular_buf_put(cbufEventfd,&data) == 0)
+      data++;
+  }
+  close(ep);
+  return NULL;
 }
 
-static int test_cbuffer_overwrite_check_read_order();
+static int test_cbuffer_eventfd(); // readable/writable eventfds: one signal per burst, and an epoll loop that never misses an item
 
-static int test_cbuffer_overwrite_check_read_order()
+static int test_cbuffer_eventfd()
 {
-  int cbufsize = 3;
-  uint32_t data = 10;
-  int result = 0;
+  struct epoll_event ev = { .events = EPOLLIN };
+  uint32_t data, expected = 0;
+  uint64_t value;
+  pthread_t producer;
+  int rfd, wfd, ep, producerResult = 0, result = 0;
   
-  cbuf_handle_t cbuf = circular_buf_init(cbufsize,sizeof(uint32_t));
+  cbuf_handle_t cbuf = circular_buf_init_flags(8,sizeof(uint32_t),FCBUF_EVENTFD|FCBUF_DO_NOT_OVERWRITE);
+  if (cbuf == NULL) return -1;
+  rfd = circular_buf_event_fd(cbuf,CBUF_EVENT_READABLE);
+  wfd = circular_buf_event_fd(cbuf,CBUF_EVENT_WRITABLE);
   
-  circular_buf_put(cbuf,(void *)&data);
-  data += 10;
-  circular_buf_put(cbuf,(void *)&data);
-  data += 10;
-  circular_buf_put(cbuf,(void *)&data);
-  // buffer is full
-     
-  circular_buf_get(cbuf,&data);
+  // nothing to read yet, room to write
+  if ( read(rfd,&value,sizeof(value)) != -1 || errno != EAGAIN ) result = -1;
+  if ( read(wfd,&value,sizeof(value)) != sizeof(value) || value != 1 ) result = -1;
   
-  if ( data != 10 ) result = -1;
+  // three puts, one write
+  for (data = 0; data < 3; data++)
+    circular_buf_put(cbuf,&data);
+  if ( read(rfd,&value,sizeof(value)) != sizeof(value) || value != 1 ) result = -1;
+  circular_buf_put(cbuf,&data);
+  if ( read(rfd,&value,sizeof(value)) != -1 ) result = -1; // not acked yet
+  circular_buf_event_ack(cbuf,CBUF_EVENT_READABLE);
+  while (circular_buf_get(cbuf,&data) == 0)
+    ;
+  circular_buf_put(cbuf,&data);
+  if ( read(rfd,&value,sizeof(value)) != sizeof(value) || value != 1 ) result = -1;
   
+  // full: writable again only once a get frees a slot after the ack
+  for (data = 0; data < 7; data++)
+    circular_buf_put(cbuf,&data);
+  circular_buf_event_ack(cbuf,CBUF_EVENT_WRITABLE);
+  if ( circular_buf_put(cbuf,&data) != -1 || read(wfd,&value,sizeof(value)) != -1 ) result = -1;
   circular_buf_get(cbuf,&data);
+  if ( read(wfd,&value,sizeof(value)) != sizeof(value) || value != 1 ) result = -1;
+  circular_buf_free(cbuf);
   
-  if ( data != 20 ) result = -1;
+  if ( circular_buf_event_fd(cbuf = circular_buf_init_flags(8,sizeof(uint32_t),0),CBUF_EVENT_READABLE) != -1 ) result = -1;
+  circular_buf_free(cbuf);
+  
+  // a consumer on epoll and a producer on epoll, each only sleeping in epoll_wait
+  if ( (cbufEventfd = circular_buf_init_flags(64,sizeof(uint32_t),FCBUF_EVENTFD|FCBUF_DO_NOT_OVERWRITE)) == NULL ) return -1;
+  ep = epoll_create1(EPOLL_CLOEXEC);
+  epoll_ctl(ep,EPOLL_CTL_ADD,circular_buf_event_fd(cbufEventfd,CBUF_EVENT_READABLE),&ev);
+  pthread_create(&producer,NULL,&circular_buf_eventfd_producer,&producerResult);
+  while (expected < EVENTFDITEMS) {
+    if (epoll_wait(ep,&ev,1,5000) != 1) { result = -1; break; }
+    circular_buf_event_ack(cbufEventfd,CBUF_EVENT_READABLE);
+    while (circular_buf_get(cbufEventfd,&data) == 0)
+      if (data != expected++) result = -1;
+  }
+  pthread_join(producer,NULL);
+  close(ep);
+  circular_buf_free(cbufEventfd);
+  
+  return (producerResult == 0) ? result : -1;
+}
+
+#define SHMITEMS 100000
+
+static int test_cbuffer_shm(); // ring in shared memory: two handles, a producer process, and processes dying in the middle of a copy
+
+static int test_cbuffer_shm()
+{
+  char name[64];
+  uint32_t data, i, pos;
+  cbuf_handle_t cbuf, other;
+  pid_t child;
+  int status, result = 0;
+  
+  snprintf(name,sizeof(name),"/cbuf_test_%d",(int)getpid());
+  shm_unlink(name);
+  if ( (cbuf = circular_buf_init_shm(name,6,sizeof(uint32_t),0)) == NULL ) return -1;
+  if ( circular_buf_capacity(cbuf) != 8 || !circular_buf_empty(cbuf) ) result = -1;
+  
+  // a second handle on the same object, as another process would have
+  if ( (other = circular_buf_init_shm(name,1000,sizeof(uint32_t),0)) == NULL ) { circular_buf_free(cbuf); shm_unlink(name); return -1; }
+  if ( circular_buf_capacity(other) != 8 || circular_buf_init_shm(name,8,sizeof(uint64_t),0) != NULL ) result = -1;
+  for (data = 0; data < 10; data++)
+    if ( circular_buf_put(cbuf,&data) != (data < 8 ? 0 : -1) ) result = -1;
+  if ( !circular_buf_full(other) || circular_buf_size(other) != 8 ) result = -1;
+  for (i = 0; i < 8; i++)
+    if ( circular_buf_get(other,&data) != 0 || data != i ) result = -1;
+  if ( circular_buf_get(other,&data) != -1 ) result = -1;
+  circular_buf_free(other);
+  
+  // a producer process
+  if ( (child = fork()) == 0 ) {
+    cbuf_handle_t producer = circular_buf_init_shm(name,0,sizeof(uint32_t),0);
+    for (data = 0; producer && data < SHMITEMS; )
+      if (circular_buf_put(producer,&data) == 0) data++;
+      else sched_yield();
+    _exit(producer ? 0 : 1);
+  }
+  for (i = 0; i < SHMITEMS; ) {
+    if (circular_buf_get(cbuf,&data) != 0) { sched_yield(); continue; }
+    if (data != i++) result = -1;
+    if (result) break;
+  }
+  if ( waitpid(child,&status,0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0 ) result = -1;
   
-  circular_buf_get(cbuf,&data);
+  // a producer dies between claiming a slot and publishing it: skipped once it has been reaped
+  data = 1;
+  circular_buf_put(cbuf,&data);
+  if ( (child = fork()) == 0 ) {
+    pos = (uint32_t)cbuf->shm->head;
+    cbuf->seq[pos & cbuf->mask] = CBUF_SHM_WORD(pos,CBUF_SHM_WRITING,getpid()); // claimed, head not moved yet
+    _exit(0);
+  }
+  waitpid(child,&status,0);
+  data = 2;
+  circular_buf_put(cbuf,&data); // moves head past the dead claim
+  if ( circular_buf_get(cbuf,&data) != 0 || data != 1 ) result = -1;
+  if ( circular_buf_get(cbuf,&data) != 0 || data != 2 || circular_buf_get_overwrites(cbuf) != 1 ) result = -1;
   
-  if ( data != 30 ) result = -1;
+  // the same, but a get finds the dead claim before any put: it moves head along with tail
+  if ( (child = fork()) == 0 ) {
+    pos = (uint32_t)cbuf->shm->head;
+    cbuf->seq[pos & cbuf->mask] = CBUF_SHM_WORD(pos,CBUF_SHM_WRITING,getpid());
+    _exit(0);
+  }
+  waitpid(child,&status,0);
+  if ( circular_buf_get(cbuf,&data) != -1 || circular_buf_get_overwrites(cbuf) != 2 ) result = -1;
+  if ( cbuf->shm->head != cbuf->shm->tail || !circular_buf_empty(cbuf) ) result = -1;
+  data = 3;
+  if ( circular_buf_put(cbuf,&data) != 0 || circular_buf_get(cbuf,&data) != 0 || data != 3 ) result = -1;
   
-  // get all elements
-  /*
-  printf("result after compare reading order %d\n",result);
-  printf("get overwrites: %d\n",circular_buf_get_overwrites(cbuf));
-  printf("get size: %d\n",circular_buf_size(cbuf));
-  printf("get if is full:%d\n",circular_buf_full(cbuf));
-  */
-  if ( ( circular_buf_get_overwrites(cbuf) == 0 ) && (circular_buf_size(cbuf) == 0 ) && (circular_buf_full(cbuf)==0) && (result == 0))
-    result = 0;
-  else
-    result = -1;  
-    
-  circular_buf_free(cbuf); 
+  // a consumer dies in the middle of a get of a full ring: the next put takes the slot back
+  for (data = 0; data < 8; data++)
+    circular_buf_put(cbuf,&data);
+  if ( (child = fork()) == 0 ) {
+    pos = (uint32_t)cbuf->shm->tail;
+    cbuf->seq[pos & cbuf->mask] = CBUF_SHM_WORD(pos,CBUF_SHM_READING,getpid());
+    _exit(0);
+  }
+  waitpid(child,&status,0);
+  data = 8;
+  if ( circular_buf_put(cbuf,&data) != 0 || circular_buf_get_overwrites(cbuf) != 3 ) result = -1;
+  for (i = 1; i <= 8; i++)
+    if ( circular_buf_get(cbuf,&data) != 0 || data != i ) result = -1;
+  if ( !circular_buf_empty(cbuf) ) result = -1;
   
+  circular_buf_free(cbuf);
+  shm_unlink(name);
+  if ( circular_buf_init_shm(name,8,sizeof(uint32_t),FCBUF_MPMC) != NULL ) result = -1;
   return result;
-
 }
 
-static int test_cbuffer_overwrite_resize_and_operate();
+static int test_cbuffer_elem_sizes(); // the fixed size item copies (4, 8, 16 bytes) and the generic one, in every put/get path
 
-static int test_cbuffer_overwrite_resize_and_operate() 
+static int test_cbuffer_elem_sizes()
 {
-  int cbufsize = 3;
-  uint32_t data = 10;
-  int result;
+  uint32_t sizes[] = { 4, 8, 16, 12 };
+  uint32_t modes[] = { 0, FCBUF_POW2, FCBUF_SPSC, FCBUF_MPMC };
+  uint8_t in[16], out[16];
+  uint32_t s, m, i, b;
+  int result = 0;
   
-  cbuf_handle_t cbuf = circular_buf_init(cbufsize,sizeof(uint32_t));
+  for (s = 0; s < 4; s++)
+    for (m = 0; m < 4; m++) {
+      cbuf_handle_t cbuf = circular_buf_init_flags(8,sizes[s],modes[m]);
+      if (cbuf == NULL) return -1;
+      for (i = 0; i < 20; i++) { // wraps twice
+        for (b = 0; b < 16; b++) in[b] = (uint8_t)(i*16 + b);
+        memset(out,0xEE,sizeof(out));
+        if ( circular_buf_put(cbuf,in) != 0 || circular_buf_get(cbuf,out) != 0 ) result = -1;
+        if ( memcmp(in,out,sizes[s]) != 0 || out[sizes[s] - 1] != in[sizes[s] - 1] ) result = -1;
+        if ( sizes[s] < 16 && out[sizes[s]] != 0xEE ) result = -1; // not a byte more
+      }
+      circular_buf_free(cbuf);
+    }
+  return result;
+}
+
+#define WAITITEMS 20
+static void *circular_buf_wait_producer(void* param) // helper of test_cbuffer_wait: puts 1..WAITITEMS with pauses
+{
+  cbuf_handle_t cbuf = param;
+  uint32_t i;
   
-  circular_buf_put(cbuf,(void *)&data);
-  data += 10;
-  circular_buf_put(cbuf,(void *)&data);
+  for (i = 1; i <= WAITITEMS; i++) {
+    if (i % 5 == 1) usleep(1000);
+    circular_buf_put_wait(cbuf,&i,0,CBUF_WAIT_YIELD);
+  }
+  return NULL;
+}
+
+static int test_cbuffer_wait(); // spin, spin then yield and spin then park all get every item in order, and time out
+
+static int test_cbuffer_wait()
+{
+  uint32_t strategies[] = { CBUF_WAIT_SPIN, CBUF_WAIT_YIELD, CBUF_WAIT_PARK, CBUF_WAIT_PARK };
+  uint32_t flags[] = { FCBUF_SPSC, FCBUF_DO_NOT_OVERWRITE, FCBUF_BLOCKING_GET|FCBUF_BLOCKING_PUT|FCBUF_MPMC, FCBUF_DO_NOT_OVERWRITE };
+  circular_buf_stats_t stats;
+  struct timespec t0, t1;
+  pthread_t producer;
+  uint32_t k, i, data;
+  int result = 0;
   
-  circular_buf_resize(cbuf,cbufsize+2);
-   
-  if ( (circular_buf_capacity(cbuf) == 5 ) && (!circular_buf_full(cbuf)) && (circular_buf_size(cbuf) == 2 ) )
-    result = 0;
-  else
-    result = -1;  
+  for (k = 0; k < 4; k++) {
+    cbuf_handle_t cbuf = circular_buf_init_flags(8,sizeof(uint32_t),flags[k]); // room for a burst, only the consumer waits
+    circular_buf_set_wait(cbuf,strategies[k],8);
     
-  circular_buf_get(cbuf,&data);
-  //printf("Resize ANd operate data1: %d\n",data);
-  circular_buf_get(cbuf,&data);
-  //printf("Resize ANd operate data2: %d\n",data);
-  
-  if ((circular_buf_capacity(cbuf) == 5 ) &&  (!circular_buf_full(cbuf)) && circular_buf_size(cbuf) == 0 && result == 0 )
-    result = 0;
-  else
-    result = -1;  
+    pthread_create(&producer, NULL, &circular_buf_wait_producer, cbuf);
+    for (i = 1; i <= WAITITEMS; i++)
+      if ( circular_buf_get_wait(cbuf,&data,1000000,strategies[k]) != 0 || data != i ) result = -1;
+    pthread_join(producer,NULL);
     
-  circular_buf_free(cbuf); 
+    // nothing will come now
+    clock_gettime(CLOCK_MONOTONIC,&t0);
+    if ( circular_buf_get_wait(cbuf,&data,5000,strategies[k]) != -1 ) result = -1;
+    clock_gettime(CLOCK_MONOTONIC,&t1);
+    if ( (t1.tv_sec - t0.tv_sec)*1000000000L + (t1.tv_nsec - t0.tv_nsec) < 5000000L ) result = -1;
     
-  return result;     	
+    if ( circular_buf_get_stats(cbuf,&stats) == 0 ) {
+      if ( stats.waitSpins == 0 || stats.waitNs < 5000000 ) result = -1;
+      if ( k == 0 && (stats.waitYields != 0 || stats.waitParks != 0) ) result = -1;
+      if ( k == 1 && (stats.waitYields == 0 || stats.waitParks != 0) ) result = -1;
+      if ( k == 2 && stats.waitParks == 0 ) result = -1;
+      if ( k == 3 && (stats.waitYields == 0 || stats.waitParks != 0) ) result = -1; // no FCBUF_BLOCKING_GET: yields
+    }
+    circular_buf_free(cbuf);
+  }
+  
+  // the ring's own strategy, through get_timed
+  cbuf_handle_t cbuf = circular_buf_init_flags(8,sizeof(uint32_t),FCBUF_BLOCKING_GET|FCBUF_DO_NOT_OVERWRITE);
+  circular_buf_set_wait(cbuf,CBUF_WAIT_YIELD,4);
+  pthread_create(&producer, NULL, &circular_buf_wait_producer, cbuf);
+  for (i = 1; i <= WAITITEMS; i++)
+    if ( circular_buf_get_timed(cbuf,&data,1000000) != 0 || data != i ) result = -1;
+  pthread_join(producer,NULL);
+  if ( circular_buf_get_stats(cbuf,&stats) == 0 && (stats.waitParks != 0 || stats.waitYields == 0) ) result = -1;
+  circular_buf_free(cbuf);
+  
+  return result;
 }
 
-static int test_cbuffer_overwrite_multiple_reading_threads() // one put, multiple gets simultaneously
+static int test_cbuffer_prio(); // highest lane first, FIFO within a lane, the quota, and a producer per lane
+
+#define PRIOITEMS 20000
+static cbuf_prio_handle_t cbufPrio;
+
+static void *circular_buf_prio_producer(void* param) // helper of test_cbuffer_prio: puts 1..PRIOITEMS into its lane
 {
+  uint32_t lane = (uint32_t)(uintptr_t)param;
+  uint32_t i;
+  
+  for (i = 1; i <= PRIOITEMS; i++)
+    while (circular_buf_prio_put(cbufPrio,lane,&i) != 0)
+      sched_yield();
+  return NULL;
+}
 
-  int cbufSize = 9000000;
-  uint32_t data;
-  bool result;
-  int i;
-  uint32_t *ptrCount[NUMBEROFTHREADS];
-  uint32_t sum = 0 ;
-  int thread;
-  clock_t startTime,endTime;
+static int test_cbuffer_prio()
+{
+  uint32_t data, lane, i, k;
+  uint32_t next[4] = { 1, 1, 1, 1 };
+  uint32_t got[3] = { 0, 0, 0 };
+  pthread_t producers[4];
+  int result = 0;
   
-  cbufglobal = circular_buf_init(cbufSize,sizeof(uint32_t));
-  startTime=clock();
-    
-  for (i=1;i<=cbufSize;i++)
-    circular_buf_put(cbufglobal,(void *)&i);
-   
-  for (thread = 0; thread < NUMBEROFTHREADS; thread++) 
-     pthread_create(&threads[thread], NULL, &circular_buf_get_all,NULL);
-   
-  for (thread = 0; thread < NUMBEROFTHREADS; thread++) 
-       pthread_join(threads[thread], (void **)&ptrCount[thread]);
+  if ( circular_buf_prio_init(65,8,sizeof(uint32_t),0) != NULL ) result = -1;
+  if ( circular_buf_prio_init(2,8,sizeof(uint32_t),FCBUF_BLOCKING_GET) != NULL ) result = -1;
   
-  for (thread = 0; thread < NUMBEROFTHREADS; thread++) {
-   
-     printf("Value of return count from thread %d is : %d; Percentage of Processing: %d % \n",thread,*ptrCount[thread],((*ptrCount[thread]*100)/cbufSize));
-     sum += *ptrCount[thread];
-   }
-   
-  printf("Value of return count from All Threads is : %d\n",sum);
-      
-  circular_buf_free(cbufglobal); 
+  cbuf_prio_handle_t prio = circular_buf_prio_init(3,1024,sizeof(uint32_t),FCBUF_DO_NOT_OVERWRITE);
   
-  endTime=clock();
-  printf("Time Elapsed: %.4f seconds\n",((double)(endTime - startTime)/CLOCKS_PER_SEC));
+  // bulk backlog in lane 0, then a few items in lanes 2 and 1: lane 2 comes out first, then 1, then 0
+  for (i = 0; i < 1000; i++)
+    circular_buf_prio_put(prio,0,&i);
+  for (i = 0; i < 3; i++) {
+    data = 100 + i;
+    circular_buf_prio_put(prio,1,&data);
+    data = 200 + i;
+    circular_buf_prio_put(prio,2,&data);
+  }
+  if ( circular_buf_prio_size(prio) != 1006 ) result = -1;
+  for (i = 0; i < 3; i++)
+    if ( circular_buf_prio_get(prio,&data,&lane) != 0 || lane != 2 || data != 200 + i ) result = -1;
   
-  if ( sum == cbufSize ) 
-    return 0;
-  else
-    return -1;  
-
+  // an urgent item put now is the very next one out
+  data = 300;
+  circular_buf_prio_put(prio,2,&data);
+  if ( circular_buf_prio_get(prio,&data,&lane) != 0 || lane != 2 || data != 300 ) result = -1;
+  
+  for (i = 0; i < 3; i++)
+    if ( circular_buf_prio_get(prio,&data,NULL) != 0 || data != 100 + i ) result = -1;
+  for (i = 0; i < 1000; i++)
+    if ( circular_buf_prio_get(prio,&data,&lane) != 0 || lane != 0 || data != i ) result = -1;
+  if ( circular_buf_prio_get(prio,&data,&lane) != -1 || circular_buf_prio_size(prio) != 0 ) result = -1;
+  
+  // quota 2 with all three lanes busy: 2, 2, then a lower lane, taking turns (1, then 0)
+  circular_buf_prio_set_quota(prio,2);
+  for (i = 0; i < 30; i++)
+    for (k = 0; k < 3; k++)
+      circular_buf_prio_put(prio,k,&i);
+  {
+    uint32_t expected[] = { 2, 2, 1, 2, 2, 0, 2, 2, 1 };
+    for (i = 0; i < 9; i++)
+      if ( circular_buf_prio_get(prio,&data,&lane) != 0 || lane != expected[i] ) result = -1;
+  }
+  while (circular_buf_prio_get(prio,&data,&lane) == 0) got[lane]++;
+  if ( got[2] != 24 || got[1] != 28 || got[0] != 29 ) result = -1;
+  circular_buf_prio_free(prio);
+  
+  // a producer per lane, one consumer: every item once, in order within its lane
+  cbufPrio = circular_buf_prio_init(4,64,sizeof(uint32_t),FCBUF_SPSC);
+  circular_buf_prio_set_quota(cbufPrio,8);
+  for (k = 0; k < 4; k++)
+    pthread_create(&producers[k], NULL, &circular_buf_prio_producer, (void *)(uintptr_t)k);
+  for (i = 0; i < 4*PRIOITEMS; ) {
+    if (circular_buf_prio_get(cbufPrio,&data,&lane) != 0) { sched_yield(); continue; }
+    if ( lane >= 4 || data != next[lane] ) result = -1;
+    else next[lane]++;
+    i++;
+  }
+  for (k = 0; k < 4; k++)
+    pthread_join(producers[k],NULL);
+  if ( circular_buf_prio_get(cbufPrio,&data,&lane) != -1 ) result = -1;
+  circular_buf_prio_free(cbufPrio);
+  
+  return result;
 }
 
-static int test_cbuffer_overwrite_multiple_RW_threads() // multiple puts and gets simultaneously
+static int test_cbuffer_scan(); // in place scan in at most two spans (one mirrored, one per chunk segmented), stop, aggregates
+
+typedef struct {
+  uint32_t spans;
+  uint32_t items;
+  uint32_t next; // value the next item must have
+  uint32_t stopAt; // stop after this many spans, 0 = never
+  int ok;
+} test_scan_state_t;
+
+static int test_scan_visit(const void * items, uint32_t n, void * arg) // helper of test_cbuffer_scan
 {
+  test_scan_state_t *st = arg;
+  const uint32_t *p = items;
+  uint32_t i;
+  
+  for (i = 0; i < n; i++)
+    if (p[i] != st->next++) st->ok = 0;
+  st->items += n;
+  return (++st->spans == st->stopAt) ? 7 : 0;
+}
 
-  int cbufSize = 90000000;
-  uint32_t data;
-  bool result;
-  int i;
-  uint32_t *ptrCount[NUMBEROFTHREADS];
-  uint32_t *ptrCountPut[NUMBEROFTHREADS];
-  uint32_t sum = 0 ;
-  uint32_t sumPut = 0;
-  int thread;
-  clock_t startTime, endTime;
+static int test_cbuffer_scan()
+{
+  uint32_t flags[] = { 0, FCBUF_POW2, FCBUF_MIRRORED, FCBUF_SEGMENTED };
+  uint32_t sizes[] = { 10, 8, 1024, 65536 }; // segmented: chunks of 16384 items
+  uint32_t spans[] = { 2, 2, 1, 5 }; // segmented: the rest of chunk 0, chunks 1 to 3, the start of chunk 0
+  circular_buf_aggregate_t agg;
+  test_scan_state_t st;
+  uint32_t k, i, data, lo, hi;
+  int result = 0;
   
-  cbufglobal = circular_buf_init(cbufSize,sizeof(uint32_t));
-  startTime = clock();
+  for (k = 0; k < 4; k++) {
+    cbuf_handle_t cbuf = circular_buf_init_flags(sizes[k],sizeof(uint32_t),flags[k]|FCBUF_DO_NOT_OVERWRITE);
+    uint32_t max = circular_buf_capacity(cbuf), skip = (k == 3) ? 10000 : max/2, count = max - skip + skip/2;
     
-  //for (i=1;i<=cbufSize;i++)
-  //  circular_buf_put(cbufglobal,(void *)&i);
-  
-  for (thread = 0; thread < NUMBEROFTHREADS; thread++) 
-     pthread_create(&threadsPut[thread], NULL, &circular_buf_put_all_sleep,NULL);
-   
-  for (thread = 0; thread < NUMBEROFTHREADS; thread++) 
-     pthread_create(&threads[thread], NULL, &circular_buf_get_all_sleep,NULL);
-   
-  for (thread = 0; thread < NUMBEROFTHREADS; thread++) 
-       pthread_join(threads[thread], (void **)&ptrCount[thread]);
-  
-  for (thread = 0; thread < NUMBEROFTHREADS; thread++) 
-       pthread_join(threadsPut[thread], (void **)&ptrCountPut[thread]);
-  
-  
-  for (thread = 0; thread < NUMBEROFTHREADS; thread++) {
-	sum += *ptrCount[thread];
-    sumPut += *ptrCountPut[thread];
-   }   
+    for (i = 0; i < max; i++)
+      circular_buf_put(cbuf,&i);
+    for (i = 0; i < skip; i++) // the items now wrap
+      circular_buf_get(cbuf,&data);
+    for (i = max; i < max + skip/2; i++)
+      circular_buf_put(cbuf,&i);
     
-   for (thread = 0; thread < NUMBEROFTHREADS; thread++) {
-   
-     printf("Value of return count from thread Read %d is : %d; Percentage of Processing: %d % \n",thread,*ptrCount[thread],((*ptrCount[thread]*100)/sum));
-     printf("Value of return count from thread Write %d is : %d; Percentage of Processing: %d % \n",thread,*ptrCountPut[thread],((*ptrCountPut[thread]*100)/sumPut));
-     
-  } 
+    memset(&st,0,sizeof(st));
+    st.next = skip;
+    st.ok = 1;
+    if ( circular_buf_scan(cbuf,test_scan_visit,&st) != 0 ) result = -1;
+    if ( !st.ok || st.spans != spans[k] || st.items != count || circular_buf_size(cbuf) != count ) result = -1;
+    
+    memset(&st,0,sizeof(st));
+    st.next = skip;
+    st.ok = 1;
+    st.stopAt = 1;
+    if ( circular_buf_scan(cbuf,test_scan_visit,&st) != 7 || st.spans != 1 || !st.ok ) result = -1;
+    
+    // items skip .. max + skip/2 - 1
+    lo = max;
+    hi = max + 1;
+    if ( circular_buf_aggregate(cbuf,CBUF_TYPE_U32,&lo,&hi,&agg) != 0 ) result = -1;
+    if ( agg.count != count || agg.min != skip || agg.max != max + skip/2 - 1 || agg.matches != 2 ) result = -1;
+    if ( agg.isum != (int64_t)(skip + max + skip/2 - 1)*count/2 || agg.sum != (double)agg.isum ) result = -1;
+    if ( circular_buf_aggregate(cbuf,CBUF_TYPE_F64,NULL,NULL,&agg) != -1 || agg.count != 0 ) result = -1; // 8 byte items only
+    
+    circular_buf_free(cbuf);
+  }
   
-  printf("Value of return count from All Threads Get is : %d\n",sum);
-  printf("Value of return count from All Threads Put is : %d\n",sumPut);    
-  circular_buf_free(cbufglobal); 
-  endTime=clock();
+  // signed and floating point items, NaNs and an empty buffer
+  {
+    int32_t ints[] = { -5, 7, -100, 3, 0, 42, -1, 8, 9, 10, -20 };
+    float floats[] = { 1.5f, -2.25f, __builtin_nanf(""), 10.0f, 0.5f };
+    double doubles[] = { 1e300, -1e300, 3.0 };
+    int32_t ilo = -5, ihi = 8;
+    float flo = 0.0f;
+    
+    cbuf_handle_t cbuf = circular_buf_init(16,sizeof(int32_t));
+    circular_buf_put_n(cbuf,ints,11);
+    if ( circular_buf_aggregate(cbuf,CBUF_TYPE_I32,&ilo,&ihi,&agg) != 0 ) result = -1;
+    if ( agg.count != 11 || agg.min != -100 || agg.max != 42 || agg.isum != -47 || agg.matches != 6 ) result = -1;
+    circular_buf_free(cbuf);
+    
+    cbuf = circular_buf_init(4,sizeof(float));
+    if ( circular_buf_aggregate(cbuf,CBUF_TYPE_F32,NULL,NULL,&agg) != 0 || agg.count != 0 || agg.min != __builtin_inf() ) result = -1;
+    circular_buf_put_n(cbuf,floats,5); // overwrites 1.5
+    if ( circular_buf_aggregate(cbuf,CBUF_TYPE_F32,&flo,NULL,&agg) != 0 ) result = -1;
+    if ( agg.count != 4 || agg.min != -2.25 || agg.max != 10.0 || agg.matches != 2 || agg.sum != 8.25 ) result = -1; // the NaN is not summed
+    circular_buf_free(cbuf);
+    
+    // NaNs inside the vector lanes too, for float and double
+    cbuf = circular_buf_init(32,sizeof(float));
+    for (i = 0; i < 20; i++) {
+      float f = (i == 3 || i == 12) ? __builtin_nanf("") : (float)i;
+      circular_buf_put(cbuf,&f);
+    }
+    if ( circular_buf_aggregate(cbuf,CBUF_TYPE_F32,NULL,NULL,&agg) != 0 ) result = -1;
+    if ( agg.count != 20 || agg.sum != 190 - 3 - 12 || agg.min != 0 || agg.max != 19 || agg.matches != 18 ) result = -1;
+    circular_buf_free(cbuf);
+    
+    cbuf = circular_buf_init(32,sizeof(double));
+    for (i = 0; i < 20; i++) {
+      double d = (i == 5) ? __builtin_nan("") : (double)i;
+      circular_buf_put(cbuf,&d);
+    }
+    if ( circular_buf_aggregate(cbuf,CBUF_TYPE_F64,NULL,NULL,&agg) != 0 ) result = -1;
+    if ( agg.count != 20 || agg.sum != 190 - 5 || agg.min != 0 || agg.max != 19 || agg.matches != 19 ) result = -1;
+    circular_buf_free(cbuf);
+    
+    cbuf = circular_buf_init(3,sizeof(double));
+    circular_buf_put_n(cbuf,doubles,3);
+    if ( circular_buf_aggregate(cbuf,CBUF_TYPE_F64,NULL,NULL,&agg) != 0 || agg.min != -1e300 || agg.max != 1e300 || agg.sum != 3.0 ) result = -1;
+    circular_buf_free(cbuf);
+  }
   
-  printf("Time Elapsed: %.4f seconds\n",((double)(endTime - startTime)/CLOCKS_PER_SEC));
+  // no in place scan without the lock
+  cbuf_handle_t cbuf = circular_buf_init_flags(8,sizeof(uint32_t),FCBUF_SPSC);
+  if ( circular_buf_scan(cbuf,test_scan_visit,&st) != -1 || circular_buf_aggregate(cbuf,CBUF_TYPE_U32,NULL,NULL,&agg) != -1 ) result = -1;
+  circular_buf_free(cbuf);
   
-  if ( sum == sumPut ) 
-    return 0;
-  else
-    return -1;  
-
+  return result;
 }
 
 void *circular_buf_get_all(void* param) 
@@ -767,8 +5607,376 @@ int test_cbuffer_overwrite()
   printf("Test CBuffer Overwrite : Resize and Operate: %s\n",(test_cbuffer_overwrite_resize_and_operate()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
   printf("Test CBuffer Overwrite : Multiple Threads Reading: %s\n",(test_cbuffer_overwrite_multiple_reading_threads()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
   printf("Test CBuffer Overwrite : Multiple Threads Read/Write: %s\n",(test_cbuffer_overwrite_multiple_RW_threads()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
+  printf("Test CBuffer SPSC : Full and Read Order: %s\n",(test_cbuffer_spsc_full_and_order()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
+  printf("Test CBuffer SPSC : Producer/Consumer Threads: %s\n",(test_cbuffer_spsc_threads()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
+  printf("Test CBuffer MPMC : Overwrite: %s\n",(test_cbuffer_mpmc_overwrite()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
+  printf("Test CBuffer MPMC : Multiple Threads Read/Write: %s\n",(test_cbuffer_mpmc_threads()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
+  printf("Test CBuffer Bulk : Put/Get N Items: %s\n",(test_cbuffer_bulk_put_get()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
+  printf("Test CBuffer Zero Copy : Reserve/Commit and Peek/Release: %s\n",(test_cbuffer_reserve_peek()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
+  printf("Test CBuffer Zero Copy : Puts and Gets Keep Off Reservations and Peeks: %s\n",(test_cbuffer_reserve_peek_guard()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
+  printf("Test CBuffer Mirrored : Wrapped Runs Are Contiguous: %s\n",(test_cbuffer_mirrored()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
+  printf("Test CBuffer Do Not Overwrite : Put on Full Buffer: %s\n",(test_cbuffer_do_not_overwrite()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
+  printf("Test CBuffer Blocking : Put/Get Wait and Timeout: %s\n",(test_cbuffer_blocking()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
+  printf("Test CBuffer Resize : Wrapped Items Keep Order: %s\n",(test_cbuffer_resize_wrapped()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
+  printf("Test CBuffer Resize : Auto Grow up to Limit: %s\n",(test_cbuffer_resize_auto()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
+  printf("Test CBuffer Resize : Grow While Reading: %s\n",(test_cbuffer_resize_concurrent()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
+  printf("Test CBuffer Records : Variable Size Items: %s\n",(test_cbuffer_records()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
+  printf("Test CBuffer Typed : uint32_t and float Rings: %s\n",(test_cbuffer_typed()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
+  printf("Test CBuffer Pow2 : Masked Free Running Indexes: %s\n",(test_cbuffer_pow2()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
+  printf("Test CBuffer Timestamp : Time Window Search: %s\n",(test_cbuffer_timestamp()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
+  printf("Test CBuffer Stats : Counters Snapshot: %s\n",(test_cbuffer_stats()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
+  printf("Test CBuffer Set : Sharded Put/Get and Stealing: %s\n",(test_cbuffer_set()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
+  printf("Test CBuffer Broadcast : Every Consumer Reads Every Item: %s\n",(test_cbuffer_broadcast()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
+  printf("Test CBuffer Persistent : Reopen and Crash: %s\n",(test_cbuffer_persistent()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
+  printf("Test CBuffer Alloc : Huge Pages, NUMA and Prefault: %s\n",(test_cbuffer_alloc_options()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
+  printf("Test CBuffer Segmented : Chunks Follow the Items: %s\n",(test_cbuffer_segmented()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
+  printf("Test CBuffer Snapshot : Latest Items Without the Lock: %s\n",(test_cbuffer_snapshot()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
+  printf("Test CBuffer Eventfd : Coalesced Readiness and Epoll: %s\n",(test_cbuffer_eventfd()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
+  printf("Test CBuffer Shared : Processes and Dead Claimants: %s\n",(test_cbuffer_shm()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
+  printf("Test CBuffer Copy : Fixed Size Items: %s\n",(test_cbuffer_elem_sizes()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
+  printf("Test CBuffer Wait : Spin, Yield and Park: %s\n",(test_cbuffer_wait()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
+  printf("Test CBuffer Prio : Lanes, Quota and Threads: %s\n",(test_cbuffer_prio()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
+  printf("Test CBuffer Scan : In Place Spans and Aggregates: %s\n",(test_cbuffer_scan()==0)?"\033[32;1;4m[OK]\033[0m":"\033[31;1;4m[NOK]\033[0m");
+}
+
+
+#ifdef CBUF_BENCHMARK
+
+// Benchmark (built with -DCBUF_BENCHMARK instead of the tests).
+// Producers and consumers hammer one buffer for a fixed number of items, with threads pinned to cores.
+// Reports wall clock items/s and per call latency percentiles, one CSV line or one JSON object per run,
+// so runs of different modes and releases can be compared. Latencies go to a log-linear histogram:
+// 16 sub buckets per power of two, i.e. a value is known within 1/16 (6%), percentiles print the bucket start.
+
+#define CBUF_BENCH_SUB 16
+#define CBUF_BENCH_BUCKETS (CBUF_BENCH_SUB + 60*CBUF_BENCH_SUB)
+
+typedef struct {
+	uint64_t count[CBUF_BENCH_BUCKETS];
+	uint64_t total;
+	uint64_t max;
+} cbuf_bench_hist_t;
+
+typedef struct {
+	const char *mode;
+	uint32_t flags;
+	uint32_t producers;
+	uint32_t consumers;
+	uint32_t elemSize;
+	uint32_t capacity;
+	uint32_t batch;
+	uint32_t shards; // > 0: a circular_buf_set_t of that many buffers instead of one buffer
+	uint64_t items; // per producer
+	int firstCpu; // -1 = do not pin
+	int wait; // CBUF_WAIT_* of single item put/get, -1 = try and sched_yield
+	uint32_t waitSpins;
+	bool json;
+	bool header;
+} cbuf_bench_config_t;
+
+typedef struct {
+	pthread_t thread;
+	cbuf_handle_t cbuf;
+	cbuf_set_handle_t set;
+	const cbuf_bench_config_t *config;
+	uint32_t cpu;
+	bool producer;
+	uint64_t items; // moved by this thread
+	cbuf_bench_hist_t hist;
+} cbuf_bench_thread_t;
+
+static volatile int cbufBenchGo;
+static volatile int cbufBenchProducersDone;
+
+static uint32_t cbuf_bench_bucket(uint64_t ns)
+{
+	uint32_t e;
+
+	if (ns < CBUF_BENCH_SUB) return (uint32_t)ns;
+	e = 63 - __builtin_clzll(ns); // >= 4
+	return CBUF_BENCH_SUB + (e - 4)*CBUF_BENCH_SUB + (uint32_t)((ns >> (e - 4)) - CBUF_BENCH_SUB);
+}
+
+static uint64_t cbuf_bench_bucket_value(uint32_t bucket)
+{
+	uint32_t e;
+
+	if (bucket < CBUF_BENCH_SUB) return bucket;
+	e = (bucket - CBUF_BENCH_SUB)/CBUF_BENCH_SUB + 4;
+	return (uint64_t)(CBUF_BENCH_SUB + (bucket - CBUF_BENCH_SUB)%CBUF_BENCH_SUB) << (e - 4);
+}
+
+static void cbuf_bench_record(cbuf_bench_hist_t *hist, uint64_t ns)
+{
+	hist->count[cbuf_bench_bucket(ns)]++;
+	hist->total++;
+	if (ns > hist->max) hist->max = ns;
+}
+
+static void cbuf_bench_merge(cbuf_bench_hist_t *dst, const cbuf_bench_hist_t *src)
+{
+	uint32_t i;
+
+	for (i = 0; i < CBUF_BENCH_BUCKETS; i++) dst->count[i] += src->count[i];
+	dst->total += src->total;
+	if (src->max > dst->max) dst->max = src->max;
+}
+
+static uint64_t cbuf_bench_percentile(const cbuf_bench_hist_t *hist, double p)
+{
+	uint64_t rank = (uint64_t)(p*hist->total), seen = 0;
+	uint32_t i;
+
+	if (hist->total == 0) return 0;
+	if (rank >= hist->total) rank = hist->total - 1;
+	for (i = 0; i < CBUF_BENCH_BUCKETS; i++)
+	{
+		seen += hist->count[i];
+		if (seen > rank) return cbuf_bench_bucket_value(i);
+	}
+	return hist->max;
+}
+
+static void *cbuf_bench_worker(void *param)
+{
+	cbuf_bench_thread_t *self = param;
+	const cbuf_bench_config_t *config = self->config;
+	char *data = calloc(config->batch,config->elemSize);
+	uint64_t start, now;
+	uint32_t done;
+
+	if (config->firstCpu >= 0)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(self->cpu,&set);
+		pthread_setaffinity_np(pthread_self(),sizeof(set),&set);
+	}
+
+	while (!__atomic_load_n(&cbufBenchGo,__ATOMIC_ACQUIRE))
+		sched_yield();
+
+	// the latency of a call includes its retries: that is what the caller waits for
+	if (self->producer)
+	{
+		while (self->items < config->items)
+		{
+			uint32_t n = config->batch;
+			if (n > config->items - self->items) n = (uint32_t)(config->items - self->items);
+			start = circular_buf_now_ns();
+			for (;;)
+			{
+				if (self->set) done = (circular_buf_set_put(self->set,data) == 0);
+				else if (n == 1 && config->wait >= 0) done = (circular_buf_put_wait(self->cbuf,data,0,config->wait) == 0);
+				else done = (n == 1) ? (circular_buf_put(self->cbuf,data) == 0) : circular_buf_put_n(self->cbuf,data,n);
+				if (done) break;
+				sched_yield(); // full and not overwriting
+			}
+			now = circular_buf_now_ns();
+			cbuf_bench_record(&self->hist,now - start);
+			self->items += done;
+		}
+	}
+	else
+	{
+		for (;;)
+		{
+			start = circular_buf_now_ns();
+			if (self->set) done = circular_buf_set_get_n(self->set,data,config->batch);
+			else if (config->batch == 1 && config->wait >= 0) done = (circular_buf_get_wait(self->cbuf,data,1000,config->wait) == 0); // 1 ms, then look whether the producers are done
+			else done = (config->batch == 1) ? (circular_buf_get(self->cbuf,data) == 0) : circular_buf_get_n(self->cbuf,data,config->batch);
+			now = circular_buf_now_ns();
+			if (done)
+			{
+				cbuf_bench_record(&self->hist,now - start);
+				self->items += done;
+			}
+			else if (__atomic_load_n(&cbufBenchProducersDone,__ATOMIC_ACQUIRE) &&
+			         (self->set ? circular_buf_set_size(self->set) == 0 : circular_buf_empty(self->cbuf)))
+				break;
+			else
+				sched_yield();
+		}
+	}
+
+	free(data);
+	return NULL;
+}
+
+static void cbuf_bench_usage(const char *name)
+{
+	printf("usage: %s [options]\n"
+	       "  -m mode       mutex | pow2 | spsc | mpmc | mirrored (default mutex)\n"
+	       "  -x flags      extra FCBUF_ flags, hex, or'ed with the mode\n"
+	       "  -p n          producer threads (default 1)\n"
+	       "  -c n          consumer threads (default 1)\n"
+	       "  -e bytes      element size (default 4)\n"
+	       "  -s n          capacity in elements, per shard with -S (default 1024)\n"
+	       "  -S n          sharded set of n buffers (circular_buf_set_init), batches only apply to gets (default 0 = one buffer)\n"
+	       "  -b n          items per put/get call, > 1 uses put_n/get_n (default 1)\n"
+	       "  -n n          items per producer (default 1000000)\n"
+	       "  -o policy     overwrite | block: overwrite the oldest or retry until there is room (default block)\n"
+	       "  -a cpu        pin threads to cores starting at cpu, -1 = no pinning (default 0)\n"
+	       "  -w wait       spin | yield | park[:spins]: single item calls wait with circular_buf_put_wait/get_wait\n"
+	       "                instead of retrying with sched_yield, park adds FCBUF_BLOCKING_GET|FCBUF_BLOCKING_PUT\n"
+	       "  -j            JSON instead of CSV\n"
+	       "  -H            print the CSV header line first\n",name);
+}
+
+static int cbuf_bench_main(int argc, char** argv)
+{
+	cbuf_bench_config_t config = { "mutex", 0, 1, 1, sizeof(uint32_t), 1024, 1, 0, 1000000, 0, -1, 0, false, false };
+	cbuf_bench_thread_t *workers;
+	cbuf_bench_hist_t putHist, getHist;
+	cbuf_handle_t cbuf;
+	cbuf_set_handle_t set = NULL;
+	uint64_t start, elapsed, produced = 0, consumed = 0, overwrites;
+	uint32_t extra = 0, i, total;
+	const char *wait = "none";
+	struct rusage usage0, usage1;
+	double cpuSeconds;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	bool overwrite = false;
+	double seconds;
+	int opt;
+
+	while ((opt = getopt(argc,argv,"m:x:p:c:e:s:S:b:n:o:a:w:jHh")) != -1)
+	{
+		switch (opt)
+		{
+			case 'm': config.mode = optarg; break;
+			case 'x': extra = (uint32_t)strtoul(optarg,NULL,16); break;
+			case 'p': config.producers = (uint32_t)strtoul(optarg,NULL,10); break;
+			case 'c': config.consumers = (uint32_t)strtoul(optarg,NULL,10); break;
+			case 'e': config.elemSize = (uint32_t)strtoul(optarg,NULL,10); break;
+			case 's': config.capacity = (uint32_t)strtoul(optarg,NULL,10); break;
+			case 'S': config.shards = (uint32_t)strtoul(optarg,NULL,10); break;
+			case 'b': config.batch = (uint32_t)strtoul(optarg,NULL,10); break;
+			case 'n': config.items = strtoull(optarg,NULL,10); break;
+			case 'o': overwrite = (strcmp(optarg,"overwrite") == 0); break;
+			case 'a': config.firstCpu = atoi(optarg); break;
+			case 'w': wait = optarg; break;
+			case 'j': config.json = true; break;
+			case 'H': config.header = true; break;
+			default: cbuf_bench_usage(argv[0]); return (opt == 'h') ? 0 : 1;
+		}
+	}
+
+	if      (strcmp(config.mode,"mutex") == 0)    config.flags = 0;
+	else if (strcmp(config.mode,"pow2") == 0)     config.flags = FCBUF_POW2;
+	else if (strcmp(config.mode,"spsc") == 0)     config.flags = FCBUF_SPSC;
+	else if (strcmp(config.mode,"mpmc") == 0)     config.flags = FCBUF_MPMC;
+	else if (strcmp(config.mode,"mirrored") == 0) config.flags = FCBUF_MIRRORED;
+	else { cbuf_bench_usage(argv[0]); return 1; }
+	if      (strcmp(wait,"none") == 0)      config.wait = -1;
+	else if (strcmp(wait,"spin") == 0)      config.wait = CBUF_WAIT_SPIN;
+	else if (strncmp(wait,"yield",5) == 0)  config.wait = CBUF_WAIT_YIELD;
+	else if (strncmp(wait,"park",4) == 0) { config.wait = CBUF_WAIT_PARK; config.flags |= FCBUF_BLOCKING_GET|FCBUF_BLOCKING_PUT; }
+	else { cbuf_bench_usage(argv[0]); return 1; }
+	if (strchr(wait,':')) config.waitSpins = (uint32_t)strtoul(strchr(wait,':') + 1,NULL,10);
+	config.flags |= extra | (overwrite ? FCBUF_OVERWRITE : FCBUF_DO_NOT_OVERWRITE);
+
+	if ( config.producers == 0 || config.consumers == 0 || config.batch == 0 || config.elemSize == 0 ||
+	     ((config.flags & FCBUF_SPSC) && (config.producers != 1 || config.consumers != 1)) )
+	{
+		fprintf(stderr,"invalid thread/batch/element configuration for mode %s\n",config.mode);
+		return 1;
+	}
+
+	if (config.shards)
+	{
+		set = circular_buf_set_init(config.shards,config.capacity,config.elemSize,config.flags);
+		cbuf = set ? circular_buf_set_shard(set,0) : NULL;
+	}
+	else
+		cbuf = circular_buf_init_flags(config.capacity,config.elemSize,config.flags);
+	if (cbuf == NULL)
+	{
+		fprintf(stderr,"circular_buf_init_flags(%u,%u,0x%04x) failed\n",config.capacity,config.elemSize,config.flags);
+		return 1;
+	}
+	if (config.wait >= 0) circular_buf_set_wait(cbuf,(uint32_t)config.wait,config.waitSpins);
+
+	total = config.producers + config.consumers;
+	workers = calloc(total,sizeof(cbuf_bench_thread_t));
+	for (i = 0; i < total; i++)
+	{
+		workers[i].cbuf = cbuf;
+		workers[i].set = set;
+		workers[i].config = &config;
+		workers[i].producer = (i < config.producers);
+		workers[i].cpu = (config.firstCpu < 0 || cpus < 1) ? 0 : (uint32_t)((config.firstCpu + i) % cpus);
+		pthread_create(&workers[i].thread,NULL,&cbuf_bench_worker,&workers[i]);
+	}
+
+	getrusage(RUSAGE_SELF,&usage0);
+	start = circular_buf_now_ns();
+	__atomic_store_n(&cbufBenchGo,1,__ATOMIC_RELEASE);
+	for (i = 0; i < config.producers; i++)
+		pthread_join(workers[i].thread,NULL);
+	__atomic_store_n(&cbufBenchProducersDone,1,__ATOMIC_RELEASE);
+	for (i = config.producers; i < total; i++)
+		pthread_join(workers[i].thread,NULL);
+	elapsed = circular_buf_now_ns() - start;
+	seconds = elapsed/1e9;
+	getrusage(RUSAGE_SELF,&usage1);
+	cpuSeconds = (usage1.ru_utime.tv_sec - usage0.ru_utime.tv_sec) + (usage1.ru_stime.tv_sec - usage0.ru_stime.tv_sec) +
+	             ((usage1.ru_utime.tv_usec - usage0.ru_utime.tv_usec) + (usage1.ru_stime.tv_usec - usage0.ru_stime.tv_usec))/1e6;
+
+	memset(&putHist,0,sizeof(putHist));
+	memset(&getHist,0,sizeof(getHist));
+	for (i = 0; i < total; i++)
+	{
+		if (workers[i].producer) { produced += workers[i].items; cbuf_bench_merge(&putHist,&workers[i].hist); }
+		else { consumed += workers[i].items; cbuf_bench_merge(&getHist,&workers[i].hist); }
+	}
+	overwrites = circular_buf_get_overwrites(cbuf);
+	for (i = 1; i < config.shards; i++)
+		overwrites += circular_buf_get_overwrites(circular_buf_set_shard(set,i));
+
+	if (config.json)
+		printf("{\"mode\":\"%s\",\"flags\":\"0x%04x\",\"producers\":%u,\"consumers\":%u,\"elem_size\":%u,\"capacity\":%u,"
+		       "\"shards\":%u,\"batch\":%u,\"overwrite\":%s,\"pinned\":%s,\"wait\":\"%s\",\"seconds\":%.6f,\"cpu_seconds\":%.6f,\"produced\":%llu,\"consumed\":%llu,"
+		       "\"overwrites\":%llu,\"put_items_per_sec\":%.0f,\"get_items_per_sec\":%.0f,"
+		       "\"put_ns\":{\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu},"
+		       "\"get_ns\":{\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}}\n",
+		       config.mode,config.flags,config.producers,config.consumers,config.elemSize,circular_buf_capacity(cbuf),
+		       config.shards,config.batch,overwrite ? "true" : "false",(config.firstCpu >= 0) ? "true" : "false",wait,seconds,cpuSeconds,
+		       (unsigned long long)produced,(unsigned long long)consumed,(unsigned long long)overwrites,
+		       produced/seconds,consumed/seconds,
+		       (unsigned long long)cbuf_bench_percentile(&putHist,0.50),(unsigned long long)cbuf_bench_percentile(&putHist,0.99),
+		       (unsigned long long)cbuf_bench_percentile(&putHist,0.999),(unsigned long long)putHist.max,
+		       (unsigned long long)cbuf_bench_percentile(&getHist,0.50),(unsigned long long)cbuf_bench_percentile(&getHist,0.99),
+		       (unsigned long long)cbuf_bench_percentile(&getHist,0.999),(unsigned long long)getHist.max);
+	else
+	{
+		if (config.header)
+			printf("mode,flags,producers,consumers,elem_size,capacity,shards,batch,overwrite,pinned,wait,seconds,cpu_seconds,produced,consumed,overwrites,"
+			       "put_items_per_sec,get_items_per_sec,put_p50_ns,put_p99_ns,put_p999_ns,put_max_ns,"
+			       "get_p50_ns,get_p99_ns,get_p999_ns,get_max_ns\n");
+		printf("%s,0x%04x,%u,%u,%u,%u,%u,%u,%d,%d,%s,%.6f,%.6f,%llu,%llu,%llu,%.0f,%.0f,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu\n",
+		       config.mode,config.flags,config.producers,config.consumers,config.elemSize,circular_buf_capacity(cbuf),
+		       config.shards,config.batch,overwrite,(config.firstCpu >= 0),wait,seconds,cpuSeconds,
+		       (unsigned long long)produced,(unsigned long long)consumed,(unsigned long long)overwrites,
+		       produced/seconds,consumed/seconds,
+		       (unsigned long long)cbuf_bench_percentile(&putHist,0.50),(unsigned long long)cbuf_bench_percentile(&putHist,0.99),
+		       (unsigned long long)cbuf_bench_percentile(&putHist,0.999),(unsigned long long)putHist.max,
+		       (unsigned long long)cbuf_bench_percentile(&getHist,0.50),(unsigned long long)cbuf_bench_percentile(&getHist,0.99),
+		       (unsigned long long)cbuf_bench_percentile(&getHist,0.999),(unsigned long long)getHist.max);
+	}
+
+	free(workers);
+	if (set) circular_buf_set_free(set);
+	else circular_buf_free(cbuf);
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+  return cbuf_bench_main(argc,argv);
 }
 
+#else
 
 int main(int argc, char** argv)
 {
@@ -862,3 +6070,5 @@ int main(int argc, char** argv)
  */
   exit(0);
 }
+
+#endif // CBUF_BENCHMARK